@@ -0,0 +1,265 @@
+-- Benchmark driver of lua-xz.
+--
+-- Measures the throughput (MB/s), the compression ratio,
+-- the peak RSS and the Lua GC allocations of `stream:exec'
+-- on deterministic corpora (see corpus.lua), sweeping one
+-- parameter at a time around a baseline:
+--
+--   * presets: 0 - 9 (and 0e - 9e on the full mode);
+--   * output buffer sizes of `exec';
+--   * producer chunk sizes;
+--   * number of threads.
+--
+-- Every measurement is written as a JSON object per line,
+-- tagged with the versions of Lua, liblzma and lua-xz, so
+-- that the results of different releases and Lua versions
+-- can be tracked and compared.
+--
+-- usage:
+--
+--     lua benchmarks/bench.lua [quick | full] [results.jsonl] [size_mb]
+--     lua benchmarks/bench.lua corpus <directory> [size_mb]
+--
+-- The second form only writes the corpora to files,
+-- to be measured by the C harness (see harness.c).
+
+local script_dir = (arg and arg[0] or ""):match("^(.*[/\\])") or "./"
+package.path = script_dir .. "?.lua;" .. package.path
+
+local corpus = require("corpus")
+
+local mode = arg and arg[1] or "quick"
+
+--[[ start of corpus mode ]]
+if (mode == "corpus") then
+    local directory = assert(arg[2], "missing the output directory of the corpora")
+    local size = (tonumber(arg[3]) or 4) * 1024 * 1024
+    for _, name in ipairs(corpus.names) do
+        local filename = directory .. "/" .. name .. ".bin"
+        local output = assert(io.open(filename, "wb"), "failed to open " .. filename .. " file for writing")
+        output:write(corpus.generate(name, size))
+        output:close()
+    end
+    return
+end
+--[[ end of corpus mode ]]
+
+assert(mode == "quick" or mode == "full", "mode must be quick, full or corpus")
+
+local xz = require("lua-xz")
+
+local output = io.stdout
+if (arg[2] and arg[2] ~= "-") then
+    output = assert(io.open(arg[2], "w"), "failed to open " .. arg[2] .. " file for writing")
+end
+
+local size = (tonumber(arg[3]) or (mode == "full" and 32 or 4)) * 1024 * 1024
+
+--[[ start of measurement helpers ]]
+
+-- keys of each result, in the order they are written
+local keys = {
+    "suite", "lua", "liblzma", "binding", "sweep", "corpus", "size",
+    "operation", "preset", "threads", "buffer_size", "chunk_size",
+    "input_bytes", "output_bytes", "ratio", "seconds", "cpu_seconds",
+    "mb_per_s", "code_seconds", "producer_seconds", "consumer_seconds",
+    "gc_kb", "memusage", "peak_rss_kb"
+}
+
+local function json_value(value)
+    local t = type(value)
+    if (t == "nil") then
+        return "null"
+    elseif (t == "number") then
+        if (value ~= value or value == math.huge or value == -math.huge) then
+            return "null"
+        elseif (value == math.floor(value) and math.abs(value) < 2 ^ 53) then
+            return ("%d"):format(value)
+        end
+        return ("%.6g"):format(value)
+    elseif (t == "boolean") then
+        return tostring(value)
+    end
+    return ('"%s"'):format(tostring(value):gsub('[%c"\\]', function(c)
+        return ("\\u%04x"):format(c:byte())
+    end))
+end
+
+local function write_result(result)
+    local fields = {}
+    for _, key in ipairs(keys) do
+        fields[#fields + 1] = ('"%s":%s'):format(key, json_value(result[key]))
+    end
+    output:write("{", table.concat(fields, ","), "}\n")
+    output:flush()
+end
+
+-- peak resident set size (in KB), on Linux
+local function peak_rss()
+    local status = io.open("/proc/self/status", "r")
+    if (status) then
+        local content = status:read("*a")
+        status:close()
+        return tonumber(content:match("VmHWM:%s*(%d+)"))
+    end
+    return nil
+end
+
+-- resets the peak resident set size, on Linux 4.0 or newer
+local function reset_peak_rss()
+    local clear_refs = io.open("/proc/self/clear_refs", "w")
+    if (clear_refs) then
+        clear_refs:write("5")
+        clear_refs:close()
+    end
+end
+
+local lua_version = _VERSION
+if (type(jit) == "table" and jit.version) then
+    lua_version = jit.version
+end
+
+-- runs `stream' on `data', returning the measurements
+-- and, when `keep' is true, the output
+local function measure(stream, data, chunk_size, buffer_size, keep)
+    local position = 1
+    local outputs = {}
+    local output_bytes = 0
+
+    local function producer()
+        local chunk
+        if (position <= #data) then
+            chunk = data:sub(position, position + chunk_size - 1)
+            position = position + chunk_size
+        end
+        return chunk
+    end
+
+    local function consumer(chunk)
+        output_bytes = output_bytes + #chunk
+        if (keep) then
+            outputs[#outputs + 1] = chunk
+        end
+    end
+
+    collectgarbage("collect")
+    reset_peak_rss()
+
+    -- the collector is stopped so that the
+    -- growth of the heap gives the amount of
+    -- memory allocated by Lua during exec
+    collectgarbage("stop")
+    local gc_before = collectgarbage("count")
+    local start = os.clock()
+
+    stream:exec(producer, consumer, { buffersize = buffer_size })
+
+    local cpu_seconds = os.clock() - start
+    local gc_kb = collectgarbage("count") - gc_before
+    collectgarbage("restart")
+
+    local stats = stream:stats()
+    stream:close()
+
+    local result = {
+        input_bytes = #data,
+        output_bytes = output_bytes,
+        cpu_seconds = cpu_seconds,
+        code_seconds = stats.time_code,
+        producer_seconds = stats.time_producer,
+        consumer_seconds = stats.time_consumer,
+        seconds = stats.time_code + stats.time_producer + stats.time_consumer,
+        gc_kb = gc_kb,
+        memusage = stats.memusage,
+        peak_rss_kb = peak_rss()
+    }
+
+    return result, keep and table.concat(outputs) or nil
+end
+
+-- measures the compression and the decompression
+-- of `data' with the given configuration
+local function run(sweep, name, data, preset, threads, buffer_size, chunk_size)
+    local options = threads and { threads = threads } or nil
+    local writer = xz.stream.xzwriter(preset, xz.check.CRC64, options)
+    local compressed_result, compressed = measure(writer, data, chunk_size, buffer_size, true)
+
+    local reader = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0, options)
+    local decompressed_result = measure(reader, compressed, chunk_size, buffer_size, false)
+
+    assert(decompressed_result.output_bytes == #data, "decompressed size mismatch")
+
+    compressed_result.operation = "compress"
+    decompressed_result.operation = "decompress"
+
+    for _, result in ipairs({ compressed_result, decompressed_result }) do
+        result.suite = "lua"
+        result.lua = lua_version
+        result.liblzma = xz._VERSION
+        result.binding = xz.version
+        result.sweep = sweep
+        result.corpus = name
+        result.size = #data
+        result.preset = tostring(preset)
+        result.threads = threads and tostring(threads) or nil
+        result.buffer_size = buffer_size
+        result.chunk_size = chunk_size
+        result.ratio = #compressed / #data
+        result.mb_per_s = result.seconds > 0 and (#data / (1024 * 1024)) / result.seconds or nil
+        write_result(result)
+    end
+end
+--[[ end of measurement helpers ]]
+
+--[[ start of sweeps ]]
+
+-- baseline of the sweeps: a nil buffer size
+-- stands for LUA_XZ_BUFFER_SIZE, and 8 KB is the
+-- chunk size used by the samples
+local baseline_preset = 6
+local baseline_chunk_size = 8 * 1024
+
+-- the sweeps of buffer and chunk sizes use preset 0,
+-- where the cost of the binding is not hidden by
+-- the cost of the compression itself
+local fast_preset = 0
+
+local presets = { 0, 1, 3, 6, 9 }
+if (mode == "full") then
+    presets = {}
+    for level = 0, 9 do
+        presets[#presets + 1] = level
+    end
+    for level = 0, 9 do
+        presets[#presets + 1] = level .. "e"
+    end
+end
+
+local buffer_sizes = { false, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 }
+local chunk_sizes = { 1024, 8 * 1024, 64 * 1024, 1024 * 1024 }
+local thread_counts = { 1, 2, 4, "auto" }
+
+for _, name in ipairs(corpus.names) do
+    local data = corpus.generate(name, size)
+
+    for _, preset in ipairs(presets) do
+        run("preset", name, data, preset, nil, nil, baseline_chunk_size)
+    end
+
+    for _, buffer_size in ipairs(buffer_sizes) do
+        run("buffer_size", name, data, fast_preset, nil, buffer_size or nil, baseline_chunk_size)
+    end
+
+    for _, chunk_size in ipairs(chunk_sizes) do
+        run("chunk_size", name, data, fast_preset, nil, nil, chunk_size)
+    end
+
+    for _, threads in ipairs(thread_counts) do
+        run("threads", name, data, baseline_preset, threads, 1024 * 1024, 1024 * 1024)
+    end
+end
+--[[ end of sweeps ]]
+
+if (output ~= io.stdout) then
+    output:close()
+end
@@ -0,0 +1,143 @@
+-- Deterministic corpora for the benchmarks.
+--
+-- Every corpus is generated from a Park-Miller
+-- random number generator, whose state never
+-- exceeds 2^46 during the computation. Thus, the
+-- same bytes are produced on Lua 5.1 - 5.4 and
+-- LuaJIT, either with floats or integers.
+
+local corpus = {}
+
+local unpack = unpack or table.unpack
+
+-- names of the corpora, in the order they are benchmarked
+corpus.names = { "text", "json", "binary", "random" }
+
+-- returns a function giving integers
+-- in [0, n) on each call, from a seed
+-- in [1, 2147483646]
+function corpus.random(seed)
+    local state = seed
+    return function(n)
+        state = (state * 16807) % 2147483647
+        return state % n
+    end
+end
+
+local new_random = corpus.random
+
+-- concatenates the pieces produced by `piece'
+-- until `size' bytes are reached
+local function build(size, piece)
+    local parts = {}
+    local length = 0
+    while (length < size) do
+        local p = piece()
+        parts[#parts + 1] = p
+        length = length + #p
+    end
+    return table.concat(parts):sub(1, size)
+end
+
+-- english-like text with a skewed word distribution
+local function text(size)
+    local random = new_random(1)
+    local words = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+        "compression", "stream", "dictionary", "encoder", "decoder", "block",
+        "buffer", "producer", "consumer", "memory", "thread", "preset",
+        "lorem", "ipsum", "dolor", "amet", "consectetur", "adipiscing"
+    }
+    local count = 0
+    return build(size, function()
+        -- the product of two uniform
+        -- values favours the first words
+        local word = words[(random(#words) * random(#words)) % #words + 1]
+        count = count + 1
+        if (count % 97 == 0) then
+            return word .. ".\n"
+        elseif (count % 13 == 0) then
+            return word .. ", "
+        end
+        return word .. " "
+    end)
+end
+
+-- JSON log lines
+local function json(size)
+    local random = new_random(2)
+    local levels = { "DEBUG", "INFO", "INFO", "INFO", "WARN", "ERROR" }
+    local methods = { "GET", "GET", "GET", "POST", "PUT", "DELETE" }
+    local statuses = { 200, 200, 200, 201, 204, 304, 400, 404, 500 }
+    local ts = 1700000000000
+    return build(size, function()
+        ts = ts + random(250)
+        return ('{"ts":%d,"level":"%s","service":"api-%d","method":"%s","path":"/v1/items/%d","status":%d,"latency_ms":%d,"request_id":"%08x"}\n'):format(
+            ts,
+            levels[random(#levels) + 1],
+            random(8),
+            methods[random(#methods) + 1],
+            random(100000),
+            statuses[random(#statuses) + 1],
+            random(2000),
+            random(2147483647)
+        )
+    end)
+end
+
+-- machine-code-like binary data: a small set of
+-- opcodes followed by operands of varying entropy
+local function binary(size)
+    local random = new_random(3)
+    local opcodes = {}
+    for i = 1, 24 do
+        opcodes[i] = string.char(random(256), random(256))
+    end
+    local char = string.char
+    return build(size, function()
+        local op = opcodes[random(#opcodes) + 1]
+        local kind = random(4)
+        if (kind == 0) then
+            -- small immediate
+            return op .. char(random(16), 0, 0, 0)
+        elseif (kind == 1) then
+            -- near address
+            return op .. char(random(256), random(256), 0x40, 0)
+        elseif (kind == 2) then
+            -- register form
+            return op
+        end
+        -- random 32-bit value
+        return op .. char(random(256), random(256), random(256), random(256))
+    end)
+end
+
+-- incompressible data
+local function random_bytes(size)
+    local random = new_random(4)
+    local char = string.char
+    return build(size, function()
+        local bytes = {}
+        for i = 1, 256 do
+            bytes[i] = random(256)
+        end
+        return char(unpack(bytes))
+    end)
+end
+
+local generators = {
+    text = text,
+    json = json,
+    binary = binary,
+    random = random_bytes
+}
+
+-- generates the corpus `name' with `size' bytes
+function corpus.generate(name, size)
+    local generator = generators[name]
+    assert(generator, "unknown corpus " .. tostring(name))
+    return generator(size)
+end
+
+return corpus
@@ -0,0 +1,116 @@
+-- Measures the throughput of `stream:exec'
+-- for producer chunk sizes from 4 KB to 16 MB.
+--
+-- Since the produced data is fed to the
+-- lzma_stream without a copy, the input side
+-- of `exec' should no longer slow down as the
+-- chunks grow. To compare two builds of lua-xz,
+-- run this script against each one of them:
+--
+--     lua benchmarks/exec-producer-chunk-sizes.lua [total_mb]
+--
+-- note: the writer uses preset 0 and the reader
+-- decodes the data written with preset 0, so that
+-- the cost of the input side is not hidden
+-- by the cost of the compression itself.
+
+local xz = require("lua-xz")
+
+local script_dir = (arg and arg[0] or ""):match("^(.*[/\\])") or "./"
+package.path = script_dir .. "?.lua;" .. package.path
+
+local corpus = require("corpus")
+
+-- amount of uncompressed data (in MB)
+local total_mb = tonumber(arg and arg[1]) or 64
+
+-- deterministic, moderately compressible data
+local function make_data(size)
+    local words = {
+        "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+        "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"
+    }
+    local parts = {}
+    local random = corpus.random(12345)
+    local length = 0
+    while (length < size) do
+        local word = words[random(#words) + 1]
+        parts[#parts + 1] = word
+        length = length + #word + 1
+    end
+    return table.concat(parts, " "):sub(1, size)
+end
+
+-- creates a producer that returns
+-- chunks of `chunk_size' bytes of `data'
+local function make_producer(data, chunk_size)
+    local position = 1
+    local chunks = {}
+    while (position <= #data) do
+        chunks[#chunks + 1] = data:sub(position, position + chunk_size - 1)
+        position = position + chunk_size
+    end
+
+    local i = 0
+    return function()
+        i = i + 1
+        return chunks[i]
+    end
+end
+
+local function run(stream, data, chunk_size)
+    local producer = make_producer(data, chunk_size)
+    local size = 0
+    local outputs = {}
+    local function consumer(chunk)
+        size = size + #chunk
+        outputs[#outputs + 1] = chunk
+    end
+
+    local start = os.clock()
+    stream:exec(producer, consumer, 1024 * 1024)
+    local elapsed = os.clock() - start
+
+    stream:close()
+    return elapsed, table.concat(outputs)
+end
+
+local data = make_data(total_mb * 1024 * 1024)
+
+local compressed
+do
+    local _, output = run(xz.stream.xzwriter(0, xz.check.CRC32), data, 1024 * 1024)
+    compressed = output
+end
+
+local chunk_sizes = {
+    4 * 1024,
+    16 * 1024,
+    64 * 1024,
+    256 * 1024,
+    1024 * 1024,
+    4 * 1024 * 1024,
+    16 * 1024 * 1024
+}
+
+print(("%-10s %12s %16s %16s"):format("operation", "chunk (KB)", "input (MB/s)", "output (MB/s)"))
+
+for _, chunk_size in ipairs(chunk_sizes) do
+    local elapsed = run(xz.stream.xzwriter(0, xz.check.CRC32), data, chunk_size)
+    print(("%-10s %12d %16.1f %16.1f"):format(
+        "compress",
+        math.floor(chunk_size / 1024),
+        (#data / (1024 * 1024)) / elapsed,
+        (#compressed / (1024 * 1024)) / elapsed
+    ))
+end
+
+for _, chunk_size in ipairs(chunk_sizes) do
+    local elapsed = run(xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0), compressed, chunk_size)
+    print(("%-10s %12d %16.1f %16.1f"):format(
+        "decompress",
+        math.floor(chunk_size / 1024),
+        (#compressed / (1024 * 1024)) / elapsed,
+        (#data / (1024 * 1024)) / elapsed
+    ))
+end
@@ -0,0 +1,578 @@
+/*
+** C harness of the lua-xz benchmarks.
+**
+** Measures plain liblzma on the corpora written by
+** `lua bench.lua corpus <directory>', sweeping the same
+** presets, buffer sizes, chunk sizes and thread counts
+** as the Lua driver. Comparing both results tells
+** the overhead of the binding and of the Lua VM.
+**
+** usage:
+**
+**     harness [--quick | --full] file...
+**
+** Every measurement is written to the standard output
+** as a JSON object per line.
+*/
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lzma.h>
+
+#define HARNESS_DEFAULT_BUFFER_SIZE ((size_t)8192)
+#define HARNESS_DEFAULT_CHUNK_SIZE ((size_t)8192)
+
+/* start of measurement helpers */
+
+/*
+** counting allocator: tracks the
+** total and the peak of the memory
+** allocated by liblzma
+*/
+typedef union harness_alloc_header
+{
+    size_t size;
+    double align_d;
+    void *align_p;
+} harness_alloc_header;
+
+static size_t harness_alloc_current = 0;
+static size_t harness_alloc_peak = 0;
+static size_t harness_alloc_total = 0;
+
+static void *harness_alloc(void *opaque, size_t nmemb, size_t size)
+{
+    harness_alloc_header *header;
+    size_t bytes = nmemb * size;
+    (void)opaque;
+
+    header = (harness_alloc_header *)malloc(sizeof(harness_alloc_header) + bytes);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    header->size = bytes;
+    harness_alloc_current += bytes;
+    harness_alloc_total += bytes;
+    if (harness_alloc_current > harness_alloc_peak)
+    {
+        harness_alloc_peak = harness_alloc_current;
+    }
+
+    return (void *)(header + 1);
+}
+
+static void harness_free(void *opaque, void *ptr)
+{
+    harness_alloc_header *header;
+    (void)opaque;
+
+    if (ptr != NULL)
+    {
+        header = ((harness_alloc_header *)ptr) - 1;
+        harness_alloc_current -= header->size;
+        free(header);
+    }
+}
+
+static const lzma_allocator harness_allocator = { harness_alloc, harness_free, NULL };
+
+static double harness_clock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return ((double)counter.QuadPart) / ((double)frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double)ts.tv_sec) + ((double)ts.tv_nsec) * 1e-9;
+#else
+    return ((double)clock()) / ((double)CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+** peak resident set size of the process (in KB)
+** or -1 when unavailable
+*/
+static long harness_peak_rss(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return (long)(counters.PeakWorkingSetSize / 1024);
+    }
+    return -1;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#ifdef __APPLE__
+        /* bytes on macOS */
+        return (long)(usage.ru_maxrss / 1024);
+#else
+        return (long)usage.ru_maxrss;
+#endif
+    }
+    return -1;
+#endif
+}
+
+/*
+** resets the peak resident set size
+** on Linux 4.0 or newer. Elsewhere, the
+** peak is the one of the whole process
+*/
+static void harness_reset_peak_rss(void)
+{
+#ifdef __linux__
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs != NULL)
+    {
+        fputs("5", clear_refs);
+        fclose(clear_refs);
+    }
+#endif
+}
+
+/*
+** peak RSS: on Linux, /proc/self/status
+** reflects the reset of clear_refs, which
+** getrusage ignores
+*/
+static long harness_current_peak_rss(void)
+{
+#ifdef __linux__
+    char line[256];
+    long peak = -1;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != NULL)
+    {
+        while (fgets(line, sizeof(line), status) != NULL)
+        {
+            if (strncmp(line, "VmHWM:", 6) == 0)
+            {
+                peak = strtol(line + 6, NULL, 10);
+                break;
+            }
+        }
+        fclose(status);
+    }
+    if (peak >= 0)
+    {
+        return peak;
+    }
+#endif
+    return harness_peak_rss();
+}
+
+/* end of measurement helpers */
+
+/* start of coding */
+
+typedef struct harness_result
+{
+    size_t output_size;
+    double seconds;
+    size_t memusage;
+    size_t allocated;
+    long peak_rss_kb;
+} harness_result;
+
+/*
+** runs `strm' over `input', feeding at most
+** `chunk_size' bytes per call and collecting
+** the output through a `buffer_size' buffer.
+** When `output' is not NULL, it receives the
+** output (a malloc'ed block)
+*/
+static lzma_ret harness_code(lzma_stream *strm, const uint8_t *input, size_t input_size, size_t chunk_size, size_t buffer_size, uint8_t **output, harness_result *result)
+{
+    lzma_ret ret = LZMA_OK;
+    size_t position = 0;
+    size_t output_size = 0;
+    size_t output_capacity = 0;
+    uint8_t *collected = NULL;
+    uint8_t *buffer = (uint8_t *)malloc(buffer_size);
+    double start;
+
+    if (buffer == NULL)
+    {
+        return LZMA_MEM_ERROR;
+    }
+
+    start = harness_clock();
+
+    while (ret == LZMA_OK)
+    {
+        lzma_action action = LZMA_RUN;
+
+        if (strm->avail_in == 0)
+        {
+            size_t chunk = input_size - position;
+            if (chunk > chunk_size)
+            {
+                chunk = chunk_size;
+            }
+            strm->next_in = input + position;
+            strm->avail_in = chunk;
+            position += chunk;
+        }
+
+        if (position == input_size)
+        {
+            action = LZMA_FINISH;
+        }
+
+        strm->next_out = buffer;
+        strm->avail_out = buffer_size;
+
+        ret = lzma_code(strm, action);
+
+        if (buffer_size > strm->avail_out)
+        {
+            size_t produced = buffer_size - strm->avail_out;
+
+            if (output != NULL)
+            {
+                if (output_size + produced > output_capacity)
+                {
+                    uint8_t *grown;
+                    output_capacity = 2 * (output_size + produced);
+                    grown = (uint8_t *)realloc(collected, output_capacity);
+                    if (grown == NULL)
+                    {
+                        ret = LZMA_MEM_ERROR;
+                        break;
+                    }
+                    collected = grown;
+                }
+                memcpy(collected + output_size, buffer, produced);
+            }
+
+            output_size += produced;
+        }
+    }
+
+    result->seconds = harness_clock() - start;
+    result->output_size = output_size;
+
+    free(buffer);
+
+    if (output != NULL)
+    {
+        *output = collected;
+    }
+    else
+    {
+        free(collected);
+    }
+
+    return ret == LZMA_STREAM_END ? LZMA_OK : ret;
+}
+
+/* end of coding */
+
+/* start of sweeps */
+
+static const char *harness_file = NULL;
+static size_t harness_file_size = 0;
+
+static void harness_write_result(const char *sweep, const char *operation, const char *preset, int threads, size_t buffer_size, size_t chunk_size, size_t input_size, size_t ratio_numerator, const harness_result *result)
+{
+    printf("{\"suite\":\"c\",\"liblzma\":\"%s\",\"sweep\":\"%s\",\"corpus\":\"%s\",\"size\":%lu,"
+           "\"operation\":\"%s\",\"preset\":\"%s\",",
+           lzma_version_string(), sweep, harness_file, (unsigned long)harness_file_size,
+           operation, preset);
+
+    if (threads > 0)
+    {
+        printf("\"threads\":\"%d\",", threads);
+    }
+    else
+    {
+        printf("\"threads\":null,");
+    }
+
+    printf("\"buffer_size\":%lu,\"chunk_size\":%lu,\"input_bytes\":%lu,\"output_bytes\":%lu,"
+           "\"ratio\":%.6g,\"seconds\":%.6g,\"mb_per_s\":",
+           (unsigned long)buffer_size, (unsigned long)chunk_size,
+           (unsigned long)input_size, (unsigned long)result->output_size,
+           ((double)ratio_numerator) / ((double)harness_file_size), result->seconds);
+
+    if (result->seconds > 0.0)
+    {
+        printf("%.6g", (((double)harness_file_size) / (1024.0 * 1024.0)) / result->seconds);
+    }
+    else
+    {
+        printf("null");
+    }
+
+    printf(",\"allocated\":%lu,\"memusage\":%lu,\"peak_rss_kb\":",
+           (unsigned long)result->allocated, (unsigned long)result->memusage);
+
+    if (result->peak_rss_kb >= 0)
+    {
+        printf("%ld}\n", result->peak_rss_kb);
+    }
+    else
+    {
+        printf("null}\n");
+    }
+
+    fflush(stdout);
+}
+
+/*
+** measures the compression and
+** the decompression of `data'
+*/
+static int harness_run(const char *sweep, const uint8_t *data, size_t size, const char *preset_name, int threads, size_t buffer_size, size_t chunk_size)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    harness_result compressed_result;
+    harness_result decompressed_result;
+    uint8_t *compressed = NULL;
+    uint32_t preset;
+    lzma_ret ret;
+
+    preset = (uint32_t)atoi(preset_name);
+    if (strchr(preset_name, 'e') != NULL)
+    {
+        preset |= LZMA_PRESET_EXTREME;
+    }
+
+    strm.allocator = &harness_allocator;
+
+    /* compression */
+    harness_alloc_peak = harness_alloc_current = harness_alloc_total = 0;
+    harness_reset_peak_rss();
+
+    if (threads > 0)
+    {
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = (uint32_t)threads;
+        mt.preset = preset;
+        mt.check = LZMA_CHECK_CRC64;
+        ret = lzma_stream_encoder_mt(&strm, &mt);
+    }
+    else
+    {
+        ret = lzma_easy_encoder(&strm, preset, LZMA_CHECK_CRC64);
+    }
+
+    if (ret == LZMA_OK)
+    {
+        ret = harness_code(&strm, data, size, chunk_size, buffer_size, &compressed, &compressed_result);
+    }
+
+    compressed_result.allocated = harness_alloc_total;
+    compressed_result.memusage = harness_alloc_peak;
+    compressed_result.peak_rss_kb = harness_current_peak_rss();
+    lzma_end(&strm);
+
+    if (ret != LZMA_OK)
+    {
+        fprintf(stderr, "harness: compression of %s failed (error %d)\n", harness_file, (int)ret);
+        free(compressed);
+        return 0;
+    }
+
+    harness_write_result(sweep, "compress", preset_name, threads, buffer_size, chunk_size, size, compressed_result.output_size, &compressed_result);
+
+    /* decompression */
+    harness_alloc_peak = harness_alloc_current = harness_alloc_total = 0;
+    harness_reset_peak_rss();
+
+    if (threads > 0)
+    {
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = (uint32_t)threads;
+        mt.memlimit_threading = UINT64_MAX;
+        mt.memlimit_stop = UINT64_MAX;
+        ret = lzma_stream_decoder_mt(&strm, &mt);
+    }
+    else
+    {
+        ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
+    }
+
+    if (ret == LZMA_OK)
+    {
+        ret = harness_code(&strm, compressed, compressed_result.output_size, chunk_size, buffer_size, NULL, &decompressed_result);
+    }
+
+    decompressed_result.allocated = harness_alloc_total;
+    decompressed_result.memusage = harness_alloc_peak;
+    decompressed_result.peak_rss_kb = harness_current_peak_rss();
+    lzma_end(&strm);
+    free(compressed);
+
+    if (ret != LZMA_OK || decompressed_result.output_size != size)
+    {
+        fprintf(stderr, "harness: decompression of %s failed (error %d)\n", harness_file, (int)ret);
+        return 0;
+    }
+
+    harness_write_result(sweep, "decompress", preset_name, threads, buffer_size, chunk_size, compressed_result.output_size, compressed_result.output_size, &decompressed_result);
+
+    return 1;
+}
+
+static uint8_t *harness_read_file(const char *filename, size_t *size)
+{
+    uint8_t *data = NULL;
+    size_t capacity = 0;
+    size_t length = 0;
+    size_t read_bytes;
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    do
+    {
+        if (length == capacity)
+        {
+            uint8_t *grown;
+            capacity = capacity == 0 ? (1 << 20) : 2 * capacity;
+            grown = (uint8_t *)realloc(data, capacity);
+            if (grown == NULL)
+            {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = grown;
+        }
+        read_bytes = fread(data + length, 1, capacity - length, file);
+        length += read_bytes;
+    } while (read_bytes > 0);
+
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+/* corpus name from the path of its file */
+static const char *harness_corpus_name(const char *filename, char *name, size_t name_size)
+{
+    const char *base = filename;
+    const char *p;
+    size_t length;
+
+    for (p = filename; *p != '\0'; p++)
+    {
+        if (*p == '/' || *p == '\\')
+        {
+            base = p + 1;
+        }
+    }
+
+    p = strrchr(base, '.');
+    length = p == NULL ? strlen(base) : (size_t)(p - base);
+    if (length >= name_size)
+    {
+        length = name_size - 1;
+    }
+
+    memcpy(name, base, length);
+    name[length] = '\0';
+    return name;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *quick_presets[] = { "0", "1", "3", "6", "9", NULL };
+    static const char *full_presets[] = {
+        "0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+        "0e", "1e", "2e", "3e", "4e", "5e", "6e", "7e", "8e", "9e", NULL
+    };
+    static const size_t buffer_sizes[] = { 4096, 16384, 65536, 262144, 1048576, 0 };
+    static const size_t chunk_sizes[] = { 1024, 8192, 65536, 1048576, 0 };
+    static const int thread_counts[] = { 1, 2, 4, 0 };
+
+    const char **presets = quick_presets;
+    char name[256];
+    int failures = 0;
+    int i;
+    int j;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            presets = quick_presets;
+        }
+        else if (strcmp(argv[i], "--full") == 0)
+        {
+            presets = full_presets;
+        }
+        else
+        {
+            uint8_t *data;
+            size_t size = 0;
+
+            data = harness_read_file(argv[i], &size);
+            if (data == NULL || size == 0)
+            {
+                fprintf(stderr, "harness: failed to read %s\n", argv[i]);
+                free(data);
+                failures++;
+                continue;
+            }
+
+            harness_file = harness_corpus_name(argv[i], name, sizeof(name));
+            harness_file_size = size;
+
+            for (j = 0; presets[j] != NULL; j++)
+            {
+                failures += !harness_run("preset", data, size, presets[j], 0, HARNESS_DEFAULT_BUFFER_SIZE, HARNESS_DEFAULT_CHUNK_SIZE);
+            }
+
+            for (j = 0; buffer_sizes[j] != 0; j++)
+            {
+                failures += !harness_run("buffer_size", data, size, "0", 0, buffer_sizes[j], HARNESS_DEFAULT_CHUNK_SIZE);
+            }
+
+            for (j = 0; chunk_sizes[j] != 0; j++)
+            {
+                failures += !harness_run("chunk_size", data, size, "0", 0, HARNESS_DEFAULT_BUFFER_SIZE, chunk_sizes[j]);
+            }
+
+            for (j = 0; thread_counts[j] != 0; j++)
+            {
+                failures += !harness_run("threads", data, size, "6", thread_counts[j], 1048576, 1048576);
+            }
+
+            free(data);
+        }
+    }
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* end of sweeps */
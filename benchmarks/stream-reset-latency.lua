@@ -0,0 +1,111 @@
+-- Measures the per-payload latency of compressing
+-- and decompressing many small independent payloads,
+-- either creating a new stream for each payload
+-- or recycling a single stream through `stream:reset'.
+--
+--     lua benchmarks/stream-reset-latency.lua [payloads] [payload_size]
+--
+-- note: most of the cost of a new writer is the allocation
+-- and initialization of the match finder, which `reset'
+-- reuses. However, on presets with large dictionaries
+-- (e.g.: 9), liblzma clears the reused hash table of the
+-- match finder, which might cost more than the zeroed pages
+-- handed by the operating system to a new writer.
+
+local xz = require("lua-xz")
+
+local script_dir = (arg and arg[0] or ""):match("^(.*[/\\])") or "./"
+package.path = script_dir .. "?.lua;" .. package.path
+
+local corpus = require("corpus")
+
+-- number of payloads per measurement
+local payloads = tonumber(arg and arg[1]) or 200
+
+-- size of each payload (in bytes)
+local payload_size = tonumber(arg and arg[2]) or 1024
+
+-- deterministic, moderately compressible data
+local function make_payload(index, size)
+    local parts = {}
+    local length = 0
+    local random = corpus.random(index)
+    while (length < size) do
+        local part = ("item-%d "):format(random(1000))
+        parts[#parts + 1] = part
+        length = length + #part
+    end
+    return table.concat(parts):sub(1, size)
+end
+
+local function run(stream, data)
+    local done = false
+    local outputs = {}
+    stream:exec(
+        function()
+            if (not done) then
+                done = true
+                return data
+            end
+        end,
+        function(chunk)
+            outputs[#outputs + 1] = chunk
+        end
+    )
+    return table.concat(outputs)
+end
+
+local inputs = {}
+for i = 1, payloads do
+    inputs[i] = make_payload(i, payload_size)
+end
+
+local function measure(f)
+    local start = os.clock()
+    f()
+    return (os.clock() - start) * 1e6 / payloads
+end
+
+print(("%-12s %8s %18s %18s %10s"):format("operation", "preset", "new (us/payload)", "reset (us/payload)", "speedup"))
+
+for _, preset in ipairs({ 0, 3, 6, 9 }) do
+    local compressed = {}
+
+    local new_time = measure(function()
+        for i = 1, payloads do
+            local writer = xz.stream.xzwriter(preset, xz.check.CRC32)
+            compressed[i] = run(writer, inputs[i])
+            writer:close()
+        end
+    end)
+
+    local reset_time = measure(function()
+        local writer = xz.stream.xzwriter(preset, xz.check.CRC32)
+        for i = 1, payloads do
+            assert(run(writer, inputs[i]) == compressed[i])
+            writer:reset()
+        end
+        writer:close()
+    end)
+
+    print(("%-12s %8d %18.1f %18.1f %9.1fx"):format("compress", preset, new_time, reset_time, new_time / reset_time))
+
+    new_time = measure(function()
+        for i = 1, payloads do
+            local reader = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0)
+            run(reader, compressed[i])
+            reader:close()
+        end
+    end)
+
+    reset_time = measure(function()
+        local reader = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0)
+        for i = 1, payloads do
+            assert(run(reader, compressed[i]) == inputs[i])
+            reader:reset()
+        end
+        reader:close()
+    end)
+
+    print(("%-12s %8d %18.1f %18.1f %9.1fx"):format("decompress", preset, new_time, reset_time, new_time / reset_time))
+end
@@ -0,0 +1,58 @@
+local xz = require("lua-xz")
+
+-- some data to compress
+local content = ("lua-xz accounts the memory of liblzma. "):rep(1000)
+
+-- runs the stream on the whole content
+local function run(stream, data)
+    local done = false
+    local outputs = {}
+    stream:exec(
+        function()
+            if (not done) then
+                done = true
+                return data
+            end
+        end,
+        function(chunk)
+            table.insert(outputs, chunk)
+        end
+    )
+    return table.concat(outputs)
+end
+
+-- the option allocator installs an allocator
+-- on liblzma:
+--   "malloc": malloc / free
+--   "lua": the allocator of the lua_State
+--   "pool": recycles large blocks across streams
+for _, allocator in ipairs({ "malloc", "lua", "pool" }) do
+    local writer_stream = xz.stream.xzwriter(1, xz.check.CRC32, { allocator = allocator })
+
+    -- the memory allocated by the encoder
+    assert(writer_stream:allocated() > 0)
+
+    local compressed = run(writer_stream, content)
+    writer_stream:close()
+
+    -- closing the stream releases its memory
+    assert(writer_stream:allocated() == 0)
+
+    local reader_stream = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0, { allocator = allocator })
+    assert(
+        content == run(reader_stream, compressed),
+        "compression-decompression mismatch: the final output did not match the initial input"
+    )
+    reader_stream:close()
+end
+
+-- memory allocated by all the streams,
+-- and memory kept by the pool for reuse
+local allocated, pooled = xz.allocated()
+print(("allocated: %d bytes, pooled: %d bytes"):format(allocated, pooled))
+
+-- give the memory kept by the pool back
+local trimmed = xz.pool_trim()
+assert(trimmed == pooled, "the pool was not fully trimmed")
+assert(select(2, xz.allocated()) == 0, "the pool still keeps memory")
+print(("trimmed: %d bytes"):format(trimmed))
@@ -0,0 +1,71 @@
+local xz = require("lua-xz")
+
+-- compresses the README.md file on a
+-- worker thread: the Lua thread only
+-- reads the input, submits it and writes
+-- the compressed output, so the file I/O
+-- overlaps with the compression
+local input = io.open("README.md", "rb")
+if (not input) then
+    error("failed to open README.md file for reading")
+end
+
+local output = io.open("README.md.async.xz", "wb")
+if (not output) then
+    input:close()
+    error("failed to open README.md.async.xz file for writing")
+end
+
+-- the queues hold up to 2 chunks of input
+-- and 2 chunks of output, which bounds
+-- the memory held by the handle
+local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC64)
+local handle = xz.async(writer_stream, { input_queue = 2, output_queue = 2, buffersize = 4096 })
+
+local chunk = input:read(1024)
+while (chunk) do
+    -- submit returns immediately, and
+    -- returns false when the input
+    -- queue is full
+    if (handle:submit(chunk)) then
+        chunk = input:read(1024)
+    else
+        -- wait for output, which
+        -- makes room on the queues
+        output:write((handle:wait()))
+    end
+end
+input:close()
+
+-- no more data: the worker finishes
+-- the stream, and wait hands back the
+-- remaining output until the end
+handle:finish()
+local ended = false
+while (not ended) do
+    local compressed_chunk
+    compressed_chunk, ended = handle:wait()
+    output:write(compressed_chunk)
+end
+output:close()
+
+-- closing the handle joins the worker
+-- and gives the stream back
+handle:close()
+print(("compressed in %.3f seconds of the worker"):format(writer_stream:stats().time_code))
+writer_stream:close()
+
+-- check the output
+input = io.open("README.md", "rb")
+local content = input:read("*a")
+input:close()
+
+local compressed_file = io.open("README.md.async.xz", "rb")
+local compressed = compressed_file:read("*a")
+compressed_file:close()
+os.remove("README.md.async.xz")
+
+assert(
+    xz.decompress(compressed) == content,
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
@@ -0,0 +1,83 @@
+local xz = require("lua-xz")
+
+-- records to compress, e.g.: lines of a log
+local records = {}
+for i = 1, 5000 do
+    records[i] = ("%05d level=%s message=\"request served\"\n"):format(i, i % 7 == 0 and "warn" or "info")
+end
+
+-- compressed file name
+local compressed_filename = "records.blocks.xz"
+
+-- compress the records in blocks of
+-- at most 64 KB of uncompressed data,
+-- ending a block every 1000 records
+local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC32, {
+    block_size = 64 * 1024
+})
+
+local output = assert(
+    io.open(compressed_filename, "wb"),
+    "failed to open " .. compressed_filename .. " file for writing"
+)
+
+local i = 0
+
+-- tip: always check for errors
+local ok, exec_err = pcall(
+    function()
+        writer_stream:exec(
+            function()
+                i = i + 1
+                if (i <= #records) then
+                    -- the second value ends the block
+                    -- right after the record
+                    if (i % 1000 == 0) then
+                        return records[i], xz.FULL_FLUSH
+                    end
+                    return records[i]
+                end
+            end,
+            output
+        )
+    end
+)
+
+output:close()
+
+-- an error occurred ?
+if (not ok) then
+    writer_stream:close()
+    -- raise the error
+    error(exec_err)
+end
+
+-- the table of blocks, to be
+-- stored as a sidecar index
+local blocks = writer_stream:blocks()
+writer_stream:close()
+
+for index, block in ipairs(blocks) do
+    print(("block %d: uncompressed %d+%d, compressed %d+%d"):format(
+        index,
+        block.uncompressed_offset, block.uncompressed_size,
+        block.compressed_offset, block.compressed_size
+    ))
+end
+
+-- each block holds whole records,
+-- so any block decodes on its own
+-- to a whole set of records
+local content = table.concat(records)
+local reader = xz.seekable(compressed_filename)
+
+for _, block in ipairs(blocks) do
+    local data = reader:read(block.uncompressed_offset, block.uncompressed_size)
+    assert(
+        data == content:sub(block.uncompressed_offset + 1, block.uncompressed_offset + block.uncompressed_size),
+        "block mismatch: the data read did not match the initial input"
+    )
+    assert(data:sub(-1) == "\n", "blocks must end at record boundaries")
+end
+
+reader:close()
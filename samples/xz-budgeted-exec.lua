@@ -0,0 +1,86 @@
+local xz = require("lua-xz")
+
+-- simulates a single-threaded worker
+-- that compresses a large input while
+-- it keeps serving other requests:
+-- each call of exec runs for a bounded
+-- amount of work, and returns true
+-- while there is more work pending
+local lines = {}
+for i = 1, 100000 do
+    lines[i] = ("%d: request from 10.0.%d.%d served\n"):format(i, i % 256, (i * 7) % 256)
+end
+local data = table.concat(lines)
+
+local position = 1
+local chunk_size = 16 * 1024
+local function producer()
+    local chunk
+    if (position <= #data) then
+        chunk = data:sub(position, position + chunk_size - 1)
+        position = position + chunk_size
+    end
+    return chunk
+end
+
+local outputs = {}
+local function consumer(compressed_chunk)
+    table.insert(outputs, compressed_chunk)
+end
+
+-- process at most 256 KB of uncompressed
+-- data or 5 ms per call, whatever comes first
+local budget = { budget_bytes = 256 * 1024, budget_time = 0.005 }
+
+local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC64)
+
+local calls = 0
+local requests_served = 0
+local pending = true
+while (pending) do
+    -- the same producer, consumer and
+    -- options are given on every call
+    pending = writer_stream:exec(producer, consumer, budget)
+    calls = calls + 1
+
+    -- serve other requests in between
+    requests_served = requests_served + 1
+end
+
+writer_stream:close()
+
+local compressed = table.concat(outputs)
+print(("%d bytes compressed to %d bytes in %d calls of exec"):format(#data, #compressed, calls))
+
+-- the same goes for readers, where the
+-- budget counts the decompressed bytes
+local reader_stream = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0)
+local compressed_position = 1
+local decompressed = {}
+local reader_calls = 0
+pending = true
+while (pending) do
+    pending = reader_stream:exec(
+        function()
+            local chunk
+            if (compressed_position <= #compressed) then
+                chunk = compressed:sub(compressed_position, compressed_position + chunk_size - 1)
+                compressed_position = compressed_position + chunk_size
+            end
+            return chunk
+        end,
+        function(chunk)
+            table.insert(decompressed, chunk)
+        end,
+        { budget_bytes = 512 * 1024 }
+    )
+    reader_calls = reader_calls + 1
+end
+reader_stream:close()
+
+assert(calls > 1 and reader_calls > 1, "the budget did not split the work")
+
+assert(
+    table.concat(decompressed) == data,
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
@@ -0,0 +1,111 @@
+local xz = require("lua-xz")
+
+-- the file to compress
+local filename = "README.md"
+
+-- compressed file name
+local compressed_filename = filename .. ".view.xz"
+
+-- read the whole content of the file
+-- to be matched against the output
+-- of a compression-decompression
+local content
+do
+    local input = assert(
+        io.open(filename, "rb"),
+        "failed to open " .. filename .. " file for reading"
+    )
+    content = input:read("*a")
+    input:close()
+end
+
+--[[ start of encoding ]]
+do
+    local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC32)
+
+    local output = assert(
+        io.open(compressed_filename, "wb"),
+        "failed to open " .. compressed_filename .. " file for writing"
+    )
+
+    local position = 1
+    local function producer()
+        local chunk_size = 1024
+        local chunk
+        if (position <= #content) then
+            chunk = content:sub(position, position + chunk_size - 1)
+            position = position + chunk_size
+        end
+        return chunk
+    end
+
+    -- the consumer receives a reusable
+    -- view of the output buffer, and
+    -- forwards its bytes to the output file
+    -- without creating a string
+    local function consumer(view)
+        view:write(output)
+    end
+
+    -- tip: always check for errors
+    local ok, exec_err = pcall(
+        function()
+            -- the fourth parameter might
+            -- be a table of options
+            writer_stream:exec(producer, consumer, {
+                buffersize = 4 * 1024,
+                view = true
+            })
+        end
+    )
+
+    writer_stream:close()
+    output:close()
+
+    -- an error occurred ?
+    if (not ok) then
+        -- raise the error
+        error(exec_err)
+    end
+end
+--[[ end of encoding]]
+
+--[[ start of decoding ]]
+local outputs = {}
+do
+    local reader_stream = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, xz.CONCATENATED)
+
+    local input = assert(
+        io.open(compressed_filename, "rb"),
+        "failed to open " .. compressed_filename .. " file for reading"
+    )
+
+    -- the view is only valid during
+    -- the call of the consumer, so
+    -- copy its content to keep it
+    local function consumer(view)
+        table.insert(outputs, view:tostring())
+    end
+
+    local ok, exec_err = pcall(
+        function()
+            reader_stream:exec(input, consumer, { view = true })
+        end
+    )
+
+    reader_stream:close()
+    input:close()
+
+    if (not ok) then
+        error(exec_err)
+    end
+end
+--[[ end of decoding]]
+
+-- make sure that the decoded data
+-- after compression-decompression
+-- matches the initial content
+assert(
+    content == table.concat(outputs),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
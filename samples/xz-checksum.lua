@@ -0,0 +1,71 @@
+local xz = require("lua-xz")
+
+local file = io.open("README.md", "rb")
+if (not file) then
+    error("failed to open README.md file for reading")
+end
+local content = file:read("*a")
+file:close()
+
+-- a checksum of the data at once
+print(("CRC32 of README.md: %08x"):format(xz.crc32sum(content)))
+
+-- the same checksum, incrementally
+local hasher = xz.crc32()
+for position = 1, #content, 4096 do
+    hasher:update(content:sub(position, position + 4095))
+end
+
+assert(hasher:digest() == xz.crc32sum(content), "incremental checksum mismatch")
+
+-- the checksum of the uncompressed data
+-- is computed while the data is compressed,
+-- without feeding it to Lua once more
+local writer_hasher = xz.crc64()
+local compressed_chunks = {}
+local position = 1
+
+local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC64)
+writer_stream:exec(
+    function()
+        local chunk
+        if (position <= #content) then
+            chunk = content:sub(position, position + 8191)
+            position = position + 8192
+        end
+        return chunk
+    end,
+    function(compressed_chunk)
+        table.insert(compressed_chunks, compressed_chunk)
+    end,
+    { checksum = writer_hasher }
+)
+writer_stream:close()
+
+-- the reader computes it from its output
+local reader_hasher = xz.crc64()
+local compressed = table.concat(compressed_chunks)
+local fed = false
+
+local reader_stream = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0)
+reader_stream:exec(
+    function()
+        if (fed) then
+            return nil
+        end
+        fed = true
+        return compressed
+    end,
+    function()
+        -- the output is not needed here
+    end,
+    { checksum = reader_hasher }
+)
+reader_stream:close()
+
+print(("CRC64 of README.md: %s"):format(reader_hasher:hexdigest()))
+
+assert(
+    writer_hasher:hexdigest() == reader_hasher:hexdigest() and reader_hasher:hexdigest() == xz.crc64(content):hexdigest(),
+    "the checksum of the decompressed data does not match the checksum of the initial input"
+)
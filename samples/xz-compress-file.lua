@@ -0,0 +1,65 @@
+local xz = require("lua-xz")
+
+-- the file to compress
+local filename = "README.md"
+
+-- compressed file name
+local compressed_filename = filename .. ".file.xz"
+
+-- decompressed file name
+local decompressed_filename = compressed_filename .. ".out"
+
+-- compress the file to .xz format,
+-- doing all the I/O in C
+--
+-- third parameter:
+--  options (all of them are optional):
+--    preset:
+--      compression preset
+--    check:
+--      integrity check
+--    buffersize:
+--      size of the input and output buffers
+--    mmap:
+--      memory map the input file
+--
+-- tip: always check for errors
+local ok, bytes_in, bytes_out, elapsed = pcall(xz.compress_file, filename, compressed_filename, {
+    preset = xz.PRESET_DEFAULT,
+    check = xz.check.CRC32,
+    buffersize = 64 * 1024,
+    mmap = true
+})
+
+-- an error occurred ?
+if (not ok) then
+    -- raise the error
+    error(bytes_in)
+end
+
+print(("compressed %d bytes into %d bytes in %.3f seconds"):format(bytes_in, bytes_out, elapsed))
+
+-- decompress the file back
+bytes_in, bytes_out, elapsed = xz.decompress_file(compressed_filename, decompressed_filename, {
+    memlimit = xz.MEMLIMIT_UNLIMITED
+})
+
+print(("decompressed %d bytes into %d bytes in %.3f seconds"):format(bytes_in, bytes_out, elapsed))
+
+-- make sure that the decoded file
+-- after compression-decompression
+-- matches the initial file
+local function read_file(name)
+    local input = assert(
+        io.open(name, "rb"),
+        "failed to open " .. name .. " file for reading"
+    )
+    local content = input:read("*a")
+    input:close()
+    return content
+end
+
+assert(
+    read_file(filename) == read_file(decompressed_filename),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
@@ -0,0 +1,43 @@
+local xz = require("lua-xz")
+
+-- many independent objects (e.g.: entries
+-- of an archive), compressed one by one
+local objects = {}
+for i = 1, 1000 do
+    objects[i] = ('{"id": %d, "name": "object %d", "tags": ["a", "b", "c"], "size": %d}'):format(i, i, (i * 7919) % 65536):rep(i % 20 + 1)
+end
+
+-- compress all of them concurrently on a
+-- pool of threads, one per processor core
+--
+-- note: the preset, the check and
+-- the options are optional
+local compressed, errors = xz.compress_many(objects, xz.PRESET_DEFAULT, xz.check.CRC32, { threads = "auto" })
+assert(next(errors) == nil, "failed to compress the objects")
+
+local total_in, total_out = 0, 0
+for i = 1, #objects do
+    total_in = total_in + #objects[i]
+    total_out = total_out + #compressed[i]
+end
+print(("%d objects: %d bytes compressed to %d bytes"):format(#objects, total_in, total_out))
+
+-- errors of an item do not abort
+-- the batch: the failed items hold
+-- false, and the second table tells
+-- the error of each one
+compressed[10] = "not .xz data"
+
+local decompressed, decompress_errors = xz.decompress_many(compressed)
+
+assert(decompressed[10] == false)
+print(("item 10 failed: %s"):format(decompress_errors[10]))
+
+for i = 1, #objects do
+    if (i ~= 10) then
+        assert(
+            decompressed[i] == objects[i],
+            "compression-decompression mismatch: the final output did not match the initial input"
+        )
+    end
+end
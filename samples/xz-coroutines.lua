@@ -0,0 +1,68 @@
+local xz = require("lua-xz")
+
+-- simulates an event loop running
+-- tasks as coroutines: a task waiting
+-- for data yields, and the loop resumes
+-- it once the data "arrives"
+
+-- data arriving in pieces
+local pieces = {}
+for i = 1, 200 do
+    pieces[i] = ("%d: sensor reading %d\n"):format(i, (i * 37) % 101)
+end
+
+-- waits (yields) for the next piece
+local next_piece = 0
+local function receive()
+    coroutine.yield("waiting for data")
+    next_piece = next_piece + 1
+    return pieces[next_piece]
+end
+
+-- on Lua 5.2 or newer, the producer and
+-- the consumer of exec might yield
+local yieldable = _VERSION ~= "Lua 5.1"
+
+local outputs = {}
+
+local task = coroutine.create(function()
+    local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC64)
+
+    if (yieldable) then
+        writer_stream:exec(
+            function()
+                -- yields inside exec
+                return receive()
+            end,
+            function(compressed_chunk)
+                table.insert(outputs, compressed_chunk)
+            end
+        )
+    else
+        -- on Lua 5.1 and LuaJIT, exec cannot
+        -- be suspended, but update and finish
+        -- are called from Lua, so the loop
+        -- itself might yield
+        local piece = receive()
+        while (piece) do
+            table.insert(outputs, writer_stream:update(piece))
+            piece = receive()
+        end
+        table.insert(outputs, writer_stream:finish())
+    end
+
+    writer_stream:close()
+end)
+
+-- the event loop
+while (coroutine.status(task) ~= "dead") do
+    local ok, err = coroutine.resume(task)
+    if (not ok) then
+        error(err)
+    end
+end
+
+assert(
+    xz.decompress(table.concat(outputs)) == table.concat(pieces),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
@@ -0,0 +1,82 @@
+local xz = require("lua-xz")
+
+-- small JSON events sharing most of
+-- their keys and values
+local function event(i)
+    return ('{"id":%d,"type":"%s","user":{"name":"user%d","country":"%s"},"status":"ok","latency_ms":%d}'):format(
+        i,
+        ({ "click", "view", "purchase" })[i % 3 + 1],
+        i % 50,
+        ({ "BR", "US", "DE", "JP" })[i % 4 + 1],
+        (i * 7) % 120
+    )
+end
+
+-- the dictionary is built once from
+-- sample events, and shared by the
+-- writers and the readers: only its
+-- last 4 KB are kept, matching the
+-- dictionary size of the filter
+local samples = {}
+for i = 1, 100 do
+    samples[i] = event(i)
+end
+local dictionary = xz.dictionary(samples, 4096)
+
+print(("dictionary: %d bytes"):format(dictionary:size()))
+
+-- raw streams have no headers, so a
+-- tiny event is not charged for them,
+-- and the smallest dictionary size of
+-- LZMA2 keeps the encoder cheap to reset
+local filters = {
+    { id = xz.filter.LZMA2, preset = 6, dict_size = 4096, dictionary = dictionary }
+}
+
+-- a writer and a reader are reused
+-- for every event through reset,
+-- keeping their allocations
+local writer_stream = xz.stream.rawwriter(filters)
+local reader_stream = xz.stream.rawreader(filters)
+
+local plain_size, xz_size, raw_size = 0, 0, 0
+
+for i = 1000, 1099 do
+    local message = event(i)
+
+    local compressed = writer_stream:update(message) .. writer_stream:finish()
+    writer_stream:reset()
+
+    local decompressed = reader_stream:update(compressed) .. reader_stream:finish()
+    reader_stream:reset()
+
+    assert(
+        decompressed == message,
+        "compression-decompression mismatch: the final output did not match the initial input"
+    )
+
+    plain_size = plain_size + #message
+    xz_size = xz_size + #xz.compress(message)
+    raw_size = raw_size + #compressed
+end
+
+writer_stream:close()
+reader_stream:close()
+
+print(("100 events: %d bytes, %d bytes as .xz, %d bytes as raw LZMA2 with the dictionary"):format(plain_size, xz_size, raw_size))
+
+assert(raw_size < xz_size, "the dictionary did not improve the compression ratio")
+
+-- a reader without the dictionary
+-- cannot decode the events
+local writer_with_dictionary = xz.stream.rawwriter(filters)
+local compressed = writer_with_dictionary:update(event(1)) .. writer_with_dictionary:finish()
+writer_with_dictionary:close()
+
+local reader_without_dictionary = xz.stream.rawreader({ { id = xz.filter.LZMA2, dict_size = 4096 } })
+local ok = pcall(function()
+    return reader_without_dictionary:update(compressed) .. reader_without_dictionary:finish()
+end)
+reader_without_dictionary:close()
+
+assert(not ok, "a reader without the dictionary decoded the events")
@@ -0,0 +1,87 @@
+local xz = require("lua-xz")
+
+-- the file to compress
+local filename = "README.md"
+
+-- compressed file name
+local compressed_filename = filename .. ".handles.xz"
+
+-- compress README.md passing
+-- file handles straight to exec:
+-- the stream reads the input file
+-- and writes the output file in C
+do
+    local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC32)
+
+    local input = assert(
+        io.open(filename, "rb"),
+        "failed to open " .. filename .. " file for reading"
+    )
+
+    local output = assert(
+        io.open(compressed_filename, "wb"),
+        "failed to open " .. compressed_filename .. " file for writing"
+    )
+
+    -- tip: always check for errors
+    local ok, exec_err = pcall(
+        function()
+            writer_stream:exec(input, output)
+        end
+    )
+
+    -- the files are still owned by Lua,
+    -- so close them as usual
+    writer_stream:close()
+    input:close()
+    output:close()
+
+    -- an error occurred ?
+    if (not ok) then
+        -- raise the error
+        error(exec_err)
+    end
+end
+
+-- decompress it back, mixing
+-- a file handle as producer
+-- and a function as consumer
+local outputs = {}
+do
+    local reader_stream = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, xz.CONCATENATED)
+
+    local input = assert(
+        io.open(compressed_filename, "rb"),
+        "failed to open " .. compressed_filename .. " file for reading"
+    )
+
+    local ok, exec_err = pcall(
+        function()
+            reader_stream:exec(input, function(decompressed_chunk)
+                table.insert(outputs, decompressed_chunk)
+            end)
+        end
+    )
+
+    reader_stream:close()
+    input:close()
+
+    if (not ok) then
+        error(exec_err)
+    end
+end
+
+-- make sure that the decoded data
+-- after compression-decompression
+-- matches the initial content
+local input = assert(
+    io.open(filename, "rb"),
+    "failed to open " .. filename .. " file for reading"
+)
+local content = input:read("*a")
+input:close()
+
+assert(
+    content == table.concat(outputs),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
@@ -0,0 +1,84 @@
+local xz = require("lua-xz")
+
+-- fixed-stride telemetry: records of
+-- 8 bytes holding slowly changing
+-- counters, where the delta filter
+-- turns each byte into the difference
+-- from the byte 8 positions before
+local records = {}
+for i = 1, 20000 do
+    local timestamp = 1000 + 3 * i
+    local level = 500 + (i % 11)
+    records[i] = string.char(
+        timestamp % 256, math.floor(timestamp / 256) % 256, math.floor(timestamp / 65536) % 256, 0,
+        level % 256, math.floor(level / 256) % 256, i % 3, 0
+    )
+end
+local telemetry = table.concat(records)
+
+local function compress(writer_stream, data)
+    local compressed = writer_stream:update(data) .. writer_stream:finish()
+    writer_stream:close()
+    return compressed
+end
+
+-- a filter chain is an array of filters,
+-- applied in order, ending with LZMA2
+local filters = {
+    { id = xz.filter.DELTA, dist = 8 },
+    { id = xz.filter.LZMA2 }
+}
+
+-- the preset still sets the
+-- defaults of the LZMA2 filter
+local with_delta = compress(xz.stream.xzwriter(1, xz.check.CRC32, { filters = filters }), telemetry)
+local without_delta = compress(xz.stream.xzwriter(9, xz.check.CRC32), telemetry)
+
+print(("telemetry: %d bytes, preset 1 + delta: %d bytes, preset 9: %d bytes"):format(#telemetry, #with_delta, #without_delta))
+
+-- the filter chain is stored on
+-- the .xz file, so any reader
+-- decompresses it
+assert(
+    xz.decompress(with_delta) == telemetry,
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
+
+-- raw streams have no headers, so they
+-- can be embedded in another container
+-- format, which has to store the filter
+-- chain on its own: the reader must be
+-- created with the same chain
+local raw_filters = {
+    { id = xz.filter.X86 },
+    { id = xz.filter.LZMA2, preset = 6, dict_size = 1024 * 1024 }
+}
+
+local file = io.open("README.md", "rb")
+if (not file) then
+    error("failed to open README.md file for reading")
+end
+local content = file:read("*a")
+file:close()
+
+local raw = compress(xz.stream.rawwriter(raw_filters), content)
+
+local reader_stream = xz.stream.rawreader(raw_filters)
+local decompressed = reader_stream:update(raw) .. reader_stream:finish()
+reader_stream:close()
+
+assert(
+    decompressed == content,
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
+
+-- filters are identified by their names,
+-- and might be missing on older liblzma
+for _, name in ipairs({ "X86", "ARM64", "RISCV", "DELTA" }) do
+    local id = xz.filter[name]
+    local encoder, decoder = false, false
+    if (id) then
+        encoder, decoder = xz.filter.supported(id)
+    end
+    print(("%s: encoder %s, decoder %s"):format(name, tostring(encoder), tostring(decoder)))
+end
@@ -0,0 +1,93 @@
+local xz = require("lua-xz")
+
+-- simulate content arriving piece by piece
+-- (e.g.: from a socket) to be compressed
+local inputs = {"hello", " ", "incremental", " ", "world"}
+
+-- a table to hold the compressed pieces
+local compressed = {}
+
+--[[ start of encoding ]]
+do
+    -- create a xz writer stream
+    --
+    -- tip: always check for errors
+    local ok, writer_stream = pcall(
+        function()
+            local check = xz.check.supported(xz.check.CRC64) and xz.check.CRC64 or xz.check.CRC32
+            return xz.stream.xzwriter(xz.PRESET_DEFAULT, check)
+        end
+    )
+
+    -- an error occurred ?
+    if (not ok) then
+        -- raise the error
+        error(writer_stream)
+    end
+
+    -- feed each piece as soon as it arrives.
+    -- `update' returns the compressed
+    -- output produced so far, which is
+    -- often an empty string, because
+    -- the encoder buffers data internally
+    for _, input in ipairs(inputs) do
+        table.insert(compressed, writer_stream:update(input))
+    end
+
+    -- `flush' makes everything fed so far
+    -- decodable by the reader on the other side
+    table.insert(compressed, writer_stream:flush())
+
+    -- `finish' ends the stream and
+    -- returns the remaining output
+    table.insert(compressed, writer_stream:finish())
+
+    -- close the xz writer stream to free resources
+    --
+    -- tip: it is automatically freed on garbage collection
+    writer_stream:close()
+end
+--[[ end of encoding]]
+
+--[[ start of decoding ]]
+local outputs = {}
+do
+    -- create a xz reader stream
+    --
+    -- tip: always check for errors
+    local ok, reader_stream = pcall(
+        function()
+            return xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, xz.CONCATENATED)
+        end
+    )
+
+    -- an error occurred ?
+    if (not ok) then
+        -- raise the error
+        error(reader_stream)
+    end
+
+    -- feed the compressed content
+    -- in small pieces to the reader stream
+    local content = table.concat(compressed)
+    local piece_size = 16
+    for i = 1, #content, piece_size do
+        table.insert(outputs, reader_stream:update(content:sub(i, i + piece_size - 1)))
+    end
+
+    -- `finish' checks that the
+    -- compressed content is complete
+    table.insert(outputs, reader_stream:finish())
+
+    -- close the xz reader stream to free resources
+    reader_stream:close()
+end
+--[[ end of decoding]]
+
+-- make sure that the decoded data
+-- after compression-decompression
+-- matches the initial inputs
+assert(
+    table.concat(inputs) == table.concat(outputs),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
@@ -0,0 +1,62 @@
+local xz = require("lua-xz")
+
+-- a few .xz files, as handed to a scheduler
+local lines = {}
+for i = 1, 30000 do
+    lines[i] = ("%d: job output line %d\n"):format(i, i * 13)
+end
+local content = table.concat(lines)
+
+local filenames = {}
+for i, preset in ipairs({ 1, 6, 9 }) do
+    local writer_stream = xz.stream.xzwriter(preset, xz.check.CRC64, { block_size = 128 * 1024 })
+    local compressed = writer_stream:update(content:sub(1, i * 150000)) .. writer_stream:finish()
+    writer_stream:close()
+
+    filenames[i] = os.tmpname()
+    local file = io.open(filenames[i], "wb")
+    if (not file) then
+        error("failed to open " .. filenames[i] .. " file for writing")
+    end
+    file:write(compressed)
+    file:close()
+end
+
+-- the output size and the memory of each
+-- job are known without decompressing
+for _, filename in ipairs(filenames) do
+    local info = xz.info(filename)
+
+    print(("%s: %d -> %d bytes, %d block(s), dictionary of %d bytes, decoder needs %d bytes"):format(
+        filename, info.compressed_size, info.uncompressed_size, #info.blocks, info.dict_size, info.memusage + info.index_memusage
+    ))
+
+    local uncompressed_size = 0
+    for _, block in ipairs(info.blocks) do
+        uncompressed_size = uncompressed_size + block.uncompressed_size
+    end
+
+    assert(uncompressed_size == info.uncompressed_size, "the blocks do not add up to the uncompressed size")
+    assert(info.check == xz.check.CRC64, "check type mismatch")
+
+    os.remove(filename)
+end
+
+-- the header of .lzma files holds
+-- the LZMA options of the data
+local lzma_filename = os.tmpname()
+local lzma_file = io.open(lzma_filename, "wb")
+if (not lzma_file) then
+    error("failed to open " .. lzma_filename .. " file for writing")
+end
+lzma_file:write(xz.lzmacompress(content, 3))
+lzma_file:close()
+
+local lzma_info = xz.info(lzma_filename)
+print(("%s: dictionary of %d bytes, lc = %d, lp = %d, pb = %d, uncompressed size %s"):format(
+    lzma_filename, lzma_info.dict_size, lzma_info.lc, lzma_info.lp, lzma_info.pb, tostring(lzma_info.uncompressed_size or "unknown")
+))
+
+assert(lzma_info.format == "lzma", "format mismatch")
+
+os.remove(lzma_filename)
@@ -0,0 +1,62 @@
+local xz = require("lua-xz")
+
+-- a large, highly redundant log
+local lines = {}
+for i = 1, 50000 do
+    lines[i] = ("2026-01-01 12:%02d:%02d INFO request %d served in %d ms\n"):format(i % 60, i % 59, i % 1000, i % 37)
+end
+local log = table.concat(lines)
+
+-- the options override individual
+-- fields of the preset: a large
+-- dictionary with the hc4 match finder
+-- in the fast mode trades some of the
+-- ratio for a much faster encoder
+local lzma_options = {
+    dict_size = 16 * 1024 * 1024,
+    mf = "hc4",
+    mode = "fast",
+    nice_len = 64
+}
+
+-- the same options described as a filter
+-- chain give the memory the encoder and
+-- the decoder would need beforehand
+local encoder_memusage, decoder_memusage = xz.filter.memusage({
+    {
+        id = xz.filter.LZMA2,
+        preset = 6,
+        dict_size = lzma_options.dict_size,
+        mf = lzma_options.mf,
+        mode = lzma_options.mode,
+        nice_len = lzma_options.nice_len
+    }
+})
+print(("memory usage: encoder %d bytes, decoder %d bytes"):format(encoder_memusage, decoder_memusage))
+
+local writer_stream = xz.stream.xzwriter(6, xz.check.CRC64, lzma_options)
+local compressed = writer_stream:update(log) .. writer_stream:finish()
+local stats = writer_stream:stats()
+writer_stream:close()
+
+assert(
+    stats.memusage == encoder_memusage,
+    "the memory usage of the stream does not match the estimate"
+)
+
+print(("%d bytes compressed to %d bytes in %.3f seconds"):format(#log, #compressed, stats.time_code))
+
+assert(
+    xz.decompress(compressed) == log,
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
+
+-- .lzma writers take the same options
+local lzma_writer_stream = xz.stream.lzmawriter(6, { dict_size = 1024 * 1024, lc = 4, lp = 0, pb = 0 })
+local lzma_compressed = lzma_writer_stream:update(log) .. lzma_writer_stream:finish()
+lzma_writer_stream:close()
+
+assert(
+    xz.lzmadecompress(lzma_compressed) == log,
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
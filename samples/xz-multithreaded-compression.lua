@@ -0,0 +1,192 @@
+local xz = require("lua-xz")
+
+-- the file to compress
+local filename = "README.md"
+
+-- compressed file name
+local compressed_filename = filename .. ".mt.xz"
+
+-- read the whole content of the file
+-- to be matched against the output
+-- of a compression-decompression
+local content
+do
+    local input = assert(
+        io.open(filename, "rb"),
+        "failed to open " .. filename .. " file for reading"
+    )
+    content = input:read("*a")
+    input:close()
+end
+
+--[[ start of encoding ]]
+do
+    -- create a multithreaded xz writer stream
+    --
+    -- third parameter:
+    --  options:
+    --    threads:
+    --      number of worker threads,
+    --      or "auto" to use the number
+    --      of processor cores
+    --    block_size:
+    --      maximum uncompressed size of a block
+    --      (0 lets liblzma choose it)
+    --    timeout:
+    --      timeout in milliseconds
+    --      (0 disables the timeout)
+    --
+    -- tip: always check for errors
+    local ok, writer_stream = pcall(
+        function()
+            local check = xz.check.supported(xz.check.CRC64) and xz.check.CRC64 or xz.check.CRC32
+            return xz.stream.xzwriter(xz.PRESET_DEFAULT, check, {
+                threads = "auto",
+                block_size = 4 * 1024,
+                timeout = 0
+            })
+        end
+    )
+
+    -- an error occurred ?
+    if (not ok) then
+        -- raise the error
+        error(writer_stream)
+    end
+
+    -- open / create the output file to hold
+    -- the compressed data
+    local output = assert(
+        io.open(compressed_filename, "wb"),
+        "failed to open " .. compressed_filename .. " file for writing"
+    )
+
+    -- define a producer function
+    -- to feed uncompressed data
+    -- to be encoded by the xz writer stream
+    local position = 1
+    local function producer()
+        local chunk_size = 1024
+        local chunk
+        if (position <= #content) then
+            chunk = content:sub(position, position + chunk_size - 1)
+            position = position + chunk_size
+        end
+        return chunk
+    end
+
+    -- define a consumer function
+    -- to handle compressed chunks
+    -- emitted by the xz writer stream
+    local function consumer(compressed_chunk)
+        output:write(compressed_chunk)
+    end
+
+    do
+        -- execute the stream
+        --
+        -- tip: always check for errors
+        local ok, exec_err = pcall(
+            function()
+                writer_stream:exec(producer, consumer)
+            end
+        )
+
+        -- an error occurred ?
+        if (not ok) then
+            -- close the stream
+            writer_stream:close()
+
+            -- close files
+            output:close()
+
+            -- raise the error
+            error(exec_err)
+        end
+    end
+
+    -- close the xz writer stream to free resources
+    writer_stream:close()
+
+    -- close the output file
+    output:close()
+end
+--[[ end of encoding]]
+
+--[[ start of decoding ]]
+local outputs = {}
+do
+    -- create a multithreaded xz reader stream
+    --
+    -- third parameter:
+    --  options:
+    --    threads:
+    --      number of worker threads,
+    --      or "auto" to use the number
+    --      of processor cores
+    --    memlimit_threading:
+    --      soft memory limit that reduces
+    --      the number of threads
+    --    timeout:
+    --      timeout in milliseconds
+    --      (0 disables the timeout)
+    --
+    -- note: the first parameter (memlimit)
+    --       is the hard memory limit
+    --
+    -- tip: always check for errors
+    local ok, reader_stream = pcall(
+        function()
+            return xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, xz.CONCATENATED, {
+                threads = "auto",
+                memlimit_threading = 256 * 1024 * 1024,
+                timeout = 0
+            })
+        end
+    )
+
+    -- an error occurred ?
+    if (not ok) then
+        -- raise the error
+        error(reader_stream)
+    end
+
+    local input = assert(
+        io.open(compressed_filename, "rb"),
+        "failed to open " .. compressed_filename .. " file for reading"
+    )
+
+    local function producer()
+        return input:read(8 * 1024)
+    end
+
+    local function consumer(decompressed_chunk)
+        table.insert(outputs, decompressed_chunk)
+    end
+
+    do
+        local ok, exec_err = pcall(
+            function()
+                reader_stream:exec(producer, consumer)
+            end
+        )
+
+        if (not ok) then
+            reader_stream:close()
+            input:close()
+            error(exec_err)
+        end
+    end
+
+    reader_stream:close()
+    input:close()
+end
+--[[ end of decoding]]
+
+-- make sure that the decoded data
+-- after compression-decompression
+-- matches the initial content
+assert(
+    content == table.concat(outputs),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
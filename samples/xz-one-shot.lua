@@ -0,0 +1,37 @@
+local xz = require("lua-xz")
+
+-- a small payload (e.g.: a cache entry)
+local payload = ("lua-xz compresses small payloads at once. "):rep(20)
+
+-- compress to .xz format at once
+--
+-- note:
+--  1) the preset and the check
+--     are optional
+--  2) tip: always check for errors
+local ok, compressed = pcall(xz.compress, payload, xz.PRESET_DEFAULT, xz.check.CRC32)
+
+-- an error occurred ?
+if (not ok) then
+    -- raise the error
+    error(compressed)
+end
+
+-- decompress from .xz format at once
+--
+-- note: the memory limit is optional
+local decompressed = assert(xz.decompress(compressed, xz.MEMLIMIT_UNLIMITED))
+
+-- make sure that the decoded data
+-- after compression-decompression
+-- matches the initial payload
+assert(
+    payload == decompressed,
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
+
+-- the same applies to the .lzma format
+assert(
+    payload == xz.lzmadecompress(xz.lzmacompress(payload)),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
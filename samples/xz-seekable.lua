@@ -0,0 +1,92 @@
+local xz = require("lua-xz")
+
+-- the file to compress
+local filename = "README.md"
+
+-- compressed file name
+local compressed_filename = filename .. ".seekable.xz"
+
+-- read the whole content of the file
+-- to be matched against the ranges
+-- read from the seekable reader
+local content
+do
+    local input = assert(
+        io.open(filename, "rb"),
+        "failed to open " .. filename .. " file for reading"
+    )
+    content = input:read("*a")
+    input:close()
+end
+
+-- compress the file in blocks of 4 KB.
+--
+-- note: random access is only as fine as
+-- the blocks of the file
+xz.compress_file(filename, compressed_filename, {
+    block_size = 4 * 1024
+})
+
+-- ranges (0-based offset, length) to read
+local ranges = {
+    { 0, 100 },
+    { 4000, 200 },
+    { #content - 50, 100 },
+    { 5000, 10000 },
+    { 5000 + 10000, 300 }
+}
+
+-- read ranges from the compressed file
+do
+    -- tip: always check for errors
+    local ok, reader = pcall(xz.seekable, compressed_filename)
+
+    -- an error occurred ?
+    if (not ok) then
+        -- raise the error
+        error(reader)
+    end
+
+    assert(reader:size() == #content, "size mismatch")
+
+    for _, range in ipairs(ranges) do
+        local offset, length = range[1], range[2]
+        assert(
+            reader:read(offset, length) == content:sub(offset + 1, offset + length),
+            "range mismatch: the data read did not match the initial input"
+        )
+    end
+
+    reader:close()
+end
+
+-- read ranges through a read-at function,
+-- e.g.: to serve ranges of files stored
+-- elsewhere (here, in memory)
+do
+    local input = assert(
+        io.open(compressed_filename, "rb"),
+        "failed to open " .. compressed_filename .. " file for reading"
+    )
+    local compressed = input:read("*a")
+    input:close()
+
+    local reader = xz.seekable(
+        function(offset, length)
+            return compressed:sub(offset + 1, offset + length)
+        end,
+        {
+            size = #compressed
+        }
+    )
+
+    for _, range in ipairs(ranges) do
+        local offset, length = range[1], range[2]
+        assert(
+            reader:read(offset, length) == content:sub(offset + 1, offset + length),
+            "range mismatch: the data read did not match the initial input"
+        )
+    end
+
+    reader:close()
+end
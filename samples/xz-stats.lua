@@ -0,0 +1,57 @@
+local xz = require("lua-xz")
+
+-- the file to compress
+local filename = "README.md"
+
+local input = assert(
+    io.open(filename, "rb"),
+    "failed to open " .. filename .. " file for reading"
+)
+
+local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC32)
+
+local outputs = {}
+local function consumer(compressed_chunk)
+    table.insert(outputs, compressed_chunk)
+end
+
+-- the progress function is called
+-- every `progress_interval' bytes
+-- of input, and when the stream ends
+local progress_calls = 0
+local function progress(total_in, total_out)
+    progress_calls = progress_calls + 1
+    print(("progress: %d bytes in, %d bytes out"):format(total_in, total_out))
+end
+
+-- tip: always check for errors
+local ok, exec_err = pcall(
+    function()
+        writer_stream:exec(input, consumer, {
+            progress = progress,
+            progress_interval = 4 * 1024
+        })
+    end
+)
+
+input:close()
+
+-- an error occurred ?
+if (not ok) then
+    writer_stream:close()
+    error(exec_err)
+end
+
+assert(progress_calls > 0)
+
+-- statistics of the stream
+local stats = writer_stream:stats()
+writer_stream:close()
+
+assert(stats.total_out == #table.concat(outputs))
+
+print(("ratio: %.3f"):format(stats.ratio))
+print(("memory usage: %d bytes"):format(stats.memusage))
+print(("time in liblzma: %.6f s"):format(stats.time_code))
+print(("time in the producer: %.6f s"):format(stats.time_producer))
+print(("time in the consumer: %.6f s"):format(stats.time_consumer))
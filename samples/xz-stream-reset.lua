@@ -0,0 +1,54 @@
+local xz = require("lua-xz")
+
+-- many small independent payloads
+-- (e.g.: cache entries)
+local payloads = {}
+for i = 1, 100 do
+    payloads[i] = ("payload number %d. "):format(i):rep(i)
+end
+
+-- runs the stream on a single payload
+local function run(stream, data)
+    local done = false
+    local outputs = {}
+    stream:exec(
+        function()
+            if (not done) then
+                done = true
+                return data
+            end
+        end,
+        function(chunk)
+            table.insert(outputs, chunk)
+        end
+    )
+    return table.concat(outputs)
+end
+
+-- a single writer stream and a single
+-- reader stream are recycled through
+-- `reset' for all the payloads, instead of
+-- creating new streams for each one of them
+local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC32)
+local reader_stream = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0)
+
+for i, payload in ipairs(payloads) do
+    local compressed = run(writer_stream, payload)
+
+    -- each payload is a complete .xz stream
+    assert(
+        payload == run(reader_stream, compressed),
+        "compression-decompression mismatch: the final output did not match the initial input"
+    )
+
+    -- get the streams ready for the next payload
+    --
+    -- note: the preset and the check of the writer
+    --       (or the memlimit and the flags of the reader)
+    --       might be changed on reset
+    writer_stream:reset()
+    reader_stream:reset()
+end
+
+writer_stream:close()
+reader_stream:close()
@@ -0,0 +1,100 @@
+local xz = require("lua-xz")
+
+-- simulates the shipping of a log over
+-- a long-lived connection: every message
+-- must be decodable by the receiver as soon
+-- as it is sent, instead of when the
+-- compressed stream ends
+
+-- messages to ship
+local messages = {}
+for i = 1, 300 do
+    messages[i] = ("%d: user %d logged in\n"):format(i, i % 17)
+end
+
+-- the receiver decompresses
+-- whatever arrives right away
+local receiver = xz.stream.xzreader(xz.MEMLIMIT_UNLIMITED, 0)
+local received = {}
+
+local function receive(compressed_chunk)
+    table.insert(received, receiver:update(compressed_chunk))
+end
+
+-- the sender compresses the messages
+local sender = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC32)
+local sent = {}
+local i = 0
+
+-- tip: always check for errors
+local ok, exec_err = pcall(
+    function()
+        sender:exec(
+            function()
+                -- whatever was sent so far
+                -- was received as well
+                assert(
+                    table.concat(received) == table.concat(sent),
+                    "the receiver is behind the sender"
+                )
+
+                i = i + 1
+                if (i <= #messages) then
+                    table.insert(sent, messages[i])
+
+                    -- the second value flushes
+                    -- the stream after the message
+                    return messages[i], xz.SYNC_FLUSH
+                end
+            end,
+            receive
+        )
+    end
+)
+
+sender:close()
+
+-- an error occurred ?
+if (not ok) then
+    -- raise the error
+    error(exec_err)
+end
+
+table.insert(received, receiver:finish())
+receiver:close()
+
+assert(
+    table.concat(received) == table.concat(messages),
+    "compression-decompression mismatch: the final output did not match the initial input"
+)
+
+-- alternatively, an auto-flush policy
+-- bounds the latency without asking
+-- the producer to flush: here, after
+-- every 1 KB of input or half a second
+do
+    local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC32)
+    local outputs = {}
+    local j = 0
+
+    writer_stream:exec(
+        function()
+            j = j + 1
+            return messages[j]
+        end,
+        function(compressed_chunk)
+            table.insert(outputs, compressed_chunk)
+        end,
+        {
+            flush_bytes = 1024,
+            flush_interval = 0.5
+        }
+    )
+
+    writer_stream:close()
+
+    assert(
+        xz.decompress(table.concat(outputs)) == table.concat(messages),
+        "compression-decompression mismatch: the final output did not match the initial input"
+    )
+end
@@ -0,0 +1,42 @@
+local xz = require("lua-xz")
+
+-- a backup made of several blocks
+local lines = {}
+for i = 1, 20000 do
+    lines[i] = ("%d,backup record %d,%d\n"):format(i, i * 31, i % 97)
+end
+local content = table.concat(lines)
+
+local writer_stream = xz.stream.xzwriter(xz.PRESET_DEFAULT, xz.check.CRC64, { block_size = 64 * 1024 })
+local compressed = writer_stream:update(content) .. writer_stream:finish()
+writer_stream:close()
+
+-- verifies the data without
+-- creating the uncompressed string
+local result = xz.test(compressed)
+
+print(("%d bytes in %d block(s) of %d stream(s) verified in %.3f seconds"):format(result.uncompressed_size, result.blocks, result.streams, result.time))
+
+assert(result.uncompressed_size == #content, "uncompressed size mismatch")
+assert(result.check == xz.check.CRC64, "check type mismatch")
+
+-- the same for files
+local filename = os.tmpname()
+local file = io.open(filename, "wb")
+if (not file) then
+    error("failed to open " .. filename .. " file for writing")
+end
+file:write(compressed)
+file:close()
+
+local file_result = xz.test_file(filename)
+assert(file_result.uncompressed_size == #content and file_result.blocks == result.blocks, "file verification mismatch")
+
+-- a corrupted byte is caught by
+-- the integrity checks
+local corrupted = compressed:sub(1, 100) .. string.char((compressed:byte(101) + 1) % 256) .. compressed:sub(102)
+local ok, err = pcall(xz.test, corrupted)
+print(("corrupted data: %s"):format(tostring(err)))
+assert(not ok, "the corrupted data was not detected")
+
+os.remove(filename)
@@ -22,12 +22,56 @@
 ** SOFTWARE.
 */
 
+/* 64-bit file offsets on 32-bit POSIX platforms */
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+/*
+** declare fileno, clock_gettime (with CLOCK_MONOTONIC)
+** and the mmap / stat functions even on strict
+** C modes (e.g.: -std=c99), unless the build
+** already picked a feature-test macro
+*/
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "lua-xz.h"
 
 #include <lauxlib.h>
+#include <limits.h>
 #include <lualib.h>
 #include <lzma.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+/* SRWLOCK requires Windows Vista or newer */
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LUA_XZ_HAS_MMAP
+#endif
+/* fseeko / ftello are declared by POSIX.1-2001 or newer */
+#if defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+#define LUA_XZ_HAS_FSEEKO
+#endif
+#endif
 
 /*
 ** Define LUA_XZ_MEMLIMIT_UNLIMITED
@@ -76,6 +120,26 @@
 #endif
 #endif
 
+/*
+** maximum number of threads
+** accepted by liblzma. It mirrors
+** the internal LZMA_THREADS_MAX
+** of liblzma, which is not
+** exported by its public headers.
+*/
+#ifndef LUA_XZ_THREADS_MAX
+#define LUA_XZ_THREADS_MAX 16384
+#endif
+
+/*
+** the multithreaded decoder
+** (lzma_stream_decoder_mt)
+** is available since liblzma 5.4.0
+*/
+#if LZMA_VERSION >= 50040002
+#define LUA_XZ_HAS_STREAM_DECODER_MT
+#endif
+
 /* start of auxiliary functions */
 #if LUA_VERSION_NUM < 503
 static int lua_xz_aux_isinteger(lua_State *L, int idx)
@@ -91,650 +155,7078 @@ static int lua_xz_aux_isinteger(lua_State *L, int idx)
 #else
 #define lua_xz_aux_isinteger lua_isinteger
 #endif
-/* end of auxiliary functions */
-
-/* start of lua_xz_aux_buffers */
-#define LUA_XZ_AUX_BUFFERS_METATABLE "lua_xz_aux_buffers_metatable"
 
-typedef struct taglua_xz_aux_buffers
+/*
+** prepares space of (at most) `*size' bytes
+** on the buffer `B'. On Lua 5.1, the
+** space is limited to LUAL_BUFFERSIZE
+** bytes, and `*size' is updated accordingly
+*/
+static char *lua_xz_aux_prepbuffsize(luaL_Buffer *B, size_t *size)
 {
-    /* size of the input buffer */
-    size_t input_buffer_size;
-
-    /* input buffer */
-    uint8_t *input_buffer;
-
-    /* size of the output buffer*/
-    size_t output_buffer_size;
+#if LUA_VERSION_NUM < 502
+    *size = LUAL_BUFFERSIZE;
+    return luaL_prepbuffer(B);
+#else
+    return luaL_prepbuffsize(B, *size);
+#endif
+}
 
-    /*
-    ** note:
-    **   output_buffer member must be the last
-    **   field of the lua_xz_aux_buffers.
-    **   The reason is that we follow
-    **   the same idea employed by
-    **   Roberto Ierusalimschy in the
-    **   double array example on PIL.
-    **   In short, we allocate
-    **   a struct with size
-    **   sizeof(lua_xz_aux_buffers) + (output_buffer_size - 1) * sizeof(uint8_t)
-    **   at userdata creation. 
-    */
-    uint8_t output_buffer[1];
-} lua_xz_aux_buffers;
+#if LUA_VERSION_NUM < 502
+#define lua_xz_aux_rawlen lua_objlen
+#else
+#define lua_xz_aux_rawlen lua_rawlen
+#endif
 
-/* resizes the input buffer */
-static void *lua_xz_aux_buffers_resize_input_buffer(lua_State *L, int index, size_t new_size)
+/*
+** checks a compression preset,
+** given either as an integer [0, 9] or as
+** a string "0", ..., "9", "0e", ..., "9e"
+*/
+static uint32_t lua_xz_aux_checkpreset(lua_State *L, int arg)
 {
-    void *ud;
-    lua_Alloc allocf = lua_getallocf(L, &ud);
-    lua_xz_aux_buffers *b = (lua_xz_aux_buffers *)lua_touserdata(L, index);
-    void *temp = allocf(ud, b->input_buffer, b->input_buffer_size, new_size);
-    if (temp == NULL && new_size > 0)
+    lua_Integer arg_preset;
+    size_t arg_preset_str_len;
+    const char *arg_preset_str;
+    int first_preset_char;
+    uint32_t preset = LZMA_PRESET_DEFAULT;
+
+    if (lua_xz_aux_isinteger(L, arg))
     {
-        luaL_error(L, "Failed to allocate memory to resize the auxiliary buffer");
+        arg_preset = lua_tointeger(L, arg);
+        luaL_argcheck(L, 0 <= arg_preset && arg_preset <= 9, arg, "preset must be an integer in the interval [0, 9]");
+        preset = (uint32_t)arg_preset;
+    }
+    else if (lua_isstring(L, arg))
+    {
+        arg_preset_str = lua_tolstring(L, arg, &arg_preset_str_len);
+        luaL_argcheck(L, 1 <= arg_preset_str_len && arg_preset_str_len <= 2, arg, "preset must be a string with length 1 or 2");
+        first_preset_char = arg_preset_str[0] - '0';
+        luaL_argcheck(L, 0 <= first_preset_char && first_preset_char <= 9, arg, "first char of preset must be a digit between 0 and 9");
+        preset = (uint32_t)first_preset_char;
+        if (arg_preset_str_len == 2)
+        {
+            luaL_argcheck(L, arg_preset_str[1] == 'e', arg, "when specified, the second char of preset must be e");
+            preset |= LZMA_PRESET_EXTREME;
+        }
+    }
+    else
+    {
+        luaL_error(L, "Invalid preset type");
     }
-    b->input_buffer = (uint8_t *)temp;
-    b->input_buffer_size = new_size;
-    return temp;
-}
 
-static int lua_xz_aux_buffers_gc(lua_State *L)
-{
-    lua_xz_aux_buffers_resize_input_buffer(L, 1, 0);
-    return 0;
+    return preset;
 }
 
-static const luaL_Reg lua_xz_aux_buffers_functions[] = {
-    { "__gc", lua_xz_aux_buffers_gc },
-    { NULL, NULL }
-};
+/*
+** maximum size of the scratch buffer
+** kept alive between calls of the
+** one-shot functions
+*/
+#ifndef LUA_XZ_SCRATCH_CACHE_SIZE
+#define LUA_XZ_SCRATCH_CACHE_SIZE (1024 * 1024)
+#endif
 
-static lua_xz_aux_buffers *lua_xz_aux_buffers_new(lua_State *L, size_t output_buffer_size)
+#define LUA_XZ_SCRATCH_KEY "lua_xz_scratch"
+
+/*
+** pushes a scratch buffer of
+** at least `size' bytes onto the stack.
+** 
+** Buffers up to LUA_XZ_SCRATCH_CACHE_SIZE bytes
+** are cached on the registry to be
+** reused by subsequent calls, so that
+** the one-shot functions on small payloads
+** only allocate the resulting string.
+*/
+static void *lua_xz_aux_pushscratch(lua_State *L, size_t size)
 {
-    lua_xz_aux_buffers *b;
-    void *ud = lua_newuserdata(L, sizeof(lua_xz_aux_buffers) + (output_buffer_size - 1) * sizeof(uint8_t));
-    if (ud == NULL)
+    void *scratch;
+
+    if (size == 0)
     {
-        luaL_error(L, "Failed to allocate memory for the auxiliary buffer");
+        size = 1;
     }
 
-    if (luaL_newmetatable(L, LUA_XZ_AUX_BUFFERS_METATABLE) > 0)
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_XZ_SCRATCH_KEY);
+    if (lua_type(L, -1) == LUA_TUSERDATA && lua_xz_aux_rawlen(L, -1) >= size)
     {
-#if LUA_VERSION_NUM < 502
-        luaL_register(L, NULL, lua_xz_aux_buffers_functions);
-#else
-        luaL_setfuncs(L, lua_xz_aux_buffers_functions, 0);
-#endif        
+        return lua_touserdata(L, -1);
     }
-    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
 
-    b = (lua_xz_aux_buffers *)ud;
-    b->input_buffer = NULL;
-    b->input_buffer_size = 0;
-    b->output_buffer_size = output_buffer_size;
+    scratch = lua_newuserdata(L, size);
+    if (scratch == NULL)
+    {
+        luaL_error(L, "Failed to allocate memory for the scratch buffer");
+    }
 
-    return b;
+    if (size <= LUA_XZ_SCRATCH_CACHE_SIZE)
+    {
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_XZ_SCRATCH_KEY);
+    }
+
+    return scratch;
 }
-/* end of lua_xz_aux_buffers */
 
-/* start of lua_xz */
-#define LUA_XZ_METATABLE "lua_xz_metatable"
+/*
+** largest ratio between the uncompressed
+** size claimed by the headers or the indexes
+** of an input and the size of the input,
+** for the output to be allocated at once
+*/
+#ifndef LUA_XZ_TRUSTED_RATIO
+#define LUA_XZ_TRUSTED_RATIO 64
+#endif
 
-static int lua_xz_newindex(lua_State *L)
+/*
+** whether the uncompressed `size' claimed
+** by an input of `in_size' bytes can be
+** allocated at once: up to `memlimit' when
+** one is given, or up to LUA_XZ_TRUSTED_RATIO
+** times the input (and at least the scratch
+** cache) otherwise. Larger claims are
+** decoded into a growing buffer instead
+*/
+static int lua_xz_aux_trustsize(uint64_t size, size_t in_size, uint64_t memlimit)
 {
-    return luaL_error(L, "Read-only object");
-}
-/* end of lua_xz */
+    uint64_t bound;
 
-/* start of lua_xz_check */
-#define LUA_XZ_CHECK_METATABLE "lua_xz_check_metatable"
+    if (size >= (uint64_t)SIZE_MAX)
+    {
+        return 0;
+    }
 
-static int lua_xz_check_is_supported(lua_State *L)
-{
-    lua_Integer arg_check = luaL_checkinteger(L, 1);
-    lzma_check check = (lzma_check)arg_check;
-    lzma_bool result = lzma_check_is_supported(check);
-    lua_pushboolean(L, result);
-    return 1;
-}
+    if (memlimit != UINT64_MAX)
+    {
+        return size <= memlimit;
+    }
 
-static int lua_xz_check_size(lua_State *L)
-{
-    lua_Integer arg_check = luaL_checkinteger(L, 1);
-    lzma_check check = (lzma_check)arg_check;
-    uint32_t size = lzma_check_size(check);
-    lua_pushboolean(L, size);
-    return 1;
+    bound = (uint64_t)in_size <= UINT64_MAX / LUA_XZ_TRUSTED_RATIO ? (uint64_t)in_size * LUA_XZ_TRUSTED_RATIO : UINT64_MAX;
+    if (bound < LUA_XZ_SCRATCH_CACHE_SIZE)
+    {
+        bound = LUA_XZ_SCRATCH_CACHE_SIZE;
+    }
+
+    return size <= bound;
 }
 
-static int lua_xz_check_newindex(lua_State *L)
+/*
+** pushes the field `key' of
+** the options table at `index'
+** onto the stack, and returns
+** its type. When there is no
+** options table at `index',
+** it pushes nil.
+*/
+static int lua_xz_aux_getoption(lua_State *L, int index, const char *key)
 {
-    return luaL_error(L, "Read-only object");
+    if (lua_istable(L, index))
+    {
+        lua_getfield(L, index, key);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+    return lua_type(L, -1);
 }
 
-static const luaL_Reg lua_xz_check_functions[] = {
-    { "supported", lua_xz_check_is_supported },
-    { "size", lua_xz_check_size },
-    {NULL, NULL}
-};
-/* end of lua_xz_check */
-
-/* start of lua_xz_stream */
-typedef struct taglua_xz_stream {
+/*
+** reads the number of threads
+** from the field `threads' of
+** the options table at `index'.
+** 
+** Returns 0 when the field is absent,
+** and lzma_cputhreads() when the field
+** is "auto" or 0.
+*/
+static uint32_t lua_xz_aux_optthreads(lua_State *L, int index)
+{
+    uint32_t threads = 0;
+    lua_Integer arg_threads;
+    int type = lua_xz_aux_getoption(L, index, "threads");
 
-    lzma_stream strm;
-    int is_writer;
-    int is_xz;
-    int executed;
-    int is_closed;
+    if (type == LUA_TSTRING && strcmp(lua_tostring(L, -1), "auto") == 0)
+    {
+        arg_threads = 0;
+    }
+    else if (type == LUA_TNUMBER && lua_xz_aux_isinteger(L, -1))
+    {
+        arg_threads = lua_tointeger(L, -1);
+        luaL_argcheck(L, 0 <= arg_threads && arg_threads <= LUA_XZ_THREADS_MAX, index, "threads must be \"auto\" or an integer in the interval [0, 16384]");
+    }
+    else if (type == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+    else
+    {
+        lua_pop(L, 1);
+        return (uint32_t)luaL_argerror(L, index, "threads must be \"auto\" or an integer");
+    }
 
-    /* options to lzma encoder */
-    lzma_options_lzma opt_lzma;
+    lua_pop(L, 1);
 
-} lua_xz_stream;
+    if (arg_threads == 0)
+    {
+        threads = lzma_cputhreads();
+        if (threads == 0)
+        {
+            threads = 1;
+        }
+    }
+    else
+    {
+        threads = (uint32_t)arg_threads;
+    }
 
-#define LUA_XZ_STREAM_METATABLE "lua_xz_stream_metatable"
+    return threads;
+}
 
-static lua_xz_stream *lua_xz_check_stream(lua_State *L, int index)
+/*
+** converts a memory limit
+** given by Lua to the
+** value expected by liblzma
+*/
+static uint64_t lua_xz_aux_tomemlimit(lua_Integer arg_memlimit)
 {
-    void *ud = luaL_checkudata(L, index, LUA_XZ_STREAM_METATABLE);
-    luaL_argcheck(L, ud != NULL, index, "lua_xz_stream expected");
-    return (lua_xz_stream *)ud;
+    if (arg_memlimit == LUA_XZ_MEMLIMIT_UNLIMITED)
+    {
+        return UINT64_MAX;
+    }
+    else if (arg_memlimit == 0)
+    {
+        return 1;
+    }
+    return (uint64_t)arg_memlimit;
 }
 
-static lua_xz_stream *lua_xz_check_active_stream(lua_State *L, int index)
+/* checks a memory limit argument */
+static uint64_t lua_xz_aux_checkmemlimit(lua_State *L, int arg)
 {
-    lua_xz_stream *stream = lua_xz_check_stream(L, index);
-    luaL_argcheck(L, !stream->executed, 1, "lua_xz_stream cannot be used after it was executed");
-    luaL_argcheck(L, !stream->is_closed, 1, "lua_xz_stream cannot be used after it was closed");
-    return stream;
+    lua_Integer arg_memlimit = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, arg_memlimit == LUA_XZ_MEMLIMIT_UNLIMITED || arg_memlimit >= 0, arg, "memlimit must be an integer greater than or equal to 0");
+    return lua_xz_aux_tomemlimit(arg_memlimit);
 }
 
-static int lua_xz_stream_new(lua_State *L, int is_xz, int is_writer)
+/*
+** reads a memory limit
+** from the field `key' of the
+** options table at `index',
+** or `def' when it is absent
+*/
+static uint64_t lua_xz_aux_optmemlimit(lua_State *L, int index, const char *key, uint64_t def)
 {
-    /* writer variables and args */
-    lua_Integer arg_preset;
-    size_t arg_preset_str_len;
-    const char *arg_preset_str;
-    int first_preset_char;
-    lua_Integer arg_check;
-
-    uint32_t preset;
-    lzma_check check;
-
-    /* reader variables and args */
+    uint64_t memlimit = def;
     lua_Integer arg_memlimit;
-    uint64_t memlimit;
-    lua_Integer arg_flags;
-    uint32_t flags;
-
-    /* variables for both */
-    lua_xz_stream *stream;
-    lzma_ret ret;
-    void *ud;
 
-    ud = lua_newuserdata(L, sizeof(lua_xz_stream));
-    if (ud == NULL)
+    if (lua_xz_aux_getoption(L, index, key) != LUA_TNIL)
     {
-        return luaL_error(L, "Failed to create lua_xz_stream userdata");
+        if (!lua_xz_aux_isinteger(L, -1) || ((arg_memlimit = lua_tointeger(L, -1)) != LUA_XZ_MEMLIMIT_UNLIMITED && arg_memlimit < 0))
+        {
+            lua_pop(L, 1);
+            return (uint64_t)luaL_error(L, "option %s must be an integer greater than or equal to 0", key);
+        }
+        memlimit = lua_xz_aux_tomemlimit(arg_memlimit);
     }
 
-    luaL_getmetatable(L, LUA_XZ_STREAM_METATABLE);
-    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+    return memlimit;
+}
 
-    stream = (lua_xz_stream *)ud;
-    memset(&stream->strm, 0, sizeof(lzma_stream));
-    stream->is_writer = is_writer;
-    stream->executed = 0;
-    stream->is_closed = 0;
+/*
+** reads a non-negative integer
+** from the field `key' of the
+** options table at `index',
+** or `def' when it is absent
+*/
+static lua_Integer lua_xz_aux_optinteger(lua_State *L, int index, const char *key, lua_Integer def)
+{
+    lua_Integer value = def;
+    int type = lua_xz_aux_getoption(L, index, key);
 
-    if (is_writer)
+    if (type != LUA_TNIL)
     {
-        preset = LZMA_PRESET_DEFAULT;
-        if (lua_xz_aux_isinteger(L, 1))
-        {
-            arg_preset = lua_tointeger(L, 1);
-            luaL_argcheck(L, 0 <= arg_preset && arg_preset <= 9, 1, "preset must be an integer in the interval [0, 9]");
-            preset = (uint32_t)arg_preset;
-        }
-        else if (lua_isstring(L, 1))
+        if (type != LUA_TNUMBER || !lua_xz_aux_isinteger(L, -1))
         {
-            arg_preset_str = lua_tolstring(L, 1, &arg_preset_str_len);
-            luaL_argcheck(L, 1 <= arg_preset_str_len && arg_preset_str_len <= 2, 1, "preset must be a string with length 1 or 2");
-            first_preset_char = arg_preset_str[0] - '0';
-            luaL_argcheck(L, 0 <= first_preset_char && first_preset_char <= 9, 1, "first char of preset must be a digit between 0 and 9");
-            preset = (uint32_t)first_preset_char;
-            if (arg_preset_str_len == 2)
-            {
-                luaL_argcheck(L, arg_preset_str[1] == 'e', 1, "when specified, the second char of preset must be e");
-                preset |= LZMA_PRESET_EXTREME;
-            }
+            lua_pop(L, 1);
+            return luaL_error(L, "option %s must be an integer", key);
         }
-        else
+
+        value = lua_tointeger(L, -1);
+        if (value < 0)
         {
-            return luaL_error(L, "Invalid preset type");
+            lua_pop(L, 1);
+            return luaL_error(L, "option %s must be greater than or equal to 0", key);
         }
+    }
 
-        if (is_xz)
-        {
-            arg_check = luaL_checkinteger(L, 2);
-            check = (lzma_check)arg_check;
-    
-            ret = lzma_easy_encoder(
-                &stream->strm,
-                preset,
-                check);
+    lua_pop(L, 1);
+    return value;
+}
 
-            if (ret != LZMA_OK)
-            {
-                switch (ret)
-                {
-                case LZMA_MEM_ERROR:
-                    return luaL_error(L, "Memory allocation failed");
-                case LZMA_OPTIONS_ERROR:
-                    return luaL_error(L, "The given compression preset is not supported by this build of liblzma");
-                case LZMA_UNSUPPORTED_CHECK:
-                    return luaL_error(L, "The given check type is not supported by this build of liblzma");
-                case LZMA_PROG_ERROR:
-                    return luaL_error(L, "One or more of the parameters have values that will never be valid");
-                default:
-                    return luaL_error(L, "Failed to create lzma_easy_encoder");
-                }
+/*
+** gets the integer option `key' as
+** lua_xz_aux_optinteger does, rejecting
+** values that do not fit in 32 bits
+*/
+static uint32_t lua_xz_aux_optuint32(lua_State *L, int index, const char *key, uint32_t def)
+{
+    lua_Integer value = lua_xz_aux_optinteger(L, index, key, (lua_Integer)def);
+
+    if ((uint64_t)value > (uint64_t)UINT32_MAX)
+    {
+        return (uint32_t)luaL_error(L, "option %s must be less than or equal to 4294967295", key);
+    }
+
+    return (uint32_t)value;
+}
+/*
+** returns the userdata at `index' when
+** its metatable is the one registered
+** as `tname', or NULL otherwise
+*/
+#if LUA_VERSION_NUM < 502
+static void *lua_xz_aux_testudata(lua_State *L, int index, const char *tname)
+{
+    void *ud = lua_touserdata(L, index);
+    if (ud != NULL && lua_getmetatable(L, index))
+    {
+        luaL_getmetatable(L, tname);
+        if (!lua_rawequal(L, -1, -2))
+        {
+            ud = NULL;
+        }
+        lua_pop(L, 2);
+        return ud;
+    }
+    return NULL;
+}
+#else
+#define lua_xz_aux_testudata luaL_testudata
+#endif
+
+/*
+** raises the error of a closed file handle,
+** blaming the argument at `index' unless
+** the handle was pushed by the library
+*/
+static void lua_xz_aux_closedfile(lua_State *L, int index)
+{
+    if (index > 0)
+    {
+        luaL_argerror(L, index, "attempt to use a closed file");
+    }
+    else
+    {
+        luaL_error(L, "attempt to use a closed file");
+    }
+}
+
+/*
+** returns the FILE* of the standard
+** Lua file handle at `index', or NULL
+** when the value is not a file handle.
+** 
+** Raises an error on closed file handles.
+*/
+static FILE *lua_xz_aux_tofile(lua_State *L, int index)
+{
+#if LUA_VERSION_NUM < 502
+    /*
+    ** on Lua 5.1 and LuaJIT,
+    ** the userdata starts with the FILE*,
+    ** which is NULL after the file was closed
+    */
+    FILE **p = (FILE **)lua_xz_aux_testudata(L, index, LUA_FILEHANDLE);
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    if (*p == NULL)
+    {
+        lua_xz_aux_closedfile(L, index);
+    }
+    return *p;
+#else
+    luaL_Stream *p = (luaL_Stream *)lua_xz_aux_testudata(L, index, LUA_FILEHANDLE);
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    if (p->closef == NULL)
+    {
+        lua_xz_aux_closedfile(L, index);
+    }
+    return p->f;
+#endif
+}
+
+/*
+** returns the time, in seconds,
+** of a monotonic clock
+*/
+static double lua_xz_aux_clock(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / (double)CLOCKS_PER_SEC;
+#endif
+}
+/* end of auxiliary functions */
+
+/* start of lua_xz_aux_buffers */
+typedef struct taglua_xz_aux_buffers
+{
+    /* size of the input buffer */
+    size_t input_buffer_size;
+
+    /*
+    ** input buffer, when the data
+    ** is read from a file. It lies
+    ** right after the output buffer
+    */
+    uint8_t *input_buffer;
+
+    /* size of the output buffer*/
+    size_t output_buffer_size;
+
+    /*
+    ** note:
+    **   output_buffer member must be the last
+    **   field of the lua_xz_aux_buffers.
+    **   The reason is that we follow
+    **   the same idea employed by
+    **   Roberto Ierusalimschy in the
+    **   double array example on PIL.
+    **   In short, we allocate
+    **   a struct with size
+    **   sizeof(lua_xz_aux_buffers) + (output_buffer_size + input_buffer_size) * sizeof(uint8_t)
+    **   at userdata creation. 
+    */
+    uint8_t output_buffer[1];
+} lua_xz_aux_buffers;
+
+static lua_xz_aux_buffers *lua_xz_aux_buffers_new(lua_State *L, size_t output_buffer_size, size_t input_buffer_size)
+{
+    lua_xz_aux_buffers *b;
+    void *ud = lua_newuserdata(L, sizeof(lua_xz_aux_buffers) + (output_buffer_size + input_buffer_size) * sizeof(uint8_t));
+    if (ud == NULL)
+    {
+        luaL_error(L, "Failed to allocate memory for the auxiliary buffer");
+    }
+
+    b = (lua_xz_aux_buffers *)ud;
+    b->output_buffer_size = output_buffer_size;
+    b->input_buffer_size = input_buffer_size;
+    b->input_buffer = input_buffer_size > 0 ? b->output_buffer + output_buffer_size : NULL;
+
+    return b;
+}
+/* end of lua_xz_aux_buffers */
+
+/* start of lua_xz_buffer_view */
+typedef struct taglua_xz_buffer_view
+{
+    /* amount of valid bytes on data */
+    size_t size;
+
+    /* allocated size of data */
+    size_t capacity;
+
+    /*
+    ** set while the exec function
+    ** that owns the view is running
+    */
+    int is_valid;
+
+    /*
+    ** note:
+    **   data member must be the last field,
+    **   just like the output_buffer
+    **   of lua_xz_aux_buffers
+    */
+    uint8_t data[1];
+} lua_xz_buffer_view;
+
+#define LUA_XZ_BUFFER_VIEW_METATABLE "lua_xz_buffer_view_metatable"
+
+static lua_xz_buffer_view *lua_xz_buffer_view_new(lua_State *L, size_t capacity)
+{
+    lua_xz_buffer_view *view;
+    void *ud = lua_newuserdata(L, sizeof(lua_xz_buffer_view) + capacity);
+    if (ud == NULL)
+    {
+        luaL_error(L, "Failed to allocate memory for the buffer view");
+    }
+
+    luaL_getmetatable(L, LUA_XZ_BUFFER_VIEW_METATABLE);
+    lua_setmetatable(L, -2);
+
+    view = (lua_xz_buffer_view *)ud;
+    view->size = 0;
+    view->capacity = capacity;
+    view->is_valid = 1;
+
+    return view;
+}
+
+static lua_xz_buffer_view *lua_xz_check_buffer_view(lua_State *L, int index)
+{
+    lua_xz_buffer_view *view = (lua_xz_buffer_view *)luaL_checkudata(L, index, LUA_XZ_BUFFER_VIEW_METATABLE);
+    luaL_argcheck(L, view->is_valid, index, "buffer view cannot be used after exec returned");
+    return view;
+}
+
+static int lua_xz_buffer_view_len(lua_State *L)
+{
+    lua_xz_buffer_view *view = lua_xz_check_buffer_view(L, 1);
+    lua_pushinteger(L, (lua_Integer)view->size);
+    return 1;
+}
+
+/*
+** same semantics of string.sub,
+** including negative positions
+*/
+static int lua_xz_buffer_view_sub(lua_State *L)
+{
+    lua_xz_buffer_view *view = lua_xz_check_buffer_view(L, 1);
+    lua_Integer size = (lua_Integer)view->size;
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+
+    if (i < 0)
+    {
+        i = i < -size ? 1 : size + i + 1;
+    }
+    else if (i == 0)
+    {
+        i = 1;
+    }
+
+    if (j < 0)
+    {
+        j = j < -size ? 0 : size + j + 1;
+    }
+    else if (j > size)
+    {
+        j = size;
+    }
+
+    if (i <= j)
+    {
+        lua_pushlstring(L, (const char *)view->data + (i - 1), (size_t)(j - i + 1));
+    }
+    else
+    {
+        lua_pushliteral(L, "");
+    }
+    return 1;
+}
+
+static int lua_xz_buffer_view_tostring(lua_State *L)
+{
+    lua_xz_buffer_view *view = lua_xz_check_buffer_view(L, 1);
+    lua_pushlstring(L, (const char *)view->data, view->size);
+    return 1;
+}
+
+/* writes the bytes of the view to a file handle */
+static int lua_xz_buffer_view_write(lua_State *L)
+{
+    lua_xz_buffer_view *view = lua_xz_check_buffer_view(L, 1);
+    FILE *f = lua_xz_aux_tofile(L, 2);
+    luaL_argcheck(L, f != NULL, 2, "file expected");
+
+    if (fwrite(view->data, 1, view->size, f) != view->size)
+    {
+        return luaL_error(L, "Failed to write the buffer view to the file");
+    }
+    return 0;
+}
+
+static int lua_xz_buffer_view_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+
+static const luaL_Reg lua_xz_buffer_view_functions[] = {
+    {"len", lua_xz_buffer_view_len},
+    {"sub", lua_xz_buffer_view_sub},
+    {"tostring", lua_xz_buffer_view_tostring},
+    {"write", lua_xz_buffer_view_write},
+    {"__len", lua_xz_buffer_view_len},
+    {"__tostring", lua_xz_buffer_view_tostring},
+    {NULL, NULL}
+};
+/* end of lua_xz_buffer_view */
+
+/* start of lua_xz_hasher */
+#define LUA_XZ_HASHER_METATABLE "lua_xz_hasher_metatable"
+
+/*
+** incremental CRC32 / CRC64 of
+** the data given so far, computed by
+** the (possibly hardware accelerated)
+** lzma_crc32 / lzma_crc64
+*/
+typedef struct taglua_xz_hasher
+{
+    int is_crc64;
+    uint32_t crc32;
+    uint64_t crc64;
+} lua_xz_hasher;
+
+static lua_xz_hasher *lua_xz_check_hasher(lua_State *L, int index)
+{
+    void *ud = luaL_checkudata(L, index, LUA_XZ_HASHER_METATABLE);
+    luaL_argcheck(L, ud != NULL, index, "lua_xz_hasher expected");
+    return (lua_xz_hasher *)ud;
+}
+
+/*
+** returns the bytes of the string or
+** of the valid buffer view at `index'
+*/
+static const uint8_t *lua_xz_hasher_checkdata(lua_State *L, int index, size_t *size)
+{
+    lua_xz_buffer_view *view;
+
+    if (lua_type(L, index) == LUA_TSTRING)
+    {
+        return (const uint8_t *)lua_tolstring(L, index, size);
+    }
+
+    view = (lua_xz_buffer_view *)lua_xz_aux_testudata(L, index, LUA_XZ_BUFFER_VIEW_METATABLE);
+    luaL_argcheck(L, view != NULL && view->is_valid, index, "string or buffer view expected");
+
+    *size = view->size;
+    return view->data;
+}
+
+static void lua_xz_hasher_feed(lua_xz_hasher *hasher, const uint8_t *data, size_t size)
+{
+    if (hasher->is_crc64)
+    {
+        hasher->crc64 = lzma_crc64(data, size, hasher->crc64);
+    }
+    else
+    {
+        hasher->crc32 = lzma_crc32(data, size, hasher->crc32);
+    }
+}
+
+/*
+** pushes a CRC as an integer. CRC64 values
+** need 64-bit integers, which Lua 5.1 / 5.2
+** and LuaJIT do not have
+*/
+static void lua_xz_hasher_pushcrc(lua_State *L, int is_crc64, uint32_t crc32, uint64_t crc64)
+{
+    if (!is_crc64)
+    {
+        lua_pushinteger(L, (lua_Integer)crc32);
+        return;
+    }
+
+#if LUA_VERSION_NUM >= 503
+    if (sizeof(lua_Integer) >= sizeof(uint64_t))
+    {
+        /* values above LUA_MAXINTEGER wrap around, as string.unpack("<I8") */
+        lua_pushinteger(L, (lua_Integer)crc64);
+        return;
+    }
+#else
+    (void)crc64;
+#endif
+
+    luaL_error(L, "CRC64 values require 64-bit integers (Lua 5.3 or newer), use hexdigest instead");
+}
+
+static int lua_xz_hasher_new(lua_State *L, int is_crc64)
+{
+    lua_xz_hasher *hasher;
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    void *ud;
+
+    /* the initial data is optional */
+    if (!lua_isnoneornil(L, 1))
+    {
+        data = lua_xz_hasher_checkdata(L, 1, &size);
+    }
+
+    ud = lua_newuserdata(L, sizeof(lua_xz_hasher));
+    if (ud == NULL)
+    {
+        return luaL_error(L, "Failed to create lua_xz_hasher userdata");
+    }
+
+    luaL_getmetatable(L, LUA_XZ_HASHER_METATABLE);
+    lua_setmetatable(L, -2);
+
+    hasher = (lua_xz_hasher *)ud;
+    hasher->is_crc64 = is_crc64;
+    hasher->crc32 = 0;
+    hasher->crc64 = 0;
+
+    if (data != NULL)
+    {
+        lua_xz_hasher_feed(hasher, data, size);
+    }
+
+    return 1;
+}
+
+static int lua_xz_hasher_crc32(lua_State *L)
+{
+    return lua_xz_hasher_new(L, 0);
+}
+
+static int lua_xz_hasher_crc64(lua_State *L)
+{
+    return lua_xz_hasher_new(L, 1);
+}
+
+/* one-shot CRC32 of a string or buffer view */
+static int lua_xz_hasher_crc32sum(lua_State *L)
+{
+    size_t size;
+    const uint8_t *data = lua_xz_hasher_checkdata(L, 1, &size);
+    lua_xz_hasher_pushcrc(L, 0, lzma_crc32(data, size, 0), 0);
+    return 1;
+}
+
+/* one-shot CRC64 of a string or buffer view */
+static int lua_xz_hasher_crc64sum(lua_State *L)
+{
+    size_t size;
+    const uint8_t *data = lua_xz_hasher_checkdata(L, 1, &size);
+    lua_xz_hasher_pushcrc(L, 1, 0, lzma_crc64(data, size, 0));
+    return 1;
+}
+
+static int lua_xz_hasher_update(lua_State *L)
+{
+    lua_xz_hasher *hasher = lua_xz_check_hasher(L, 1);
+    size_t size;
+    const uint8_t *data = lua_xz_hasher_checkdata(L, 2, &size);
+
+    lua_xz_hasher_feed(hasher, data, size);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lua_xz_hasher_digest(lua_State *L)
+{
+    lua_xz_hasher *hasher = lua_xz_check_hasher(L, 1);
+    lua_xz_hasher_pushcrc(L, hasher->is_crc64, hasher->crc32, hasher->crc64);
+    return 1;
+}
+
+static int lua_xz_hasher_hexdigest(lua_State *L)
+{
+    lua_xz_hasher *hasher = lua_xz_check_hasher(L, 1);
+    char hex[17];
+
+    if (hasher->is_crc64)
+    {
+        sprintf(hex, "%08lx%08lx", (unsigned long)(hasher->crc64 >> 32), (unsigned long)(hasher->crc64 & 0xFFFFFFFFU));
+    }
+    else
+    {
+        sprintf(hex, "%08lx", (unsigned long)hasher->crc32);
+    }
+
+    lua_pushstring(L, hex);
+    return 1;
+}
+
+static int lua_xz_hasher_reset(lua_State *L)
+{
+    lua_xz_hasher *hasher = lua_xz_check_hasher(L, 1);
+    hasher->crc32 = 0;
+    hasher->crc64 = 0;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lua_xz_hasher_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+
+static const luaL_Reg lua_xz_hasher_functions[] = {
+    {"digest", lua_xz_hasher_digest},
+    {"hexdigest", lua_xz_hasher_hexdigest},
+    {"reset", lua_xz_hasher_reset},
+    {"update", lua_xz_hasher_update},
+    {"__tostring", lua_xz_hasher_hexdigest},
+    {NULL, NULL}
+};
+/* end of lua_xz_hasher */
+
+/* start of lua_xz_mutex */
+#if defined(_WIN32)
+typedef SRWLOCK lua_xz_mutex;
+#define LUA_XZ_MUTEX_INIT SRWLOCK_INIT
+#define lua_xz_mutex_init(m) InitializeSRWLock(m)
+#define lua_xz_mutex_destroy(m) ((void)(m))
+#define lua_xz_mutex_lock(m) AcquireSRWLockExclusive(m)
+#define lua_xz_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#else
+typedef pthread_mutex_t lua_xz_mutex;
+#define LUA_XZ_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define lua_xz_mutex_init(m) pthread_mutex_init((m), NULL)
+#define lua_xz_mutex_destroy(m) pthread_mutex_destroy(m)
+#define lua_xz_mutex_lock(m) pthread_mutex_lock(m)
+#define lua_xz_mutex_unlock(m) pthread_mutex_unlock(m)
+#endif
+/* end of lua_xz_mutex */
+
+/* start of lua_xz_cond */
+#if defined(_WIN32)
+typedef CONDITION_VARIABLE lua_xz_cond;
+#define lua_xz_cond_init(c) InitializeConditionVariable(c)
+#define lua_xz_cond_destroy(c) ((void)(c))
+#define lua_xz_cond_wait(c, m) SleepConditionVariableSRW((c), (m), INFINITE, 0)
+#define lua_xz_cond_signal(c) WakeConditionVariable(c)
+#define lua_xz_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_cond_t lua_xz_cond;
+#define lua_xz_cond_init(c) pthread_cond_init((c), NULL)
+#define lua_xz_cond_destroy(c) pthread_cond_destroy(c)
+#define lua_xz_cond_wait(c, m) pthread_cond_wait((c), (m))
+#define lua_xz_cond_signal(c) pthread_cond_signal(c)
+#define lua_xz_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/*
+** waits on `c' for up to `seconds',
+** with the mutex `m' locked
+*/
+static void lua_xz_cond_timedwait(lua_xz_cond *c, lua_xz_mutex *m, double seconds)
+{
+#if defined(_WIN32)
+    SleepConditionVariableSRW(c, m, (DWORD)(seconds * 1000.0), 0);
+#else
+    struct timespec deadline;
+    long nsec;
+
+#if defined(CLOCK_REALTIME)
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+    deadline.tv_sec = time(NULL);
+    deadline.tv_nsec = 0;
+#endif
+
+    nsec = deadline.tv_nsec + (long)((seconds - (double)(long)seconds) * 1e9);
+    deadline.tv_sec += (time_t)seconds + nsec / 1000000000L;
+    deadline.tv_nsec = nsec % 1000000000L;
+
+    pthread_cond_timedwait(c, m, &deadline);
+#endif
+}
+/* end of lua_xz_cond */
+
+/* start of lua_xz_thread */
+#if defined(_WIN32)
+typedef HANDLE lua_xz_thread;
+#define LUA_XZ_THREAD_FUNCTION(name) DWORD WINAPI name(LPVOID arg)
+#define LUA_XZ_THREAD_RETURN 0
+#else
+typedef pthread_t lua_xz_thread;
+#define LUA_XZ_THREAD_FUNCTION(name) void *name(void *arg)
+#define LUA_XZ_THREAD_RETURN NULL
+#endif
+
+/*
+** starts a thread running `function(arg)'.
+** 
+** Returns 0 on success.
+*/
+#if defined(_WIN32)
+#define lua_xz_thread_create(t, function, arg) ((*(t) = CreateThread(NULL, 0, (function), (arg), 0, NULL)) == NULL)
+#define lua_xz_thread_join(t) (WaitForSingleObject((t), INFINITE), CloseHandle(t))
+#else
+#define lua_xz_thread_create(t, function, arg) pthread_create((t), NULL, (function), (arg))
+#define lua_xz_thread_join(t) pthread_join((t), NULL)
+#endif
+/* end of lua_xz_thread */
+
+/* start of lua_xz_alloc */
+
+/*
+** kinds of lzma_allocator
+** installed on a stream
+*/
+
+/* the default allocator of liblzma (not accounted) */
+#define LUA_XZ_ALLOC_DEFAULT 0
+
+/* malloc / free */
+#define LUA_XZ_ALLOC_MALLOC 1
+
+/* the lua_Alloc of the lua_State that created the stream */
+#define LUA_XZ_ALLOC_LUA 2
+
+/* malloc / free, recycling large blocks through a global pool */
+#define LUA_XZ_ALLOC_POOL 3
+
+/*
+** smallest block kept by the pool.
+** Smaller blocks go to malloc / free
+*/
+#ifndef LUA_XZ_POOL_MIN_SIZE
+#define LUA_XZ_POOL_MIN_SIZE (64 * 1024)
+#endif
+
+/*
+** maximum amount of memory
+** kept by the pool for reuse
+*/
+#ifndef LUA_XZ_POOL_MAX_CACHED
+#define LUA_XZ_POOL_MAX_CACHED (256 * 1024 * 1024)
+#endif
+
+/*
+** number of size classes of the pool.
+** Each class is 25% larger than the
+** previous one, starting at LUA_XZ_POOL_MIN_SIZE
+*/
+#define LUA_XZ_POOL_CLASSES 96
+
+typedef struct taglua_xz_alloc
+{
+    /* the allocator given to liblzma */
+    lzma_allocator allocator;
+
+    /* one of the LUA_XZ_ALLOC_* kinds */
+    int kind;
+
+    /* bytes currently allocated through this allocator */
+    size_t allocated;
+
+    /* the allocator of Lua, for LUA_XZ_ALLOC_LUA */
+    lua_Alloc lua_alloc;
+    void *lua_ud;
+} lua_xz_alloc;
+
+/*
+** header stored before each block
+** to remember its size, since
+** the free function of lzma_allocator
+** does not receive it
+*/
+typedef union taglua_xz_alloc_header
+{
+    size_t size;
+
+    /* keep the memory after the header aligned */
+    long double align_ld;
+    long long align_ll;
+    void *align_p;
+} lua_xz_alloc_header;
+
+typedef struct taglua_xz_pool_block
+{
+    struct taglua_xz_pool_block *next;
+} lua_xz_pool_block;
+
+/*
+** the mutex guards the counters and the pool,
+** because the multithreaded encoder / decoder
+** allocates memory from its worker threads
+*/
+static lua_xz_mutex lua_xz_alloc_mutex = LUA_XZ_MUTEX_INIT;
+
+/* bytes allocated by all the streams */
+static size_t lua_xz_alloc_total = 0;
+
+/* bytes kept by the pool for reuse */
+static size_t lua_xz_pool_cached = 0;
+
+/* free blocks of the pool for each size class */
+static lua_xz_pool_block *lua_xz_pool_free[LUA_XZ_POOL_CLASSES];
+
+/*
+** returns the size class of the pool
+** for `size', rounding `size' up to
+** the size of the class, or -1 when
+** the block is not handled by the pool
+*/
+static int lua_xz_pool_class(size_t *size)
+{
+    size_t class_size = LUA_XZ_POOL_MIN_SIZE;
+    int index = 0;
+
+    if (*size < LUA_XZ_POOL_MIN_SIZE)
+    {
+        return -1;
+    }
+
+    while (class_size < *size)
+    {
+        if (class_size > SIZE_MAX / 2 || ++index == LUA_XZ_POOL_CLASSES)
+        {
+            return -1;
+        }
+
+        /* grow 25%, keeping the size a multiple of 4 KB */
+        class_size = (class_size + class_size / 4 + 4095) & ~((size_t)4095);
+    }
+
+    *size = class_size;
+    return index;
+}
+
+static void *lua_xz_alloc_alloc(void *opaque, size_t nmemb, size_t size)
+{
+    lua_xz_alloc *a = (lua_xz_alloc *)opaque;
+    lua_xz_alloc_header *h = NULL;
+    int index;
+
+    if (size != 0 && nmemb > (SIZE_MAX - sizeof(lua_xz_alloc_header)) / size)
+    {
+        return NULL;
+    }
+    size *= nmemb;
+
+    if (a->kind == LUA_XZ_ALLOC_LUA)
+    {
+        h = (lua_xz_alloc_header *)a->lua_alloc(a->lua_ud, NULL, 0, sizeof(lua_xz_alloc_header) + size);
+    }
+    else
+    {
+        if (a->kind == LUA_XZ_ALLOC_POOL && (index = lua_xz_pool_class(&size)) >= 0)
+        {
+            lua_xz_mutex_lock(&lua_xz_alloc_mutex);
+            if (lua_xz_pool_free[index] != NULL)
+            {
+                h = (lua_xz_alloc_header *)lua_xz_pool_free[index];
+                lua_xz_pool_free[index] = lua_xz_pool_free[index]->next;
+                lua_xz_pool_cached -= size;
+            }
+            lua_xz_mutex_unlock(&lua_xz_alloc_mutex);
+        }
+
+        if (h == NULL)
+        {
+            h = (lua_xz_alloc_header *)malloc(sizeof(lua_xz_alloc_header) + size);
+        }
+    }
+
+    if (h == NULL)
+    {
+        return NULL;
+    }
+
+    h->size = size;
+
+    lua_xz_mutex_lock(&lua_xz_alloc_mutex);
+    a->allocated += size;
+    lua_xz_alloc_total += size;
+    lua_xz_mutex_unlock(&lua_xz_alloc_mutex);
+
+    return (void *)(h + 1);
+}
+
+static void lua_xz_alloc_free(void *opaque, void *ptr)
+{
+    lua_xz_alloc *a = (lua_xz_alloc *)opaque;
+    lua_xz_alloc_header *h;
+    size_t size;
+    int index;
+    lua_xz_pool_block *block;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    h = ((lua_xz_alloc_header *)ptr) - 1;
+    size = h->size;
+
+    lua_xz_mutex_lock(&lua_xz_alloc_mutex);
+    a->allocated -= size;
+    lua_xz_alloc_total -= size;
+
+    /* keep large blocks for reuse */
+    if (a->kind == LUA_XZ_ALLOC_POOL && (index = lua_xz_pool_class(&size)) >= 0 && lua_xz_pool_cached + size <= LUA_XZ_POOL_MAX_CACHED)
+    {
+        block = (lua_xz_pool_block *)h;
+        block->next = lua_xz_pool_free[index];
+        lua_xz_pool_free[index] = block;
+        lua_xz_pool_cached += size;
+        h = NULL;
+    }
+    lua_xz_mutex_unlock(&lua_xz_alloc_mutex);
+
+    if (h != NULL)
+    {
+        if (a->kind == LUA_XZ_ALLOC_LUA)
+        {
+            a->lua_alloc(a->lua_ud, h, sizeof(lua_xz_alloc_header) + size, 0);
+        }
+        else
+        {
+            free(h);
+        }
+    }
+}
+
+/* returns the bytes currently allocated through `a' */
+static size_t lua_xz_alloc_allocated(lua_xz_alloc *a)
+{
+    size_t allocated;
+    lua_xz_mutex_lock(&lua_xz_alloc_mutex);
+    allocated = a->allocated;
+    lua_xz_mutex_unlock(&lua_xz_alloc_mutex);
+    return allocated;
+}
+
+/*
+** gets the bytes allocated by all the
+** streams with an allocator, and the bytes
+** kept by the pool for reuse
+*/
+static int lua_xz_allocated(lua_State *L)
+{
+    size_t total;
+    size_t cached;
+
+    lua_xz_mutex_lock(&lua_xz_alloc_mutex);
+    total = lua_xz_alloc_total;
+    cached = lua_xz_pool_cached;
+    lua_xz_mutex_unlock(&lua_xz_alloc_mutex);
+
+    lua_pushinteger(L, (lua_Integer)total);
+    lua_pushinteger(L, (lua_Integer)cached);
+    return 2;
+}
+
+/*
+** frees the blocks kept by the pool
+** for reuse, returning their size in bytes.
+** The lists are detached under the mutex,
+** and freed after releasing it
+*/
+static int lua_xz_pool_trim(lua_State *L)
+{
+    lua_xz_pool_block *lists[LUA_XZ_POOL_CLASSES];
+    lua_xz_pool_block *block;
+    size_t trimmed;
+    int i;
+
+    lua_xz_mutex_lock(&lua_xz_alloc_mutex);
+    for (i = 0; i < LUA_XZ_POOL_CLASSES; i++)
+    {
+        lists[i] = lua_xz_pool_free[i];
+        lua_xz_pool_free[i] = NULL;
+    }
+    trimmed = lua_xz_pool_cached;
+    lua_xz_pool_cached = 0;
+    lua_xz_mutex_unlock(&lua_xz_alloc_mutex);
+
+    for (i = 0; i < LUA_XZ_POOL_CLASSES; i++)
+    {
+        while (lists[i] != NULL)
+        {
+            block = lists[i];
+            lists[i] = block->next;
+            free(block);
+        }
+    }
+
+    lua_pushinteger(L, (lua_Integer)trimmed);
+    return 1;
+}
+/* end of lua_xz_alloc */
+
+/* start of lua_xz */
+#define LUA_XZ_METATABLE "lua_xz_metatable"
+
+static int lua_xz_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+static int lua_xz_cputhreads(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)lzma_cputhreads());
+    return 1;
+}
+/* end of lua_xz */
+
+/* start of lua_xz_check */
+#define LUA_XZ_CHECK_METATABLE "lua_xz_check_metatable"
+
+static int lua_xz_check_is_supported(lua_State *L)
+{
+    lua_Integer arg_check = luaL_checkinteger(L, 1);
+    lzma_check check = (lzma_check)arg_check;
+    lzma_bool result = lzma_check_is_supported(check);
+    lua_pushboolean(L, result);
+    return 1;
+}
+
+static int lua_xz_check_size(lua_State *L)
+{
+    lua_Integer arg_check = luaL_checkinteger(L, 1);
+    lzma_check check = (lzma_check)arg_check;
+    uint32_t size = lzma_check_size(check);
+    lua_pushboolean(L, size);
+    return 1;
+}
+
+static int lua_xz_check_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+
+static const luaL_Reg lua_xz_check_functions[] = {
+    { "supported", lua_xz_check_is_supported },
+    { "size", lua_xz_check_size },
+    {NULL, NULL}
+};
+/* end of lua_xz_check */
+
+/* start of lua_xz_dictionary */
+#define LUA_XZ_DICTIONARY_METATABLE "lua_xz_dictionary_metatable"
+
+/*
+** preset dictionary of the LZMA1 / LZMA2
+** filters of raw streams, priming the
+** encoder and the decoder with sample data
+*/
+typedef struct taglua_xz_dictionary
+{
+    /* amount of bytes on data */
+    uint32_t size;
+
+    /*
+    ** note:
+    **   data member must be the last field,
+    **   allocated with the userdata
+    **   (see lua_xz_aux_buffers)
+    */
+    uint8_t data[1];
+} lua_xz_dictionary;
+
+static lua_xz_dictionary *lua_xz_check_dictionary(lua_State *L, int index)
+{
+    void *ud = luaL_checkudata(L, index, LUA_XZ_DICTIONARY_METATABLE);
+    luaL_argcheck(L, ud != NULL, index, "lua_xz_dictionary expected");
+    return (lua_xz_dictionary *)ud;
+}
+
+/*
+** builds a dictionary from a string
+** or an array of strings, keeping
+** their last `size' bytes: matches
+** closer to the end are cheaper,
+** so the most common data should
+** come last
+*/
+static int lua_xz_dictionary_new(lua_State *L)
+{
+    lua_xz_dictionary *dictionary;
+    lua_Integer arg_size;
+    const char *sample;
+    size_t sample_size;
+    size_t total = 0;
+    size_t size;
+    size_t skip;
+    size_t count;
+    size_t i;
+    void *ud;
+
+    if (lua_type(L, 1) == LUA_TSTRING)
+    {
+        count = 1;
+        total = lua_xz_aux_rawlen(L, 1);
+    }
+    else
+    {
+        luaL_argcheck(L, lua_istable(L, 1), 1, "samples must be a string or an array of strings");
+        count = lua_xz_aux_rawlen(L, 1);
+        for (i = 1; i <= count; i++)
+        {
+            lua_rawgeti(L, 1, (int)i);
+            if (lua_type(L, -1) != LUA_TSTRING)
+            {
+                return luaL_error(L, "sample #%d must be a string", (int)i);
+            }
+            total += lua_xz_aux_rawlen(L, -1);
+            lua_pop(L, 1);
+        }
+    }
+
+    size = total;
+    if (!lua_isnoneornil(L, 2))
+    {
+        arg_size = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, arg_size >= 0, 2, "size must be an integer greater than or equal to 0");
+        if ((uint64_t)arg_size < (uint64_t)size)
+        {
+            size = (size_t)arg_size;
+        }
+    }
+    luaL_argcheck(L, (uint64_t)size <= UINT32_MAX, 2, "dictionary must not exceed 4294967295 bytes");
+
+    ud = lua_newuserdata(L, sizeof(lua_xz_dictionary) + size * sizeof(uint8_t));
+    if (ud == NULL)
+    {
+        return luaL_error(L, "Failed to create lua_xz_dictionary userdata");
+    }
+
+    luaL_getmetatable(L, LUA_XZ_DICTIONARY_METATABLE);
+    lua_setmetatable(L, -2);
+
+    dictionary = (lua_xz_dictionary *)ud;
+    dictionary->size = (uint32_t)size;
+
+    /* copy the samples, skipping the bytes before the last `size' ones */
+    skip = total - size;
+    size = 0;
+    for (i = 1; i <= count; i++)
+    {
+        if (lua_type(L, 1) == LUA_TSTRING)
+        {
+            lua_pushvalue(L, 1);
+        }
+        else
+        {
+            lua_rawgeti(L, 1, (int)i);
+        }
+        sample = lua_tolstring(L, -1, &sample_size);
+
+        if (skip >= sample_size)
+        {
+            skip -= sample_size;
+        }
+        else
+        {
+            memcpy(dictionary->data + size, sample + skip, sample_size - skip);
+            size += sample_size - skip;
+            skip = 0;
+        }
+        lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+static int lua_xz_dictionary_size(lua_State *L)
+{
+    lua_xz_dictionary *dictionary = lua_xz_check_dictionary(L, 1);
+    lua_pushinteger(L, (lua_Integer)dictionary->size);
+    return 1;
+}
+
+static int lua_xz_dictionary_data(lua_State *L)
+{
+    lua_xz_dictionary *dictionary = lua_xz_check_dictionary(L, 1);
+    lua_pushlstring(L, (const char *)dictionary->data, (size_t)dictionary->size);
+    return 1;
+}
+
+static int lua_xz_dictionary_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+
+static const luaL_Reg lua_xz_dictionary_functions[] = {
+    {"data", lua_xz_dictionary_data},
+    {"size", lua_xz_dictionary_size},
+    {"__len", lua_xz_dictionary_size},
+    {NULL, NULL}
+};
+/* end of lua_xz_dictionary */
+
+/* start of lua_xz_filter */
+#define LUA_XZ_FILTER_METATABLE "lua_xz_filter_metatable"
+
+/* kinds of options taken by the filters */
+#define LUA_XZ_FILTER_LZMA 0
+#define LUA_XZ_FILTER_DELTA 1
+#define LUA_XZ_FILTER_BCJ 2
+
+/*
+** options of a filter in a chain,
+** pointed by its lzma_filter
+*/
+typedef union taglua_xz_filter_options
+{
+    lzma_options_lzma lzma;
+    lzma_options_delta delta;
+    lzma_options_bcj bcj;
+} lua_xz_filter_options;
+
+/*
+** filters are identified on Lua by
+** their names, because the id of LZMA1
+** does not fit in a double
+*/
+typedef struct taglua_xz_filter_info
+{
+    const char *key;
+    const char *name;
+    lzma_vli id;
+    int kind;
+} lua_xz_filter_info;
+
+static const lua_xz_filter_info lua_xz_filter_infos[] = {
+    { "X86", "x86", LZMA_FILTER_X86, LUA_XZ_FILTER_BCJ },
+    { "POWERPC", "powerpc", LZMA_FILTER_POWERPC, LUA_XZ_FILTER_BCJ },
+    { "IA64", "ia64", LZMA_FILTER_IA64, LUA_XZ_FILTER_BCJ },
+    { "ARM", "arm", LZMA_FILTER_ARM, LUA_XZ_FILTER_BCJ },
+    { "ARMTHUMB", "armthumb", LZMA_FILTER_ARMTHUMB, LUA_XZ_FILTER_BCJ },
+#ifdef LZMA_FILTER_ARM64
+    { "ARM64", "arm64", LZMA_FILTER_ARM64, LUA_XZ_FILTER_BCJ },
+#endif
+    { "SPARC", "sparc", LZMA_FILTER_SPARC, LUA_XZ_FILTER_BCJ },
+#ifdef LZMA_FILTER_RISCV
+    { "RISCV", "riscv", LZMA_FILTER_RISCV, LUA_XZ_FILTER_BCJ },
+#endif
+    { "DELTA", "delta", LZMA_FILTER_DELTA, LUA_XZ_FILTER_DELTA },
+    { "LZMA1", "lzma1", LZMA_FILTER_LZMA1, LUA_XZ_FILTER_LZMA },
+    { "LZMA2", "lzma2", LZMA_FILTER_LZMA2, LUA_XZ_FILTER_LZMA },
+    { NULL, NULL, 0, 0 }
+};
+
+/*
+** returns the filter named `name',
+** or NULL when it is unknown
+*/
+static const lua_xz_filter_info *lua_xz_filter_find(const char *name)
+{
+    const lua_xz_filter_info *info;
+
+    for (info = lua_xz_filter_infos; info->name != NULL; info++)
+    {
+        if (strcmp(info->name, name) == 0)
+        {
+            return info;
+        }
+    }
+
+    return NULL;
+}
+
+/* names of the match finders and of the compression modes */
+static const char *const lua_xz_filter_mf_names[] = { "hc3", "hc4", "bt2", "bt3", "bt4", NULL };
+static const lzma_match_finder lua_xz_filter_mf_values[] = { LZMA_MF_HC3, LZMA_MF_HC4, LZMA_MF_BT2, LZMA_MF_BT3, LZMA_MF_BT4 };
+
+static const char *const lua_xz_filter_mode_names[] = { "fast", "normal", NULL };
+static const lzma_mode lua_xz_filter_mode_values[] = { LZMA_MODE_FAST, LZMA_MODE_NORMAL };
+
+/*
+** reads the field `key' of the table at
+** `index' as one of the strings of `names',
+** returning its position, or -1 when
+** the field is absent
+*/
+static int lua_xz_filter_optname(lua_State *L, int index, const char *key, const char *const names[], const char *expected)
+{
+    const char *name;
+    int i;
+
+    if (lua_xz_aux_getoption(L, index, key) == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        return -1;
+    }
+
+    name = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+    for (i = 0; names[i] != NULL; i++)
+    {
+        if (strcmp(names[i], name) == 0)
+        {
+            lua_pop(L, 1);
+            return i;
+        }
+    }
+
+    return luaL_error(L, "option %s must be %s", key, expected);
+}
+
+/*
+** reads the field `key' of the table at
+** `index' as an integer in the interval
+** [min, max], setting `value' and
+** returning 1 when the field is present
+*/
+static int lua_xz_filter_optrange(lua_State *L, int index, const char *key, int min, int max, uint32_t *value)
+{
+    lua_Integer arg_value;
+
+    if (lua_xz_aux_getoption(L, index, key) == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    arg_value = lua_xz_aux_optinteger(L, index, key, 0);
+    if (arg_value < min || arg_value > max)
+    {
+        luaL_error(L, "option %s must be an integer in the interval [%d, %d]", key, min, max);
+    }
+
+    *value = (uint32_t)arg_value;
+    return 1;
+}
+
+/*
+** overrides the fields of `opt_lzma'
+** given by the table at `index'.
+**
+** Returns 1 when any field was
+** given, or 0 otherwise.
+*/
+static int lua_xz_filter_optlzma(lua_State *L, int index, lzma_options_lzma *opt_lzma)
+{
+    lua_Integer dict_size;
+    int given = 0;
+    int i;
+
+    if (lua_xz_aux_getoption(L, index, "dict_size") != LUA_TNIL)
+    {
+        given = 1;
+    }
+    lua_pop(L, 1);
+
+    dict_size = lua_xz_aux_optinteger(L, index, "dict_size", (lua_Integer)opt_lzma->dict_size);
+    if (dict_size < LZMA_DICT_SIZE_MIN || (uint64_t)dict_size > UINT32_MAX)
+    {
+        luaL_error(L, "option dict_size must be an integer in the interval [4096, 4294967295]");
+    }
+    opt_lzma->dict_size = (uint32_t)dict_size;
+
+    given |= lua_xz_filter_optrange(L, index, "lc", LZMA_LCLP_MIN, LZMA_LCLP_MAX, &opt_lzma->lc);
+    given |= lua_xz_filter_optrange(L, index, "lp", LZMA_LCLP_MIN, LZMA_LCLP_MAX, &opt_lzma->lp);
+    given |= lua_xz_filter_optrange(L, index, "pb", LZMA_PB_MIN, LZMA_PB_MAX, &opt_lzma->pb);
+    given |= lua_xz_filter_optrange(L, index, "nice_len", 2, 273, &opt_lzma->nice_len);
+    given |= lua_xz_filter_optrange(L, index, "depth", 0, INT_MAX, &opt_lzma->depth);
+
+    i = lua_xz_filter_optname(L, index, "mf", lua_xz_filter_mf_names, "\"hc3\", \"hc4\", \"bt2\", \"bt3\" or \"bt4\"");
+    if (i >= 0)
+    {
+        opt_lzma->mf = lua_xz_filter_mf_values[i];
+        given = 1;
+    }
+
+    i = lua_xz_filter_optname(L, index, "mode", lua_xz_filter_mode_names, "\"fast\" or \"normal\"");
+    if (i >= 0)
+    {
+        opt_lzma->mode = lua_xz_filter_mode_values[i];
+        given = 1;
+    }
+
+    return given;
+}
+
+/*
+** reads the options of the LZMA1 / LZMA2
+** filter described by the table at `index'
+** on top of the given preset.
+**
+** The dictionary of the filter, if any,
+** is appended to the table at `anchors',
+** keeping it alive while the options
+** point to it. When `anchors' is 0, the
+** dictionary is not supported.
+*/
+static void lua_xz_filter_checklzma(lua_State *L, int index, uint32_t preset, lzma_options_lzma *opt_lzma, int anchors)
+{
+    lua_xz_dictionary *dictionary;
+
+    if (lua_xz_aux_getoption(L, index, "preset") != LUA_TNIL)
+    {
+        preset = lua_xz_aux_checkpreset(L, lua_gettop(L));
+    }
+    lua_pop(L, 1);
+
+    if (lzma_lzma_preset(opt_lzma, preset))
+    {
+        luaL_error(L, "Unsupported preset");
+    }
+
+    lua_xz_filter_optlzma(L, index, opt_lzma);
+
+    if (lua_xz_aux_getoption(L, index, "dictionary") != LUA_TNIL)
+    {
+        if (anchors == 0)
+        {
+            luaL_error(L, "option dictionary is only supported by raw streams");
+        }
+
+        dictionary = (lua_xz_dictionary *)lua_xz_aux_testudata(L, -1, LUA_XZ_DICTIONARY_METATABLE);
+        if (dictionary == NULL)
+        {
+            luaL_error(L, "option dictionary must be a lua_xz_dictionary");
+            return;
+        }
+
+        opt_lzma->preset_dict = dictionary->size > 0 ? dictionary->data : NULL;
+        opt_lzma->preset_dict_size = dictionary->size;
+
+        lua_rawseti(L, anchors, (int)lua_xz_aux_rawlen(L, anchors) + 1);
+    }
+    else
+    {
+        lua_pop(L, 1);
+    }
+}
+
+/*
+** reads the filter chain described by the
+** array of tables at `index' into `filters',
+** terminated by LZMA_VLI_UNKNOWN, keeping
+** the options of each filter on `options'.
+**
+** The LZMA1 / LZMA2 filters start from
+** `preset', unless they provide their own,
+** and keep their dictionaries on the table
+** at `anchors' (see lua_xz_filter_checklzma).
+*/
+static void lua_xz_filter_checkchain(lua_State *L, int index, uint32_t preset, lzma_filter *filters, lua_xz_filter_options *options, int anchors)
+{
+    const lua_xz_filter_info *info;
+    const char *name;
+    lua_Integer value;
+    size_t count;
+    size_t i;
+    int entry;
+
+    if (!lua_istable(L, index) || (count = lua_xz_aux_rawlen(L, index)) < 1 || count > LZMA_FILTERS_MAX)
+    {
+        luaL_error(L, "filters must be an array of 1 to %d filters", LZMA_FILTERS_MAX);
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        lua_rawgeti(L, index, (int)(i + 1));
+        if (!lua_istable(L, -1))
+        {
+            luaL_error(L, "filter #%d must be a table", (int)(i + 1));
+        }
+        entry = lua_gettop(L);
+
+        lua_getfield(L, entry, "id");
+        name = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+        info = name != NULL ? lua_xz_filter_find(name) : NULL;
+        if (info == NULL)
+        {
+            luaL_error(L, "filter #%d has an unknown id", (int)(i + 1));
+            return;
+        }
+        lua_pop(L, 1);
+
+        memset(&options[i], 0, sizeof(lua_xz_filter_options));
+        filters[i].id = info->id;
+        filters[i].options = (void *)&options[i];
+
+        switch (info->kind)
+        {
+        case LUA_XZ_FILTER_LZMA:
+            lua_xz_filter_checklzma(L, entry, preset, &options[i].lzma, anchors);
+            break;
+        case LUA_XZ_FILTER_DELTA:
+            value = lua_xz_aux_optinteger(L, entry, "dist", LZMA_DELTA_DIST_MIN);
+            if (value < LZMA_DELTA_DIST_MIN || value > LZMA_DELTA_DIST_MAX)
+            {
+                luaL_error(L, "option dist must be an integer in the interval [1, 256]");
+            }
+            options[i].delta.type = LZMA_DELTA_TYPE_BYTE;
+            options[i].delta.dist = (uint32_t)value;
+            break;
+        default:
+            value = lua_xz_aux_optinteger(L, entry, "start_offset", 0);
+            if ((uint64_t)value > UINT32_MAX)
+            {
+                luaL_error(L, "option start_offset must be an integer in the interval [0, 4294967295]");
+            }
+            options[i].bcj.start_offset = (uint32_t)value;
+            break;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    filters[count].id = LZMA_VLI_UNKNOWN;
+    filters[count].options = NULL;
+}
+
+/*
+** estimates the memory usage of
+** the encoder and of the decoder
+** of a filter chain
+*/
+static int lua_xz_filter_memusage(lua_State *L)
+{
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lua_xz_filter_options options[LZMA_FILTERS_MAX];
+    uint32_t preset = LZMA_PRESET_DEFAULT;
+    uint64_t encoder_memusage;
+    uint64_t decoder_memusage;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 2))
+    {
+        preset = lua_xz_aux_checkpreset(L, 2);
+    }
+
+    /* the dictionaries do not change the estimates */
+    lua_newtable(L);
+    lua_xz_filter_checkchain(L, 1, preset, filters, options, lua_gettop(L));
+
+    /* UINT64_MAX means invalid options */
+    encoder_memusage = lzma_raw_encoder_memusage((const lzma_filter *)filters);
+    decoder_memusage = lzma_raw_decoder_memusage((const lzma_filter *)filters);
+    if (encoder_memusage == UINT64_MAX && decoder_memusage == UINT64_MAX)
+    {
+        return luaL_error(L, "The given filter chain is not supported by this build of liblzma");
+    }
+
+    if (encoder_memusage == UINT64_MAX)
+    {
+        lua_pushnil(L);
+    }
+    else
+    {
+        lua_pushinteger(L, (lua_Integer)encoder_memusage);
+    }
+
+    if (decoder_memusage == UINT64_MAX)
+    {
+        lua_pushnil(L);
+    }
+    else
+    {
+        lua_pushinteger(L, (lua_Integer)decoder_memusage);
+    }
+
+    return 2;
+}
+
+/*
+** tests whether the encoder and
+** the decoder of a filter are
+** supported by liblzma
+*/
+static int lua_xz_filter_is_supported(lua_State *L)
+{
+    const lua_xz_filter_info *info = lua_xz_filter_find(luaL_checkstring(L, 1));
+    lua_pushboolean(L, info != NULL && lzma_filter_encoder_is_supported(info->id));
+    lua_pushboolean(L, info != NULL && lzma_filter_decoder_is_supported(info->id));
+    return 2;
+}
+
+static int lua_xz_filter_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+
+static const luaL_Reg lua_xz_filter_functions[] = {
+    { "memusage", lua_xz_filter_memusage },
+    { "supported", lua_xz_filter_is_supported },
+    {NULL, NULL}
+};
+/* end of lua_xz_filter */
+
+/* start of lua_xz_stream */
+
+/*
+** entry of the block table
+** of a .xz writer stream
+*/
+typedef struct taglua_xz_block
+{
+    uint64_t uncompressed_offset;
+    uint64_t uncompressed_size;
+
+    /*
+    ** the compressed size covers the
+    ** whole block: header, compressed
+    ** data, padding and check
+    */
+    uint64_t compressed_offset;
+    uint64_t compressed_size;
+} lua_xz_block;
+
+/* steps of the loop of `exec' */
+#define LUA_XZ_EXEC_PRODUCE 0
+#define LUA_XZ_EXEC_PRODUCED 1
+#define LUA_XZ_EXEC_CODE 2
+#define LUA_XZ_EXEC_CONSUMED 3
+#define LUA_XZ_EXEC_PROGRESS 4
+#define LUA_XZ_EXEC_PROGRESSED 5
+#define LUA_XZ_EXEC_NEXT 6
+
+/*
+** state of the loop of `exec', kept
+** on the stream, so that a continuation
+** resumes the loop after the producer,
+** the consumer or the progress function
+** yields (on Lua 5.2 or newer)
+*/
+typedef struct taglua_xz_exec_state
+{
+    /* next step of the loop */
+    int step;
+
+    /*
+    ** use LZMA_RUN until the producer function
+    ** returns nil or none, because
+    ** a produced nil or none signals
+    ** that it is time to finish the stream
+    ** by setting LZMA_FINISH
+    */
+    lzma_action action;
+
+    /* last return code of lzma_code */
+    lzma_ret ret;
+
+    /* whether a flush action of the producer was completed */
+    int flushed;
+
+    /*
+    ** stack indexes of the last produced data,
+    ** of the buffer view and of the progress
+    ** function (0 when absent)
+    */
+    int input_index;
+    int view_index;
+    int progress_index;
+
+    /*
+    ** standard Lua file handles
+    ** given as producer / consumer,
+    ** which are read / written
+    ** directly without calling Lua
+    */
+    FILE *producer_file;
+    FILE *consumer_file;
+
+    /* buffers, anchored on the stack */
+    uint8_t *input_buffer;
+    size_t input_buffer_size;
+    uint8_t *output_buffer;
+    size_t output_buffer_size;
+
+    /*
+    ** reusable view of the output buffer
+    ** given to the consumer function
+    ** instead of a new string
+    */
+    lua_xz_buffer_view *view;
+
+    /*
+    ** the progress function is called
+    ** every `progress_interval' bytes of input
+    */
+    lua_Integer progress_interval;
+    uint64_t next_progress;
+
+    /*
+    ** auto-flush policy of writers: flush once
+    ** `flush_bytes' of input or `flush_interval'
+    ** seconds went by since the last flush
+    */
+    lua_Integer flush_bytes;
+    lua_Number flush_interval;
+    uint64_t last_flush_in;
+    double last_flush_time;
+
+    /* start of the pending call to Lua */
+    double start;
+
+    /*
+    ** budget of each call of exec: the call
+    ** returns once `budget_bytes' of uncompressed
+    ** data or `budget_time' seconds went by
+    ** since it started, leaving the loop pending
+    */
+    lua_Integer budget_bytes;
+    lua_Number budget_time;
+    uint64_t budget_start_bytes;
+    double budget_start_time;
+
+    /*
+    ** hasher of the uncompressed data
+    ** (the input of writers and the output
+    ** of readers), or NULL
+    */
+    lua_xz_hasher *checksum;
+
+    /*
+    ** set while a budgeted exec is pending.
+    ** The buffers, the view and the produced
+    ** data not consumed yet are anchored
+    ** on the registry by `anchor_ref'
+    ** until the next call
+    */
+    int pending;
+    int anchor_ref;
+
+    /*
+    ** set while a call to Lua made by
+    ** exec is in progress or suspended on
+    ** a coroutine, until reset clears it.
+    ** `generation' changes on every new exec
+    ** and reset, so that exec can tell, once
+    ** the call returns, that the state
+    ** still belongs to it
+    */
+    int in_exec;
+    int generation;
+} lua_xz_exec_state;
+
+typedef struct taglua_xz_stream {
+
+    lzma_stream strm;
+    int is_writer;
+    int is_xz;
+    int executed;
+    int is_closed;
+
+    /* lzma_code already signaled the end of the stream */
+    int ended;
+
+    /* options to lzma encoder */
+    lzma_options_lzma opt_lzma;
+
+    /* options to the multithreaded encoder / decoder */
+    lzma_mt opt_mt;
+
+    /*
+    ** configuration of the encoder / decoder,
+    ** kept to reinitialize it on reset
+    */
+    uint32_t preset;
+    lzma_check check;
+    uint64_t memlimit;
+    uint32_t flags;
+
+    /* the lzma_allocator of the stream, if any */
+    lua_xz_alloc alloc;
+
+    /*
+    ** cumulative time, in seconds,
+    ** spent by lzma_code, by the producer
+    ** and by the consumer
+    */
+    double time_code;
+    double time_producer;
+    double time_consumer;
+
+    /*
+    ** single-threaded .xz writers end
+    ** their blocks explicitly, keeping
+    ** track of the blocks written so far
+    */
+    int track_blocks;
+
+    /*
+    ** set while the current block is
+    ** being ended with LZMA_FULL_FLUSH
+    ** on behalf of the caller
+    */
+    int block_ending;
+
+    /*
+    ** maximum uncompressed size of a block
+    ** (0 lets a block grow until it is ended)
+    */
+    uint64_t block_size;
+
+    /* uncompressed bytes fed to the current block */
+    uint64_t block_in;
+
+    /* uncompressed and compressed offsets of the current block */
+    uint64_t block_start_in;
+    uint64_t block_start_out;
+
+    /* table of the finished blocks */
+    lua_xz_block *blocks;
+    size_t blocks_count;
+    size_t blocks_capacity;
+
+    /*
+    ** raw streams code the data through
+    ** the filter chain alone, without
+    ** any container format
+    */
+    int is_raw;
+
+    /*
+    ** custom filter chain of .xz writers
+    ** and raw streams, when `has_filters'
+    ** is set
+    */
+    int has_filters;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lua_xz_filter_options filter_options[LZMA_FILTERS_MAX];
+
+    /*
+    ** reference to the table of the
+    ** dictionaries of the filter chain
+    ** of raw streams
+    */
+    int dictionaries_ref;
+
+    /* state of the loop of exec */
+    lua_xz_exec_state exec;
+
+    /*
+    ** the async handle running the
+    ** stream on its worker thread
+    */
+    struct taglua_xz_async *async;
+
+} lua_xz_stream;
+
+#define LUA_XZ_STREAM_METATABLE "lua_xz_stream_metatable"
+
+static void lua_xz_async_stop(struct taglua_xz_async *a);
+
+static lua_xz_stream *lua_xz_check_stream(lua_State *L, int index)
+{
+    void *ud = luaL_checkudata(L, index, LUA_XZ_STREAM_METATABLE);
+    luaL_argcheck(L, ud != NULL, index, "lua_xz_stream expected");
+    luaL_argcheck(L, ((lua_xz_stream *)ud)->async == NULL, index, "lua_xz_stream is owned by an async handle");
+    return (lua_xz_stream *)ud;
+}
+
+static lua_xz_stream *lua_xz_check_active_stream(lua_State *L, int index)
+{
+    lua_xz_stream *stream = lua_xz_check_stream(L, index);
+    luaL_argcheck(L, !stream->exec.in_exec, 1, "lua_xz_stream cannot be used while exec is suspended");
+    luaL_argcheck(L, !stream->executed, 1, "lua_xz_stream cannot be used after it was executed");
+    luaL_argcheck(L, !stream->is_closed, 1, "lua_xz_stream cannot be used after it was closed");
+    return stream;
+}
+
+/*
+** empties the block table and
+** starts the first block
+*/
+static void lua_xz_stream_clear_blocks(lua_xz_stream *stream)
+{
+    stream->block_ending = 0;
+    stream->block_in = 0;
+    stream->block_start_in = 0;
+    stream->block_start_out = LZMA_STREAM_HEADER_SIZE;
+    stream->blocks_count = 0;
+}
+
+/*
+** pushes a new lua_xz_stream userdata
+** holding an uninitialized lzma_stream
+*/
+static lua_xz_stream *lua_xz_stream_alloc(lua_State *L, int is_xz, int is_writer)
+{
+    lua_xz_stream *stream;
+    void *ud = lua_newuserdata(L, sizeof(lua_xz_stream));
+    if (ud == NULL)
+    {
+        luaL_error(L, "Failed to create lua_xz_stream userdata");
+    }
+
+    luaL_getmetatable(L, LUA_XZ_STREAM_METATABLE);
+    lua_setmetatable(L, -2);
+
+    stream = (lua_xz_stream *)ud;
+    memset(&stream->strm, 0, sizeof(lzma_stream));
+    memset(&stream->opt_mt, 0, sizeof(lzma_mt));
+    memset(&stream->alloc, 0, sizeof(lua_xz_alloc));
+    stream->time_code = 0.0;
+    stream->time_producer = 0.0;
+    stream->time_consumer = 0.0;
+    stream->is_writer = is_writer;
+    stream->is_xz = is_xz;
+    stream->executed = 0;
+    stream->is_closed = 0;
+    stream->ended = 0;
+    stream->track_blocks = 0;
+    stream->block_size = 0;
+    stream->blocks = NULL;
+    stream->blocks_capacity = 0;
+    stream->is_raw = 0;
+    stream->has_filters = 0;
+    stream->dictionaries_ref = LUA_NOREF;
+    stream->exec.pending = 0;
+    stream->exec.anchor_ref = LUA_NOREF;
+    stream->exec.in_exec = 0;
+    stream->exec.generation = 0;
+    stream->async = NULL;
+    lua_xz_stream_clear_blocks(stream);
+
+    return stream;
+}
+
+/*
+** creates the encoder / decoder of `stream'
+** from the configuration stored on it.
+** 
+** When the lzma_stream was already initialized
+** with the same kind of coder, liblzma
+** reuses its allocations.
+*/
+static void lua_xz_stream_setup(lua_State *L, lua_xz_stream *stream)
+{
+    lzma_ret ret;
+
+    if (stream->is_raw)
+    {
+        if (stream->is_writer)
+        {
+            ret = lzma_raw_encoder(&stream->strm, (const lzma_filter *)stream->filters);
+        }
+        else
+        {
+            ret = lzma_raw_decoder(&stream->strm, (const lzma_filter *)stream->filters);
+        }
+
+        if (ret != LZMA_OK)
+        {
+            switch (ret)
+            {
+            case LZMA_MEM_ERROR:
+                luaL_error(L, "Memory allocation failed");
+                break;
+            case LZMA_OPTIONS_ERROR:
+                luaL_error(L, "The given filter chain is not supported by this build of liblzma");
+                break;
+            case LZMA_PROG_ERROR:
+                luaL_error(L, "One or more of the parameters have values that will never be valid");
+                break;
+            default:
+                luaL_error(L, stream->is_writer ? "Failed to create lzma_raw_encoder" : "Failed to create lzma_raw_decoder");
+                break;
+            }
+        }
+    }
+    else if (stream->is_writer)
+    {
+        if (stream->is_xz)
+        {
+            if (stream->opt_mt.threads > 0)
+            {
+                stream->opt_mt.preset = stream->preset;
+                stream->opt_mt.filters = stream->has_filters ? (const lzma_filter *)stream->filters : NULL;
+                stream->opt_mt.check = stream->check;
+
+                ret = lzma_stream_encoder_mt(
+                    &stream->strm,
+                    (const lzma_mt *)&stream->opt_mt);
+            }
+            else if (stream->has_filters)
+            {
+                ret = lzma_stream_encoder(
+                    &stream->strm,
+                    (const lzma_filter *)stream->filters,
+                    stream->check);
+            }
+            else
+            {
+                ret = lzma_easy_encoder(
+                    &stream->strm,
+                    stream->preset,
+                    stream->check);
+            }
+
+            if (ret != LZMA_OK)
+            {
+                switch (ret)
+                {
+                case LZMA_MEM_ERROR:
+                    luaL_error(L, "Memory allocation failed");
+                    break;
+                case LZMA_OPTIONS_ERROR:
+                    luaL_error(L, stream->has_filters ? "The given filter chain, LZMA options or multithreading options are not supported by this build of liblzma" : "The given compression preset or multithreading options are not supported by this build of liblzma");
+                    break;
+                case LZMA_UNSUPPORTED_CHECK:
+                    luaL_error(L, "The given check type is not supported by this build of liblzma");
+                    break;
+                case LZMA_PROG_ERROR:
+                    luaL_error(L, "One or more of the parameters have values that will never be valid");
+                    break;
+                default:
+                    luaL_error(L, stream->opt_mt.threads > 0 ? "Failed to create lzma_stream_encoder_mt" : stream->has_filters ? "Failed to create lzma_stream_encoder" : "Failed to create lzma_easy_encoder");
+                    break;
+                }
+            }
+        }
+        else
+        {
+            if (!stream->has_filters && lzma_lzma_preset(&stream->opt_lzma, stream->preset))
+            {
+                luaL_error(L, "Unsupported preset");
+            }
+
+            ret = lzma_alone_encoder(&stream->strm, (const lzma_options_lzma *)&stream->opt_lzma);
+
+            if (ret != LZMA_OK)
+            {
+                switch (ret)
+                {
+                case LZMA_MEM_ERROR:
+                    luaL_error(L, "Memory allocation failed");
+                    break;
+                case LZMA_OPTIONS_ERROR:
+                    luaL_error(L, stream->has_filters ? "The given LZMA options are not supported by this build of liblzma" : "The given compression preset is not supported by this build of liblzma");
+                    break;
+                case LZMA_PROG_ERROR:
+                    luaL_error(L, "One or more of the parameters have values that will never be valid");
+                    break;
+                default:
+                    luaL_error(L, "Failed to create lzma_alone_encoder");
+                    break;
+                }
+            }
+        }
+    }
+    else
+    {
+        if (stream->is_xz)
+        {
+            if (stream->opt_mt.threads > 0)
+            {
+#ifdef LUA_XZ_HAS_STREAM_DECODER_MT
+                stream->opt_mt.flags = stream->flags;
+                stream->opt_mt.memlimit_stop = stream->memlimit;
+
+                ret = lzma_stream_decoder_mt(
+                    &stream->strm,
+                    (const lzma_mt *)&stream->opt_mt);
+#else
+                luaL_error(L, "The multithreaded decoder requires liblzma 5.4.0 or newer");
+                return;
+#endif
+            }
+            else
+            {
+                ret = lzma_stream_decoder(
+                    &stream->strm,
+                    stream->memlimit,
+                    stream->flags);
+            }
+
+            if (ret != LZMA_OK)
+            {
+                switch (ret)
+                {
+                case LZMA_MEM_ERROR:
+                    luaL_error(L, "Memory allocation failed");
+                    break;
+                case LZMA_OPTIONS_ERROR:
+                    luaL_error(L, "Unsupported decompressor flags");
+                    break;
+                default:
+                    luaL_error(L, stream->opt_mt.threads > 0 ? "Failed to create lzma_stream_decoder_mt" : "Failed to create lzma_stream_decoder");
+                    break;
+                }
+            }
+        }
+        else
+        {
+            ret = lzma_alone_decoder(
+                &stream->strm,
+                stream->memlimit);
+
+            if (ret != LZMA_OK)
+            {
+                switch (ret)
+                {
+                case LZMA_MEM_ERROR:
+                    luaL_error(L, "Memory allocation failed");
+                    break;
+                case LZMA_OPTIONS_ERROR:
+                    luaL_error(L, "Unsupported decompressor flags");
+                    break;
+                default:
+                    luaL_error(L, "Failed to create lzma_alone_decoder");
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+** installs the lzma_allocator given by
+** the field `allocator' of the options
+** table at `options' on `stream'
+*/
+static void lua_xz_stream_optallocator(lua_State *L, lua_xz_stream *stream, int options)
+{
+    const char *name;
+    int kind;
+
+    if (lua_xz_aux_getoption(L, options, "allocator") == LUA_TNIL)
+    {
+        lua_pop(L, 1);
+        return;
+    }
+
+    name = lua_tostring(L, -1);
+    if (name != NULL && strcmp(name, "malloc") == 0)
+    {
+        kind = LUA_XZ_ALLOC_MALLOC;
+    }
+    else if (name != NULL && strcmp(name, "lua") == 0)
+    {
+        kind = LUA_XZ_ALLOC_LUA;
+    }
+    else if (name != NULL && strcmp(name, "pool") == 0)
+    {
+        kind = LUA_XZ_ALLOC_POOL;
+    }
+    else
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "option allocator must be \"malloc\", \"lua\" or \"pool\"");
+        return;
+    }
+    lua_pop(L, 1);
+
+    /*
+    ** lua_Alloc is not thread-safe,
+    ** while the worker threads of liblzma
+    ** allocate memory on their own
+    */
+    if (kind == LUA_XZ_ALLOC_LUA && stream->opt_mt.threads > 0)
+    {
+        luaL_error(L, "allocator \"lua\" cannot be used by multithreaded streams");
+    }
+
+    stream->alloc.kind = kind;
+    stream->alloc.allocated = 0;
+    stream->alloc.lua_alloc = lua_getallocf(L, &stream->alloc.lua_ud);
+    stream->alloc.allocator.alloc = lua_xz_alloc_alloc;
+    stream->alloc.allocator.free = lua_xz_alloc_free;
+    stream->alloc.allocator.opaque = (void *)&stream->alloc;
+    stream->strm.allocator = (const lzma_allocator *)&stream->alloc.allocator;
+}
+
+/*
+** initializes the encoder of the writer `stream'
+** with the given preset and, for .xz streams,
+** the check and the options table at `options'
+*/
+static void lua_xz_stream_init_writer(lua_State *L, lua_xz_stream *stream, uint32_t preset, lzma_check check, int options)
+{
+    int has_lzma_options;
+
+    stream->preset = preset;
+    stream->check = check;
+
+    if (stream->is_xz)
+    {
+        /*
+        ** when the options table
+        ** provides the number of threads,
+        ** use the multithreaded encoder
+        */
+        stream->opt_mt.threads = lua_xz_aux_optthreads(L, options);
+
+        if (stream->opt_mt.threads > 0)
+        {
+            stream->opt_mt.block_size = (uint64_t)lua_xz_aux_optinteger(L, options, "block_size", 0);
+            stream->opt_mt.timeout = lua_xz_aux_optuint32(L, options, "timeout", 0);
+        }
+        else
+        {
+            /*
+            ** the single-threaded encoder
+            ** writes a single block, unless
+            ** the binding ends it explicitly
+            */
+            stream->track_blocks = 1;
+            stream->block_size = (uint64_t)lua_xz_aux_optinteger(L, options, "block_size", 0);
+        }
+    }
+
+    /*
+    ** a custom filter chain replaces
+    ** the one of the preset, which
+    ** remains the default of its
+    ** LZMA1 / LZMA2 filters
+    */
+    if (!stream->is_raw)
+    {
+        /*
+        ** the LZMA options of the
+        ** options table override the
+        ** ones of the preset
+        */
+        if (lzma_lzma_preset(&stream->opt_lzma, preset))
+        {
+            luaL_error(L, "Unsupported preset");
+        }
+        has_lzma_options = lua_xz_filter_optlzma(L, options, &stream->opt_lzma);
+
+        if (lua_xz_aux_getoption(L, options, "dictionary") != LUA_TNIL)
+        {
+            luaL_error(L, "option dictionary is only supported by raw streams");
+        }
+        lua_pop(L, 1);
+
+        if (lua_xz_aux_getoption(L, options, "filters") != LUA_TNIL)
+        {
+            if (!stream->is_xz)
+            {
+                luaL_error(L, "option filters is only supported by .xz writers");
+            }
+
+            if (has_lzma_options)
+            {
+                luaL_error(L, "LZMA options must be given on the LZMA2 filter of the option filters");
+            }
+
+            lua_xz_filter_checkchain(L, lua_gettop(L), preset, stream->filters, stream->filter_options, 0);
+            stream->has_filters = 1;
+        }
+        else if (has_lzma_options)
+        {
+            /*
+            ** a chain with a single LZMA2 (.xz) or
+            ** LZMA1 (.lzma) filter holds them
+            */
+            stream->filters[0].id = stream->is_xz ? LZMA_FILTER_LZMA2 : LZMA_FILTER_LZMA1;
+            stream->filters[0].options = (void *)&stream->opt_lzma;
+            stream->filters[1].id = LZMA_VLI_UNKNOWN;
+            stream->filters[1].options = NULL;
+            stream->has_filters = 1;
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_xz_stream_optallocator(L, stream, options);
+    lua_xz_stream_setup(L, stream);
+}
+
+/*
+** initializes the decoder of the reader `stream'
+** with the given memlimit and, for .xz streams,
+** the flags and the options table at `options'
+*/
+static void lua_xz_stream_init_reader(lua_State *L, lua_xz_stream *stream, uint64_t memlimit, uint32_t flags, int options)
+{
+    stream->memlimit = memlimit;
+    stream->flags = flags;
+
+    if (stream->is_xz)
+    {
+        /*
+        ** when the options table
+        ** provides the number of threads,
+        ** use the multithreaded decoder
+        */
+        stream->opt_mt.threads = lua_xz_aux_optthreads(L, options);
+
+        if (stream->opt_mt.threads > 0)
+        {
+            stream->opt_mt.timeout = lua_xz_aux_optuint32(L, options, "timeout", 0);
+
+            /*
+            ** the soft limit defaults to
+            ** a quarter of the physical memory,
+            ** as suggested by liblzma
+            */
+            stream->opt_mt.memlimit_threading = lzma_physmem() / 4;
+            if (stream->opt_mt.memlimit_threading == 0)
+            {
+                stream->opt_mt.memlimit_threading = memlimit;
+            }
+            stream->opt_mt.memlimit_threading = lua_xz_aux_optmemlimit(L, options, "memlimit_threading", stream->opt_mt.memlimit_threading);
+        }
+    }
+
+    lua_xz_stream_optallocator(L, stream, options);
+    lua_xz_stream_setup(L, stream);
+}
+
+static int lua_xz_stream_new(lua_State *L, int is_xz, int is_writer)
+{
+    /* writer variables and args */
+    lua_Integer arg_check;
+
+    uint32_t preset;
+    lzma_check check = LZMA_CHECK_NONE;
+
+    /* reader variables and args */
+    uint64_t memlimit;
+    lua_Integer arg_flags;
+    uint32_t flags = 0;
+
+    /* variables for both */
+    lua_xz_stream *stream;
+
+    stream = lua_xz_stream_alloc(L, is_xz, is_writer);
+
+    if (is_writer)
+    {
+        preset = lua_xz_aux_checkpreset(L, 1);
+
+        if (is_xz)
+        {
+            arg_check = luaL_checkinteger(L, 2);
+            check = (lzma_check)arg_check;
+        }
+
+        lua_xz_stream_init_writer(L, stream, preset, check, is_xz ? 3 : 2);
+    }
+    else
+    {
+        memlimit = lua_xz_aux_checkmemlimit(L, 1);
+
+        if (is_xz)
+        {
+            arg_flags = luaL_checkinteger(L, 2);
+            luaL_argcheck(L, arg_flags >= 0, 2, "flags must be an integer greater than or equal to 0");
+
+            flags = (uint32_t)arg_flags;
+        }
+
+        lua_xz_stream_init_reader(L, stream, memlimit, flags, is_xz ? 3 : 2);
+    }
+
+    return 1;
+}
+
+/*
+** creates a raw writer / reader stream,
+** coding the data through the filter
+** chain at index 1 alone
+*/
+static int lua_xz_stream_new_raw(lua_State *L, int is_writer)
+{
+    lua_xz_stream *stream;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    stream = lua_xz_stream_alloc(L, 0, is_writer);
+    stream->is_raw = 1;
+
+    /*
+    ** the dictionaries must outlive
+    ** the filter chain, which is reused
+    ** on every reset
+    */
+    lua_newtable(L);
+    lua_xz_filter_checkchain(L, 1, LZMA_PRESET_DEFAULT, stream->filters, stream->filter_options, lua_gettop(L));
+    stream->dictionaries_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    stream->has_filters = 1;
+
+    if (is_writer)
+    {
+        lua_xz_stream_init_writer(L, stream, LZMA_PRESET_DEFAULT, LZMA_CHECK_NONE, 2);
+    }
+    else
+    {
+        lua_xz_stream_init_reader(L, stream, UINT64_MAX, 0, 2);
+    }
+
+    return 1;
+}
+
+/*
+** returns the message matching
+** the return code of lzma_code
+*/
+static const char *lua_xz_stream_strerror(int is_writer, lzma_ret ret)
+{
+    if (is_writer)
+    {
+        switch (ret)
+        {
+        case LZMA_MEM_ERROR:
+            return "Memory allocation failed in the writer stream";
+        case LZMA_DATA_ERROR:
+            return "File size limits exceeded";
+        default:
+            return "Unknown error, possibly a bug in the writer stream";
+        }
+    }
+    else
+    {
+        switch (ret)
+        {
+        case LZMA_MEM_ERROR:
+            return "Memory allocation failed in the reader stream";
+        case LZMA_MEMLIMIT_ERROR:
+            return "Memory usage limit was reached in the reader stream";
+        case LZMA_FORMAT_ERROR:
+            return "The input is not in the .xz format";
+        case LZMA_OPTIONS_ERROR:
+            return "Unsupported compression options";
+        case LZMA_DATA_ERROR:
+            return "Compressed file is corrupt";
+        case LZMA_BUF_ERROR:
+            return "Compressed file is truncated or otherwise corrupt";
+        case LZMA_UNSUPPORTED_CHECK:
+            return "The integrity check of the input is not supported by this build of liblzma";
+        default:
+            return "Unknown error, possibly a bug in the reader stream";
+        }
+    }
+}
+
+/*
+** raises the error matching
+** the return code of lzma_code
+*/
+static int lua_xz_stream_error(lua_State *L, lua_xz_stream *stream, lzma_ret ret)
+{
+    return luaL_error(L, "%s", lua_xz_stream_strerror(stream->is_writer, ret));
+}
+
+/*
+** appends the block ended right now
+** to the block table of `stream'.
+** 
+** Returns LZMA_MEM_ERROR when the
+** table cannot grow, or LZMA_OK.
+*/
+static lzma_ret lua_xz_stream_end_block(lua_xz_stream *stream)
+{
+    lzma_stream *s = &stream->strm;
+    lua_xz_block *blocks;
+    lua_xz_block *block;
+    size_t capacity;
+
+    /* LZMA_FULL_FLUSH does not write empty blocks */
+    if (s->total_in > stream->block_start_in)
+    {
+        if (stream->blocks_count == stream->blocks_capacity)
+        {
+            capacity = stream->blocks_capacity == 0 ? 16 : 2 * stream->blocks_capacity;
+            blocks = (lua_xz_block *)realloc(stream->blocks, capacity * sizeof(lua_xz_block));
+            if (blocks == NULL)
+            {
+                return LZMA_MEM_ERROR;
+            }
+            stream->blocks = blocks;
+            stream->blocks_capacity = capacity;
+        }
+
+        block = &stream->blocks[stream->blocks_count++];
+        block->uncompressed_offset = stream->block_start_in;
+        block->uncompressed_size = s->total_in - stream->block_start_in;
+        block->compressed_offset = stream->block_start_out;
+        block->compressed_size = s->total_out - stream->block_start_out;
+    }
+
+    stream->block_in = 0;
+    stream->block_start_in = s->total_in;
+    stream->block_start_out = s->total_out;
+    return LZMA_OK;
+}
+
+/*
+** runs lzma_code on `stream'.
+** 
+** On single-threaded .xz writers, the
+** current block is ended by LZMA_FULL_FLUSH
+** as soon as it holds `block_size' bytes,
+** holding back the input beyond it, and before
+** the stream is finished, so that every block
+** lands on the block table. Once such a flush
+** completes, LZMA_OK is returned and the caller
+** goes on with its own action.
+*/
+static lzma_ret lua_xz_stream_lzma_code(lua_xz_stream *stream, lzma_action action)
+{
+    lzma_stream *s = &stream->strm;
+    uint64_t block_left;
+    size_t held = 0;
+    size_t fed;
+    lzma_ret ret;
+
+    if (!stream->track_blocks)
+    {
+        return lzma_code(s, action);
+    }
+
+    block_left = stream->block_size - stream->block_in;
+
+    if (!stream->block_ending)
+    {
+        stream->block_ending = (stream->block_size > 0 && (uint64_t)s->avail_in >= block_left) ||
+            (action == LZMA_FINISH && (s->avail_in > 0 || stream->block_in > 0));
+    }
+
+    if (stream->block_ending)
+    {
+        if (stream->block_size > 0 && (uint64_t)s->avail_in > block_left)
+        {
+            held = s->avail_in - (size_t)block_left;
+        }
+        action = LZMA_FULL_FLUSH;
+    }
+
+    s->avail_in -= held;
+    fed = s->avail_in;
+    ret = lzma_code(s, action);
+    stream->block_in += fed - s->avail_in;
+    s->avail_in += held;
+
+    if (action == LZMA_FULL_FLUSH && ret == LZMA_STREAM_END)
+    {
+        ret = lua_xz_stream_end_block(stream);
+
+        if (stream->block_ending)
+        {
+            stream->block_ending = 0;
+        }
+        else if (ret == LZMA_OK)
+        {
+            ret = LZMA_STREAM_END;
+        }
+    }
+
+    return ret;
+}
+
+/*
+** default amount of input, in bytes,
+** between the calls of the progress
+** function given to `exec'
+*/
+#ifndef LUA_XZ_PROGRESS_INTERVAL
+#define LUA_XZ_PROGRESS_INTERVAL (1024 * 1024)
+#endif
+
+/*
+** maximum amount of space requested
+** at once by `lua_xz_stream_code'
+** to hold the output of lzma_code
+*/
+#define LUA_XZ_STREAM_CODE_MAX_CHUNK (1024 * 1024)
+
+/*
+** runs lzma_code on the pending input of `s'
+** with the given `action', appending
+** the output directly to the buffer `B'.
+** 
+** With LZMA_RUN, it stops as soon as the input
+** is consumed and no more output is pending.
+** With any other action, it stops when
+** lzma_code signals the end of the action
+** by returning LZMA_STREAM_END.
+** 
+** Returns LZMA_OK, LZMA_STREAM_END or
+** the error returned by lzma_code.
+*/
+static lzma_ret lua_xz_stream_code(lua_xz_stream *stream, lzma_action action, luaL_Buffer *B)
+{
+    lzma_stream *s = &stream->strm;
+    double start;
+    lzma_ret ret;
+    char *chunk;
+    size_t chunk_size = LUA_XZ_BUFFER_SIZE;
+    size_t size;
+
+    while (1)
+    {
+        size = chunk_size;
+        chunk = lua_xz_aux_prepbuffsize(B, &size);
+
+        s->next_out = (uint8_t *)chunk;
+        s->avail_out = size;
+
+        start = lua_xz_aux_clock();
+        ret = lua_xz_stream_lzma_code(stream, action);
+        stream->time_code += lua_xz_aux_clock() - start;
+
+        luaL_addsize(B, size - s->avail_out);
+
+        if (ret != LZMA_OK)
+        {
+            return ret;
+        }
+
+        if (action == LZMA_RUN && s->avail_in == 0 && s->avail_out != 0)
+        {
+            return ret;
+        }
+
+        /* request larger chunks as the output grows */
+        if (chunk_size < LUA_XZ_STREAM_CODE_MAX_CHUNK)
+        {
+            chunk_size *= 2;
+        }
+    }
+}
+
+/*
+** returns the action that makes all
+** the data fed so far to the .xz writer
+** `stream' decodable by the reader.
+** 
+** The multithreaded encoder does
+** not support LZMA_SYNC_FLUSH, but
+** LZMA_FULL_FLUSH achieves the same
+** at the cost of starting a new block
+*/
+static lzma_action lua_xz_stream_sync_action(lua_xz_stream *stream)
+{
+    return stream->opt_mt.threads > 0 ? LZMA_FULL_FLUSH : LZMA_SYNC_FLUSH;
+}
+
+/*
+** reads the optional flush action returned
+** by the producer function of `exec' (on the
+** top of the stack), returning LZMA_RUN
+** when it is absent
+*/
+static lzma_action lua_xz_stream_optflush(lua_State *L, lua_xz_stream *stream)
+{
+    lua_Integer arg_action;
+
+    if (lua_isnil(L, -1))
+    {
+        return LZMA_RUN;
+    }
+
+    if (!stream->is_writer || !stream->is_xz)
+    {
+        luaL_error(L, "Flush actions are only supported by xzwriter streams");
+    }
+
+    arg_action = lua_xz_aux_isinteger(L, -1) ? lua_tointeger(L, -1) : -1;
+
+    if (arg_action == LZMA_SYNC_FLUSH)
+    {
+        return lua_xz_stream_sync_action(stream);
+    }
+
+    if (arg_action != LZMA_FULL_FLUSH)
+    {
+        luaL_error(L, "Produced flush action must be xz.SYNC_FLUSH, xz.FULL_FLUSH or nil");
+    }
+
+    return LZMA_FULL_FLUSH;
+}
+
+static int lua_xz_stream_exec_resume(lua_State *L, int status, int generation);
+
+/*
+** calls the function on the stack
+** as lua_pcall does, on behalf of the exec
+** of `e'. On Lua 5.2 or newer, the function
+** might yield, and the loop of exec
+** is resumed by a continuation
+*/
+#if LUA_VERSION_NUM >= 503
+static int lua_xz_stream_exec_k(lua_State *L, int status, lua_KContext ctx)
+{
+    return lua_xz_stream_exec_resume(L, status, (int)ctx);
+}
+#define lua_xz_stream_exec_pcall(L, e, nargs, nresults) ((e)->in_exec = 1, lua_pcallk(L, (nargs), (nresults), 0, (lua_KContext)(e)->generation, lua_xz_stream_exec_k))
+#elif LUA_VERSION_NUM == 502
+static int lua_xz_stream_exec_k(lua_State *L)
+{
+    int ctx;
+    int status = lua_getctx(L, &ctx);
+    return lua_xz_stream_exec_resume(L, status, ctx);
+}
+#define lua_xz_stream_exec_pcall(L, e, nargs, nresults) ((e)->in_exec = 1, lua_pcallk(L, (nargs), (nresults), 0, (e)->generation, lua_xz_stream_exec_k))
+#else
+#define lua_xz_stream_exec_pcall(L, e, nargs, nresults) ((e)->in_exec = 1, lua_pcall(L, (nargs), (nresults), 0))
+#endif
+
+/*
+** whether a call made by lua_xz_stream_exec_pcall
+** succeeded: continuations receive LUA_YIELD
+** when the function yielded and returned
+*/
+#define lua_xz_stream_exec_succeeded(status) ((status) == 0 || (status) == LUA_YIELD)
+
+/*
+** raises when the stream was closed, or
+** its state was taken over by reset (and
+** maybe by another exec), while a call made
+** by the exec of `generation' was running
+*/
+static void lua_xz_stream_exec_check(lua_State *L, lua_xz_stream *stream, int generation)
+{
+    if (stream->is_closed)
+    {
+        luaL_error(L, "lua_xz_stream was closed while exec was suspended");
+    }
+
+    if (stream->exec.generation != generation)
+    {
+        luaL_error(L, "lua_xz_stream was reset while exec was suspended");
+    }
+}
+
+/*
+** marks the end of a call made by
+** lua_xz_stream_exec_pcall, once the
+** exec of `generation' still owns the stream
+*/
+static void lua_xz_stream_exec_returned(lua_State *L, lua_xz_stream *stream, int generation)
+{
+    lua_xz_stream_exec_check(L, stream, generation);
+    stream->exec.in_exec = 0;
+}
+
+/*
+** drops the anchors of
+** a pending budgeted exec
+*/
+static void lua_xz_stream_exec_release(lua_State *L, lua_xz_stream *stream)
+{
+    stream->exec.pending = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, stream->exec.anchor_ref);
+    stream->exec.anchor_ref = LUA_NOREF;
+}
+
+/*
+** whether the budget of the
+** current call of exec ran out
+*/
+static int lua_xz_stream_exec_exhausted(lua_xz_stream *stream)
+{
+    lua_xz_exec_state *e = &stream->exec;
+    uint64_t uncompressed = stream->is_writer ? stream->strm.total_in : stream->strm.total_out;
+
+    return (e->budget_bytes > 0 && uncompressed - e->budget_start_bytes >= (uint64_t)e->budget_bytes) ||
+           (e->budget_time > 0 && lua_xz_aux_clock() - e->budget_start_time >= (double)e->budget_time);
+}
+
+/*
+** returns from a budgeted exec
+** with more work pending, anchoring
+** the buffers, the view and the
+** produced data on the registry
+** until the next call
+*/
+static int lua_xz_stream_exec_pause(lua_State *L, lua_xz_stream *stream)
+{
+    lua_xz_exec_state *e = &stream->exec;
+
+    lua_createtable(L, 3, 0);
+
+    /* the buffers lie right below the produced data */
+    lua_pushvalue(L, e->input_index - 1);
+    lua_rawseti(L, -2, 1);
+
+    if (e->view != NULL)
+    {
+        lua_pushvalue(L, e->view_index);
+        lua_rawseti(L, -2, 2);
+
+        /* the view is not usable until exec runs again */
+        e->view->is_valid = 0;
+    }
+
+    lua_pushvalue(L, e->input_index);
+    lua_rawseti(L, -2, 3);
+
+    e->anchor_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    e->pending = 1;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** runs the loop of exec from the
+** step saved on the stream, where
+** `status' is the status of the call
+** to Lua pending on that step, made by
+** the exec of `generation'
+*/
+static int lua_xz_stream_exec_resume(lua_State *L, int status, int generation)
+{
+    lua_xz_stream *stream = (lua_xz_stream *)lua_touserdata(L, 1);
+    lua_xz_exec_state *e = &stream->exec;
+    lzma_stream *s = &stream->strm;
+    size_t produced_data_size;
+    const char *produced_data;
+    const uint8_t *checksum_data;
+    int produced_data_type;
+    size_t write_size;
+    size_t written;
+    double start;
+
+    /* the stream was closed or reset while a call was suspended */
+    lua_xz_stream_exec_check(L, stream, generation);
+
+    while (1)
+    {
+        switch (e->step)
+        {
+        case LUA_XZ_EXEC_PRODUCE:
+            e->step = LUA_XZ_EXEC_CODE;
+
+            if (s->avail_in == 0 && e->action == LZMA_RUN && e->producer_file != NULL)
+            {
+                start = lua_xz_aux_clock();
+                produced_data_size = fread(e->input_buffer, 1, e->input_buffer_size, e->producer_file);
+                stream->time_producer += lua_xz_aux_clock() - start;
+
+                if (ferror(e->producer_file))
+                {
+                    return luaL_error(L, "Failed to read from the producer file");
+                }
+
+                s->next_in = e->input_buffer;
+                s->avail_in = produced_data_size;
+
+                /* the end of the file finishes the stream */
+                if (feof(e->producer_file))
+                {
+                    e->action = LZMA_FINISH;
+                }
+            }
+            else if (s->avail_in == 0 && e->action == LZMA_RUN)
+            {
+                /* push the producer function */
+                lua_pushvalue(L, 2);
+
+                e->step = LUA_XZ_EXEC_PRODUCED;
+                e->start = lua_xz_aux_clock();
+                status = lua_xz_stream_exec_pcall(L, e, 0, 2);
+            }
+            break;
+
+        case LUA_XZ_EXEC_PRODUCED:
+            lua_xz_stream_exec_returned(L, stream, generation);
+            stream->time_producer += lua_xz_aux_clock() - e->start;
+
+            if (!lua_xz_stream_exec_succeeded(status))
+            {
+                return luaL_error(L, "%s", lua_tostring(L, -1));
+            }
+
+            /*
+            ** the producer might return
+            ** a flush action after the data
+            */
+            e->action = lua_xz_stream_optflush(L, stream);
+            lua_pop(L, 1);
+
+            produced_data_type = lua_type(L, -1);
+
+            if (produced_data_type == LUA_TNIL || produced_data_type == LUA_TNONE)
+            {
+                s->next_in = NULL;
+                s->avail_in = 0;
+                e->action = LZMA_FINISH;
+
+                /* release the previous produced data */
+                lua_replace(L, e->input_index);
+            }
+            else if (produced_data_type == LUA_TSTRING)
+            {
+                produced_data = lua_tolstring(L, -1, &produced_data_size);
+
+                s->next_in = (const uint8_t *)produced_data;
+                s->avail_in = produced_data_size;
+
+                /* anchor the produced data */
+                lua_replace(L, e->input_index);
+            }
+            else
+            {
+                return luaL_error(L, "Produced data must be a string or nil (to finish the stream)");
+            }
+
+            e->step = LUA_XZ_EXEC_CODE;
+            break;
+
+        case LUA_XZ_EXEC_CODE:
+            /*
+            ** apply the auto-flush policy to the
+            ** new input, including pending input
+            ** from earlier chunks
+            */
+            if (e->action == LZMA_RUN && (e->flush_bytes > 0 || e->flush_interval > 0) && s->total_in + s->avail_in > e->last_flush_in)
+            {
+                if ((e->flush_bytes > 0 && s->total_in + s->avail_in - e->last_flush_in >= (uint64_t)e->flush_bytes) ||
+                    (e->flush_interval > 0 && lua_xz_aux_clock() - e->last_flush_time >= (double)e->flush_interval))
+                {
+                    e->action = lua_xz_stream_sync_action(stream);
+                }
+            }
+
+            /* do the encoding / decoding */
+            start = lua_xz_aux_clock();
+            checksum_data = stream->is_writer ? s->next_in : s->next_out;
+            e->ret = lua_xz_stream_lzma_code(stream, e->action);
+
+            /* hash the uncompressed data coded right now */
+            if (e->checksum != NULL && checksum_data != NULL)
+            {
+                lua_xz_hasher_feed(e->checksum, checksum_data, (size_t)((stream->is_writer ? s->next_in : s->next_out) - checksum_data));
+            }
+            stream->time_code += lua_xz_aux_clock() - start;
+
+            e->step = LUA_XZ_EXEC_PROGRESS;
+
+            /* output buffer is full or compression finished successfully */
+            if (s->avail_out == 0 || e->ret == LZMA_STREAM_END)
+            {
+                write_size = e->output_buffer_size - s->avail_out;
+
+                if (e->consumer_file != NULL)
+                {
+                    start = lua_xz_aux_clock();
+                    written = fwrite(e->output_buffer, 1, write_size, e->consumer_file);
+                    stream->time_consumer += lua_xz_aux_clock() - start;
+
+                    if (written != write_size)
+                    {
+                        return luaL_error(L, "Failed to write to the consumer file");
+                    }
+
+                    s->next_out = e->output_buffer;
+                    s->avail_out = e->output_buffer_size;
+                }
+                else
+                {
+                    /* push the consumer function */
+                    lua_pushvalue(L, 3);
+
+                    /* push the arg of the consumer function */
+                    if (e->view != NULL)
+                    {
+                        e->view->size = write_size;
+                        lua_pushvalue(L, e->view_index);
+                    }
+                    else
+                    {
+                        lua_pushlstring(L, (const char *)e->output_buffer, write_size);
+                    }
+
+                    /* call the consumer function */
+                    e->step = LUA_XZ_EXEC_CONSUMED;
+                    e->start = lua_xz_aux_clock();
+                    status = lua_xz_stream_exec_pcall(L, e, 1, 0);
+                }
+            }
+            break;
+
+        case LUA_XZ_EXEC_CONSUMED:
+            lua_xz_stream_exec_returned(L, stream, generation);
+            stream->time_consumer += lua_xz_aux_clock() - e->start;
+
+            if (!lua_xz_stream_exec_succeeded(status))
+            {
+                if (e->view != NULL)
+                {
+                    e->view->is_valid = 0;
+                }
+                return luaL_error(L, "%s", lua_tostring(L, -1));
+            }
+
+            s->next_out = e->output_buffer;
+            s->avail_out = e->output_buffer_size;
+
+            e->step = LUA_XZ_EXEC_PROGRESS;
+            break;
+
+        case LUA_XZ_EXEC_PROGRESS:
+            /*
+            ** the end of a flush action
+            ** requested by the producer
+            */
+            e->flushed = e->ret == LZMA_STREAM_END && e->action != LZMA_RUN && e->action != LZMA_FINISH;
+
+            e->step = LUA_XZ_EXEC_NEXT;
+
+            /* report the progress */
+            if (e->progress_index != 0 && (s->total_in >= e->next_progress || (e->ret == LZMA_STREAM_END && !e->flushed)))
+            {
+                e->next_progress = s->total_in + (uint64_t)e->progress_interval;
+
+                lua_pushvalue(L, e->progress_index);
+                lua_pushinteger(L, (lua_Integer)s->total_in);
+                lua_pushinteger(L, (lua_Integer)s->total_out);
+
+                e->step = LUA_XZ_EXEC_PROGRESSED;
+                status = lua_xz_stream_exec_pcall(L, e, 2, 0);
+            }
+            break;
+
+        case LUA_XZ_EXEC_PROGRESSED:
+            lua_xz_stream_exec_returned(L, stream, generation);
+
+            if (!lua_xz_stream_exec_succeeded(status))
+            {
+                if (e->view != NULL)
+                {
+                    e->view->is_valid = 0;
+                }
+                return luaL_error(L, "%s", lua_tostring(L, -1));
+            }
+
+            e->step = LUA_XZ_EXEC_NEXT;
+            break;
+
+        default:
+            e->step = LUA_XZ_EXEC_PRODUCE;
+
+            if (e->flushed)
+            {
+                e->action = LZMA_RUN;
+                e->last_flush_in = s->total_in;
+                e->last_flush_time = lua_xz_aux_clock();
+            }
+            else if (e->ret != LZMA_OK)
+            {
+                /* the view is not usable after exec returns */
+                if (e->view != NULL)
+                {
+                    e->view->is_valid = 0;
+                }
+
+                if (e->ret == LZMA_STREAM_END)
+                {
+                    lua_pushboolean(L, 0);
+                    return 1;
+                }
+
+                return lua_xz_stream_error(L, stream, e->ret);
+            }
+
+            /* the budget of this call ran out */
+            if ((e->budget_bytes > 0 || e->budget_time > 0) && lua_xz_stream_exec_exhausted(stream))
+            {
+                return lua_xz_stream_exec_pause(L, stream);
+            }
+            break;
+        }
+    }
+}
+
+/* 
+** this function follows the pattern
+** https://github.com/tukaani-project/xz/raw/c3cb1e53a114ac944f559fe7cac45dbf48cca156/doc/examples/01_compress_easy.c
+** to compress data, and
+** https://github.com/tukaani-project/xz/raw/c3cb1e53a114ac944f559fe7cac45dbf48cca156/doc/examples/02_decompress.c
+** to decompress data
+** 
+** on top of that,
+** we added a producer / consumer
+** pattern to the lzma_stream
+*/
+static int lua_xz_stream_exec(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_stream(L, 1);
+    lua_xz_exec_state *e = &stream->exec;
+    lzma_stream *s = &stream->strm;
+
+    /* 
+    ** dynamically allocated
+    ** output buffer to hold
+    ** data from the lzma_stream
+    */
+    lua_xz_aux_buffers *b;
+    int use_view = 0;
+
+    /*
+    ** a pending budgeted exec continues
+    ** the loop of the previous call
+    */
+    int is_pending = e->pending;
+    int anchors;
+
+    lua_Integer arg_output_buffer_size;
+
+    luaL_argcheck(L, !e->in_exec, 1, "lua_xz_stream cannot be used while exec is suspended");
+
+    if (!is_pending)
+    {
+        lua_xz_check_active_stream(L, 1);
+
+        /* prevent exec from running again */
+        stream->executed = 1;
+        e->generation++;
+
+        e->step = LUA_XZ_EXEC_PRODUCE;
+        e->action = LZMA_RUN;
+        e->ret = LZMA_OK;
+        e->flushed = 0;
+        e->view = NULL;
+    }
+
+    e->view_index = 0;
+    e->progress_index = 0;
+    e->progress_interval = LUA_XZ_PROGRESS_INTERVAL;
+    e->flush_bytes = 0;
+    e->flush_interval = 0;
+    e->budget_bytes = 0;
+    e->budget_time = 0;
+    e->checksum = NULL;
+
+    /*
+    ** validate buffer size to be able
+    ** to create the output buffer
+    ** of lua_xz_aux_buffers with correct size.
+    ** 
+    ** The 4th argument is either the buffer
+    ** size or a table of options
+    */
+    if (lua_istable(L, 4))
+    {
+        arg_output_buffer_size = lua_xz_aux_optinteger(L, 4, "buffersize", LUA_XZ_BUFFER_SIZE);
+
+        lua_xz_aux_getoption(L, 4, "view");
+        use_view = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        e->progress_interval = lua_xz_aux_optinteger(L, 4, "progress_interval", LUA_XZ_PROGRESS_INTERVAL);
+        luaL_argcheck(L, e->progress_interval > 0, 4, "progress_interval must be a positive integer");
+
+        e->flush_bytes = lua_xz_aux_optinteger(L, 4, "flush_bytes", 0);
+
+        if (lua_xz_aux_getoption(L, 4, "flush_interval") != LUA_TNIL)
+        {
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0, 4, "flush_interval must be a number greater than or equal to 0");
+            e->flush_interval = lua_tonumber(L, -1);
+        }
+        lua_pop(L, 1);
+
+        luaL_argcheck(L, (e->flush_bytes == 0 && e->flush_interval == 0) || (stream->is_writer && stream->is_xz), 4, "flush_bytes and flush_interval are only supported by xzwriter streams");
+
+        e->budget_bytes = lua_xz_aux_optinteger(L, 4, "budget_bytes", 0);
+
+        if (lua_xz_aux_getoption(L, 4, "budget_time") != LUA_TNIL)
+        {
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0, 4, "budget_time must be a number greater than or equal to 0");
+            e->budget_time = lua_tonumber(L, -1);
+        }
+        lua_pop(L, 1);
+
+        /* the hasher stays anchored by the options table */
+        if (lua_xz_aux_getoption(L, 4, "checksum") != LUA_TNIL)
+        {
+            e->checksum = (lua_xz_hasher *)lua_xz_aux_testudata(L, -1, LUA_XZ_HASHER_METATABLE);
+            luaL_argcheck(L, e->checksum != NULL, 4, "checksum must be a hasher created by xz.crc32 or xz.crc64");
+        }
+        lua_pop(L, 1);
+
+        /* keep the progress function on the stack */
+        if (lua_xz_aux_getoption(L, 4, "progress") == LUA_TNIL)
+        {
+            lua_pop(L, 1);
+        }
+        else
+        {
+            luaL_argcheck(L, lua_isfunction(L, -1), 4, "progress must be a function");
+            e->progress_index = lua_gettop(L);
+        }
+    }
+    else if (lua_xz_aux_isinteger(L, 4))
+    {
+        arg_output_buffer_size = lua_tointeger(L, 4);
+    }
+    else
+    {
+        arg_output_buffer_size = LUA_XZ_BUFFER_SIZE;
+    }
+
+    if (arg_output_buffer_size <= 0)
+    {
+        return luaL_error(L, "Buffer size must be a positive integer");
+    }
+
+    /* assert that producer is a function or a file */
+    e->producer_file = lua_xz_aux_tofile(L, 2);
+    luaL_argcheck(L, e->producer_file != NULL || lua_isfunction(L, 2), 2, "function or file expected");
+
+    /* assert that consumer is a function or a file */
+    e->consumer_file = lua_xz_aux_tofile(L, 3);
+    luaL_argcheck(L, e->consumer_file != NULL || lua_isfunction(L, 3), 3, "function or file expected");
+
+    e->budget_start_bytes = stream->is_writer ? s->total_in : s->total_out;
+    e->budget_start_time = lua_xz_aux_clock();
+
+    if (is_pending)
+    {
+        /*
+        ** the buffers of the first call are kept,
+        ** which only hold an input buffer
+        ** when the producer was a file
+        */
+        luaL_argcheck(L, e->producer_file == NULL || e->input_buffer_size > 0, 2, "pending exec started with a producer function cannot continue with a file");
+
+        /*
+        ** restore the anchors of the
+        ** previous call on the stack,
+        ** in the order of the first call
+        */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, e->anchor_ref);
+        anchors = lua_gettop(L);
+
+        if (e->view != NULL)
+        {
+            lua_rawgeti(L, anchors, 2);
+        }
+        lua_rawgeti(L, anchors, 1);
+        lua_rawgeti(L, anchors, 3);
+        lua_remove(L, anchors);
+
+        e->input_index = lua_gettop(L);
+
+        if (e->view != NULL)
+        {
+            e->view_index = e->input_index - 2;
+            e->view->is_valid = 1;
+        }
+
+        lua_xz_stream_exec_release(L, stream);
+
+        return lua_xz_stream_exec_resume(L, 0, e->generation);
+    }
+
+    e->output_buffer_size = (size_t)arg_output_buffer_size;
+
+    /*
+    ** create the aux buffers, with
+    ** an input buffer of the same size
+    ** of the output buffer to read files
+    */
+    if (use_view && e->consumer_file == NULL)
+    {
+        /* the view owns the output buffer */
+        e->view = lua_xz_buffer_view_new(L, e->output_buffer_size);
+        e->view_index = lua_gettop(L);
+        e->output_buffer = e->view->data;
+
+        b = lua_xz_aux_buffers_new(L, 0, e->producer_file != NULL ? e->output_buffer_size : 0);
+    }
+    else
+    {
+        b = lua_xz_aux_buffers_new(L, e->output_buffer_size, e->producer_file != NULL ? e->output_buffer_size : 0);
+        e->output_buffer = b->output_buffer;
+    }
+
+    e->input_buffer = b->input_buffer;
+    e->input_buffer_size = b->input_buffer_size;
+
+    /*
+    ** the produced data is fed
+    ** to the lzma_stream without
+    ** a copy. Since Lua strings are
+    ** immutable, it is enough to keep
+    ** the string anchored on this
+    ** stack slot until the lzma_stream
+    ** consumes all of it
+    */
+    lua_pushnil(L);
+    e->input_index = lua_gettop(L);
+
+    s->next_in = NULL;
+    s->avail_in = 0;
+    s->next_out = e->output_buffer;
+    s->avail_out = e->output_buffer_size;
+
+    e->next_progress = s->total_in + (uint64_t)e->progress_interval;
+
+    e->last_flush_in = s->total_in;
+    e->last_flush_time = lua_xz_aux_clock();
+
+    return lua_xz_stream_exec_resume(L, 0, e->generation);
+}
+
+/*
+** feeds `data' to the stream, and
+** returns the output produced so far
+*/
+static int lua_xz_stream_update(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_active_stream(L, 1);
+    size_t data_size;
+    const char *data = luaL_checklstring(L, 2, &data_size);
+    lzma_stream *s = &stream->strm;
+    luaL_Buffer B;
+    lzma_ret ret;
+
+    if (stream->ended)
+    {
+        /* data after the end of the stream is ignored */
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    s->next_in = (const uint8_t *)data;
+    s->avail_in = data_size;
+
+    luaL_buffinit(L, &B);
+    ret = lua_xz_stream_code(stream, LZMA_RUN, &B);
+
+    s->next_in = NULL;
+    s->avail_in = 0;
+
+    if (ret == LZMA_STREAM_END)
+    {
+        /* the reader stream reached its end */
+        stream->ended = 1;
+    }
+    else if (ret != LZMA_OK)
+    {
+        return lua_xz_stream_error(L, stream, ret);
+    }
+
+    luaL_pushresult(&B);
+    return 1;
+}
+
+/*
+** on writer streams, makes all the data
+** fed so far decodable by the reader.
+** On reader streams, returns any
+** pending output.
+*/
+static int lua_xz_stream_flush(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_active_stream(L, 1);
+    lzma_stream *s = &stream->strm;
+    lzma_action action;
+    luaL_Buffer B;
+    lzma_ret ret;
+    size_t i;
+
+    if (stream->is_writer)
+    {
+        if (stream->is_raw)
+        {
+            /* LZMA1 cannot flush without ending the stream */
+            for (i = 0; stream->filters[i].id != LZMA_VLI_UNKNOWN; i++)
+            {
+                if (stream->filters[i].id == LZMA_FILTER_LZMA1)
+                {
+                    return luaL_error(L, "rawwriter streams with the LZMA1 filter do not support flush");
+                }
+            }
+        }
+        else if (!stream->is_xz)
+        {
+            return luaL_error(L, "lzmawriter streams do not support flush");
+        }
+
+        action = lua_xz_stream_sync_action(stream);
+    }
+    else
+    {
+        action = LZMA_RUN;
+    }
+
+    if (stream->ended)
+    {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    s->next_in = NULL;
+    s->avail_in = 0;
+
+    luaL_buffinit(L, &B);
+    ret = lua_xz_stream_code(stream, action, &B);
+
+    if (ret == LZMA_STREAM_END)
+    {
+        if (!stream->is_writer)
+        {
+            /* the reader stream reached its end */
+            stream->ended = 1;
+        }
+    }
+    else if (ret != LZMA_OK)
+    {
+        return lua_xz_stream_error(L, stream, ret);
+    }
+
+    luaL_pushresult(&B);
+    return 1;
+}
+
+/*
+** finishes the stream, and
+** returns the remaining output
+*/
+static int lua_xz_stream_finish(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_active_stream(L, 1);
+    lzma_stream *s = &stream->strm;
+    luaL_Buffer B;
+    lzma_ret ret;
+
+    /* prevent the stream from being used again */
+    stream->executed = 1;
+
+    if (stream->ended)
+    {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    s->next_in = NULL;
+    s->avail_in = 0;
+
+    luaL_buffinit(L, &B);
+    ret = lua_xz_stream_code(stream, LZMA_FINISH, &B);
+
+    if (ret != LZMA_STREAM_END)
+    {
+        return lua_xz_stream_error(L, stream, ret);
+    }
+
+    stream->ended = 1;
+
+    luaL_pushresult(&B);
+    return 1;
+}
+/*
+** on .xz writer streams, ends the current
+** block, so that the data fed afterwards
+** starts a new block, and returns the
+** output produced so far
+*/
+static int lua_xz_stream_endblock(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_active_stream(L, 1);
+    lzma_stream *s = &stream->strm;
+    luaL_Buffer B;
+    lzma_ret ret;
+
+    if (!stream->is_writer || !stream->is_xz)
+    {
+        return luaL_error(L, "Only xzwriter streams support end_block");
+    }
+
+    s->next_in = NULL;
+    s->avail_in = 0;
+
+    luaL_buffinit(L, &B);
+    ret = lua_xz_stream_code(stream, LZMA_FULL_FLUSH, &B);
+
+    if (ret != LZMA_STREAM_END)
+    {
+        return lua_xz_stream_error(L, stream, ret);
+    }
+
+    luaL_pushresult(&B);
+    return 1;
+}
+
+/*
+** reinitializes the encoder / decoder in place,
+** so that the stream can process another
+** independent payload reusing the memory
+** already allocated by liblzma
+*/
+static int lua_xz_stream_reset(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_stream(L, 1);
+    lua_Integer arg_flags;
+
+    luaL_argcheck(L, !stream->is_closed, 1, "lua_xz_stream cannot be used after it was closed");
+
+    if (stream->is_raw)
+    {
+        /* the filter chain is kept as is */
+    }
+    else if (stream->is_writer)
+    {
+        if (!lua_isnoneornil(L, 2))
+        {
+            luaL_argcheck(L, !stream->has_filters, 2, "preset cannot be changed on streams with a filter chain or LZMA options");
+            stream->preset = lua_xz_aux_checkpreset(L, 2);
+        }
+
+        if (stream->is_xz && !lua_isnoneornil(L, 3))
+        {
+            stream->check = (lzma_check)luaL_checkinteger(L, 3);
+        }
+    }
+    else
+    {
+        if (!lua_isnoneornil(L, 2))
+        {
+            stream->memlimit = lua_xz_aux_checkmemlimit(L, 2);
+        }
+
+        if (stream->is_xz && !lua_isnoneornil(L, 3))
+        {
+            arg_flags = luaL_checkinteger(L, 3);
+            luaL_argcheck(L, arg_flags >= 0, 3, "flags must be an integer greater than or equal to 0");
+            stream->flags = (uint32_t)arg_flags;
+        }
+    }
+
+    /*
+    ** keep the stream unusable
+    ** when the reinitialization fails
+    */
+    stream->executed = 1;
+    lua_xz_stream_exec_release(L, stream);
+
+    /*
+    ** an exec suspended on a coroutine,
+    ** which might never be resumed (e.g.:
+    ** dropped by an event loop), raises
+    ** once it finds the new generation
+    */
+    stream->exec.in_exec = 0;
+    stream->exec.generation++;
+
+    lua_xz_stream_setup(L, stream);
+
+    stream->executed = 0;
+    stream->ended = 0;
+    lua_xz_stream_clear_blocks(stream);
+    stream->time_code = 0.0;
+    stream->time_producer = 0.0;
+    stream->time_consumer = 0.0;
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+
+static int lua_xz_stream_xzwriter(lua_State *L)
+{
+    return lua_xz_stream_new(L, 1, 1);
+}
+
+static int lua_xz_stream_xzreader(lua_State *L)
+{
+    return lua_xz_stream_new(L, 1, 0);
+}
+
+static int lua_xz_stream_lzmawriter(lua_State *L)
+{
+    return lua_xz_stream_new(L, 0, 1);
+}
+
+static int lua_xz_stream_lzmareader(lua_State *L)
+{
+    return lua_xz_stream_new(L, 0, 0);
+}
+
+static int lua_xz_stream_rawwriter(lua_State *L)
+{
+    return lua_xz_stream_new_raw(L, 1);
+}
+
+static int lua_xz_stream_rawreader(lua_State *L)
+{
+    return lua_xz_stream_new_raw(L, 0);
+}
+
+static int lua_xz_stream_close(lua_State *L)
+{
+    lua_xz_stream *stream = (lua_xz_stream *)luaL_checkudata(L, 1, LUA_XZ_STREAM_METATABLE);
+
+    /*
+    ** the worker of an async handle
+    ** must stop before the lzma_stream
+    ** is released (e.g.: by lua_close,
+    ** which finalizes every object)
+    */
+    if (stream->async != NULL)
+    {
+        lua_xz_async_stop(stream->async);
+        stream->async = NULL;
+    }
+
+    /* drop the anchors of a pending budgeted exec */
+    lua_xz_stream_exec_release(L, stream);
+
+    if (!stream->is_closed)
+    {
+        /* free the lzma_stream */
+        lzma_end(&stream->strm);
+
+        /* prevent it from being called again */
+        stream->is_closed = 1;
+    }
+
+    /* the filter chain cannot be used anymore */
+    luaL_unref(L, LUA_REGISTRYINDEX, stream->dictionaries_ref);
+    stream->dictionaries_ref = LUA_NOREF;
+
+    /*
+    ** the file functions close the
+    ** lzma_stream on their own
+    */
+    free(stream->blocks);
+    stream->blocks = NULL;
+    stream->blocks_capacity = 0;
+    stream->blocks_count = 0;
+    return 0;
+}
+
+/*
+** gets the bytes currently allocated
+** by the encoder / decoder of the stream,
+** when it was created with an allocator
+*/
+static int lua_xz_stream_allocated(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_stream(L, 1);
+    lua_pushinteger(L, (lua_Integer)lua_xz_alloc_allocated(&stream->alloc));
+    return 1;
+}
+
+/*
+** gets the table of the blocks
+** written so far by a single-threaded
+** .xz writer stream
+*/
+static int lua_xz_stream_blocks(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_stream(L, 1);
+    lua_xz_block *block;
+    size_t i;
+
+    luaL_argcheck(L, !stream->is_closed, 1, "lua_xz_stream cannot be used after it was closed");
+
+    if (!stream->track_blocks)
+    {
+        return luaL_error(L, "Only single-threaded xzwriter streams keep the block table");
+    }
+
+    lua_createtable(L, (int)stream->blocks_count, 0);
+    for (i = 0; i < stream->blocks_count; i++)
+    {
+        block = &stream->blocks[i];
+
+        lua_createtable(L, 0, 4);
+
+        lua_pushstring(L, "uncompressed_offset");
+        lua_pushinteger(L, (lua_Integer)block->uncompressed_offset);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "uncompressed_size");
+        lua_pushinteger(L, (lua_Integer)block->uncompressed_size);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "compressed_offset");
+        lua_pushinteger(L, (lua_Integer)block->compressed_offset);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "compressed_size");
+        lua_pushinteger(L, (lua_Integer)block->compressed_size);
+        lua_settable(L, -3);
+
+        lua_rawseti(L, -2, (int)(i + 1));
+    }
+
+    return 1;
+}
+
+/*
+** gets the memory usage of the stream.
+** liblzma only tracks it on decoders
+** of container formats, so the usage of
+** encoders and raw decoders is estimated
+** from their options
+*/
+static uint64_t lua_xz_stream_memusage(lua_xz_stream *stream)
+{
+    lzma_filter filters[2];
+
+    if (stream->is_raw && !stream->is_writer)
+    {
+        return lzma_raw_decoder_memusage((const lzma_filter *)stream->filters);
+    }
+    else if (!stream->is_writer)
+    {
+        return lzma_memusage(&stream->strm);
+    }
+    else if (stream->opt_mt.threads > 0)
+    {
+        return lzma_stream_encoder_mt_memusage((const lzma_mt *)&stream->opt_mt);
+    }
+    else if (stream->has_filters)
+    {
+        return lzma_raw_encoder_memusage((const lzma_filter *)stream->filters);
+    }
+    else if (!stream->is_xz)
+    {
+        filters[0].id = LZMA_FILTER_LZMA1;
+        filters[0].options = (void *)&stream->opt_lzma;
+        filters[1].id = LZMA_VLI_UNKNOWN;
+        filters[1].options = NULL;
+        return lzma_raw_encoder_memusage(filters);
+    }
+    return lzma_easy_encoder_memusage(stream->preset);
+}
+
+/*
+** gets the statistics of the stream:
+** the amount of data in and out,
+** the memory usage and the time spent
+** by lzma_code compared with the
+** producer and consumer callbacks
+*/
+static int lua_xz_stream_stats(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_stream(L, 1);
+    lzma_stream *s = &stream->strm;
+    uint64_t progress_in = s->total_in;
+    uint64_t progress_out = s->total_out;
+    uint64_t compressed = stream->is_writer ? s->total_out : s->total_in;
+    uint64_t uncompressed = stream->is_writer ? s->total_in : s->total_out;
+
+    lua_createtable(L, 0, 11);
+
+    lua_pushinteger(L, (lua_Integer)s->total_in);
+    lua_setfield(L, -2, "total_in");
+
+    lua_pushinteger(L, (lua_Integer)s->total_out);
+    lua_setfield(L, -2, "total_out");
+
+    /* compressed size over uncompressed size */
+    lua_pushnumber(L, uncompressed == 0 ? (lua_Number)0 : (lua_Number)compressed / (lua_Number)uncompressed);
+    lua_setfield(L, -2, "ratio");
+
+    if (!stream->is_closed)
+    {
+        /*
+        ** on the multithreaded encoder / decoder,
+        ** the data held by the worker threads
+        ** is accounted by lzma_get_progress
+        */
+        lzma_get_progress(s, &progress_in, &progress_out);
+
+        lua_pushinteger(L, (lua_Integer)lua_xz_stream_memusage(stream));
+        lua_setfield(L, -2, "memusage");
+
+        if (!stream->is_writer && !stream->is_raw)
+        {
+            lua_pushinteger(L, (lua_Integer)(lzma_memlimit_get(s) == UINT64_MAX ? LUA_XZ_MEMLIMIT_UNLIMITED : (lua_Integer)lzma_memlimit_get(s)));
+            lua_setfield(L, -2, "memlimit");
+        }
+    }
+
+    lua_pushinteger(L, (lua_Integer)progress_in);
+    lua_setfield(L, -2, "progress_in");
+
+    lua_pushinteger(L, (lua_Integer)progress_out);
+    lua_setfield(L, -2, "progress_out");
+
+    lua_pushnumber(L, (lua_Number)stream->time_code);
+    lua_setfield(L, -2, "time_code");
+
+    lua_pushnumber(L, (lua_Number)stream->time_producer);
+    lua_setfield(L, -2, "time_producer");
+
+    lua_pushnumber(L, (lua_Number)stream->time_consumer);
+    lua_setfield(L, -2, "time_consumer");
+
+    return 1;
+}
+
+static int lua_xz_stream_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+
+static const luaL_Reg lua_xz_stream_functions[] = {
+    {"allocated", lua_xz_stream_allocated},
+    {"blocks", lua_xz_stream_blocks},
+    {"close", lua_xz_stream_close},
+    {"end_block", lua_xz_stream_endblock},
+    {"exec", lua_xz_stream_exec},
+    {"finish", lua_xz_stream_finish},
+    {"flush", lua_xz_stream_flush},
+    {"lzmareader", lua_xz_stream_lzmareader},
+    {"lzmawriter", lua_xz_stream_lzmawriter},
+    {"rawreader", lua_xz_stream_rawreader},
+    {"rawwriter", lua_xz_stream_rawwriter},
+    {"reset", lua_xz_stream_reset},
+    {"stats", lua_xz_stream_stats},
+    {"update", lua_xz_stream_update},
+    {"xzreader", lua_xz_stream_xzreader},
+    {"xzwriter", lua_xz_stream_xzwriter},
+    {"__gc", lua_xz_stream_close},
+    {NULL, NULL}
+};
+/* end of lua_xz_stream */
+
+/* start of lua_xz_async */
+#define LUA_XZ_ASYNC_METATABLE "lua_xz_async_metatable"
+
+/*
+** default number of chunks held
+** by each queue of an async handle
+*/
+#ifndef LUA_XZ_ASYNC_QUEUE_DEPTH
+#define LUA_XZ_ASYNC_QUEUE_DEPTH 4
+#endif
+
+typedef struct taglua_xz_async_chunk
+{
+    struct taglua_xz_async_chunk *next;
+
+    /* amount of valid bytes on data */
+    size_t size;
+
+    /*
+    ** note:
+    **   data member must be the last field,
+    **   just like the output_buffer
+    **   of lua_xz_aux_buffers
+    */
+    uint8_t data[1];
+} lua_xz_async_chunk;
+
+typedef struct taglua_xz_async_queue
+{
+    lua_xz_async_chunk *head;
+    lua_xz_async_chunk *tail;
+
+    /* chunks on the queue */
+    size_t count;
+
+    /* maximum amount of chunks on the queue */
+    size_t depth;
+} lua_xz_async_queue;
+
+typedef struct taglua_xz_async
+{
+    /*
+    ** the stream run by the worker,
+    ** anchored by a registry reference
+    */
+    lua_xz_stream *stream;
+    int stream_ref;
+
+    /* size of each chunk of output */
+    size_t buffer_size;
+
+    /*
+    ** the mutex guards the fields below.
+    ** The worker waits on `worker_cond' for
+    ** input or for room on the output queue,
+    ** while wait() sleeps on `owner_cond'
+    ** until there is output
+    */
+    lua_xz_mutex mutex;
+    lua_xz_cond worker_cond;
+    lua_xz_cond owner_cond;
+
+    /* data submitted, not taken by the worker yet */
+    lua_xz_async_queue input;
+
+    /* output of the worker, not handed back yet */
+    lua_xz_async_queue output;
+
+    /*
+    ** set by finish: the worker finishes
+    ** the stream once the input queue is empty
+    */
+    int finishing;
+
+    /* set when the worker must return right away */
+    int cancelled;
+
+    /* set while the worker waits for input */
+    int idle;
+
+    /* set when the worker returned */
+    int stopped;
+
+    /* set when the stream ended and all of its output was queued */
+    int ended;
+
+    /* error of lzma_code that stopped the worker, or LZMA_OK */
+    lzma_ret ret;
+
+    lua_xz_thread thread;
+
+    /* set until the thread is joined */
+    int running;
+
+    int is_closed;
+} lua_xz_async;
+
+static void lua_xz_async_push(lua_xz_async_queue *q, lua_xz_async_chunk *chunk)
+{
+    chunk->next = NULL;
+    if (q->tail == NULL)
+    {
+        q->head = chunk;
+    }
+    else
+    {
+        q->tail->next = chunk;
+    }
+    q->tail = chunk;
+    q->count++;
+}
+
+static lua_xz_async_chunk *lua_xz_async_pop(lua_xz_async_queue *q)
+{
+    lua_xz_async_chunk *chunk = q->head;
+    if (chunk != NULL)
+    {
+        q->head = chunk->next;
+        if (q->head == NULL)
+        {
+            q->tail = NULL;
+        }
+        q->count--;
+    }
+    return chunk;
+}
+
+static void lua_xz_async_clear(lua_xz_async_queue *q)
+{
+    lua_xz_async_chunk *chunk;
+    while ((chunk = lua_xz_async_pop(q)) != NULL)
+    {
+        free(chunk);
+    }
+}
+
+/*
+** the worker thread: feeds the submitted
+** chunks to the stream, and queues its
+** output in chunks of `buffer_size' bytes.
+** 
+** It never touches the lua_State.
+*/
+static LUA_XZ_THREAD_FUNCTION(lua_xz_async_worker)
+{
+    lua_xz_async *a = (lua_xz_async *)arg;
+    lua_xz_stream *stream = a->stream;
+    lzma_stream *s = &stream->strm;
+    lua_xz_async_chunk *input = NULL;
+    lua_xz_async_chunk *output = NULL;
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret = LZMA_OK;
+    int cancelled = 0;
+    double start;
+
+    s->next_in = NULL;
+    s->avail_in = 0;
+
+    while (!cancelled)
+    {
+        /* take the next input once the previous one was consumed */
+        if (s->avail_in == 0 && action == LZMA_RUN)
+        {
+            free(input);
+
+            lua_xz_mutex_lock(&a->mutex);
+            a->idle = 1;
+            lua_xz_cond_broadcast(&a->owner_cond);
+            while (a->input.head == NULL && !a->finishing && !a->cancelled)
+            {
+                lua_xz_cond_wait(&a->worker_cond, &a->mutex);
+            }
+            a->idle = 0;
+            cancelled = a->cancelled;
+            input = lua_xz_async_pop(&a->input);
+            lua_xz_mutex_unlock(&a->mutex);
+
+            if (input == NULL)
+            {
+                /* finish requested, or cancelled */
+                s->next_in = NULL;
+                s->avail_in = 0;
+                action = LZMA_FINISH;
+                continue;
+            }
+
+            s->next_in = input->data;
+            s->avail_in = input->size;
+        }
+
+        if (output == NULL)
+        {
+            output = (lua_xz_async_chunk *)malloc(sizeof(lua_xz_async_chunk) + a->buffer_size);
+            if (output == NULL)
+            {
+                ret = LZMA_MEM_ERROR;
+                break;
+            }
+            s->next_out = output->data;
+            s->avail_out = a->buffer_size;
+        }
+
+        start = lua_xz_aux_clock();
+        ret = lua_xz_stream_lzma_code(stream, action);
+        stream->time_code += lua_xz_aux_clock() - start;
+
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+        {
+            break;
+        }
+
+        /* output chunk is full or the stream ended */
+        if (s->avail_out == 0 || ret == LZMA_STREAM_END)
+        {
+            output->size = a->buffer_size - s->avail_out;
+
+            lua_xz_mutex_lock(&a->mutex);
+            while (a->output.count >= a->output.depth && !a->cancelled)
+            {
+                lua_xz_cond_wait(&a->worker_cond, &a->mutex);
+            }
+            cancelled = a->cancelled;
+            if (!cancelled)
+            {
+                if (output->size > 0)
+                {
+                    lua_xz_async_push(&a->output, output);
+                    output = NULL;
+                }
+                a->ended = ret == LZMA_STREAM_END;
+                lua_xz_cond_broadcast(&a->owner_cond);
+            }
+            lua_xz_mutex_unlock(&a->mutex);
+
+            if (ret == LZMA_STREAM_END)
+            {
+                break;
+            }
+        }
+    }
+
+    free(input);
+    free(output);
+
+    lua_xz_mutex_lock(&a->mutex);
+    if (!cancelled && ret != LZMA_OK && ret != LZMA_STREAM_END)
+    {
+        a->ret = ret;
+    }
+    a->stopped = 1;
+    lua_xz_cond_broadcast(&a->owner_cond);
+    lua_xz_mutex_unlock(&a->mutex);
+
+    return LUA_XZ_THREAD_RETURN;
+}
+
+/*
+** makes the worker return,
+** and joins its thread
+*/
+static void lua_xz_async_stop(lua_xz_async *a)
+{
+    if (a->running)
+    {
+        lua_xz_mutex_lock(&a->mutex);
+        a->cancelled = 1;
+        lua_xz_cond_broadcast(&a->worker_cond);
+        lua_xz_mutex_unlock(&a->mutex);
+
+        lua_xz_thread_join(a->thread);
+        a->running = 0;
+    }
+}
+
+static lua_xz_async *lua_xz_check_async(lua_State *L, int index)
+{
+    lua_xz_async *a = (lua_xz_async *)luaL_checkudata(L, index, LUA_XZ_ASYNC_METATABLE);
+    luaL_argcheck(L, !a->is_closed, index, "async handle cannot be used after it was closed");
+    luaL_argcheck(L, a->stream->async == a, index, "async handle cannot be used after its stream was closed");
+    return a;
+}
+
+/*
+** runs `stream' on a worker thread
+*/
+static int lua_xz_async_new(lua_State *L)
+{
+    lua_xz_stream *stream = lua_xz_check_active_stream(L, 1);
+    lua_Integer arg_input_queue;
+    lua_Integer arg_output_queue;
+    lua_Integer arg_buffer_size;
+    lua_xz_async *a;
+
+    luaL_argcheck(L, !stream->ended, 1, "lua_xz_stream cannot be used after its end");
+
+    /*
+    ** lua_Alloc is not thread-safe, while
+    ** the worker allocates through the stream
+    */
+    luaL_argcheck(L, stream->alloc.kind != LUA_XZ_ALLOC_LUA, 1, "streams with the allocator \"lua\" cannot run on a worker thread");
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+
+    arg_input_queue = lua_xz_aux_optinteger(L, 2, "input_queue", LUA_XZ_ASYNC_QUEUE_DEPTH);
+    luaL_argcheck(L, arg_input_queue > 0, 2, "input_queue must be a positive integer");
+
+    arg_output_queue = lua_xz_aux_optinteger(L, 2, "output_queue", LUA_XZ_ASYNC_QUEUE_DEPTH);
+    luaL_argcheck(L, arg_output_queue > 0, 2, "output_queue must be a positive integer");
+
+    arg_buffer_size = lua_xz_aux_optinteger(L, 2, "buffersize", LUA_XZ_BUFFER_SIZE);
+    luaL_argcheck(L, arg_buffer_size > 0, 2, "buffersize must be a positive integer");
+
+    a = (lua_xz_async *)lua_newuserdata(L, sizeof(lua_xz_async));
+    if (a == NULL)
+    {
+        return luaL_error(L, "Failed to create lua_xz_async userdata");
+    }
+
+    /* closed until the worker is running */
+    memset(a, 0, sizeof(lua_xz_async));
+    a->is_closed = 1;
+    a->stream_ref = LUA_NOREF;
+
+    luaL_getmetatable(L, LUA_XZ_ASYNC_METATABLE);
+    lua_setmetatable(L, -2);
+
+    a->stream = stream;
+    a->buffer_size = (size_t)arg_buffer_size;
+    a->input.depth = (size_t)arg_input_queue;
+    a->output.depth = (size_t)arg_output_queue;
+    a->ret = LZMA_OK;
+
+    lua_xz_mutex_init(&a->mutex);
+    lua_xz_cond_init(&a->worker_cond);
+    lua_xz_cond_init(&a->owner_cond);
+
+    /* the stream belongs to the handle from now on */
+    stream->executed = 1;
+    stream->async = a;
+
+    if (lua_xz_thread_create(&a->thread, lua_xz_async_worker, a) != 0)
+    {
+        stream->executed = 0;
+        stream->async = NULL;
+        lua_xz_cond_destroy(&a->owner_cond);
+        lua_xz_cond_destroy(&a->worker_cond);
+        lua_xz_mutex_destroy(&a->mutex);
+        return luaL_error(L, "Failed to create the worker thread");
+    }
+
+    a->running = 1;
+    a->is_closed = 0;
+
+    lua_pushvalue(L, 1);
+    a->stream_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return 1;
+}
+
+/*
+** queues a copy of `data' for the worker.
+** 
+** Returns false, without queueing
+** the data, when the input queue is full
+*/
+static int lua_xz_async_submit(lua_State *L)
+{
+    lua_xz_async *a = lua_xz_check_async(L, 1);
+    size_t data_size;
+    const char *data = luaL_checklstring(L, 2, &data_size);
+    lua_xz_async_chunk *chunk;
+    int finishing;
+    int stopped;
+    int full;
+    lzma_ret ret;
+
+    lua_xz_mutex_lock(&a->mutex);
+    finishing = a->finishing;
+    stopped = a->stopped;
+    full = a->input.count >= a->input.depth;
+    ret = a->ret;
+    lua_xz_mutex_unlock(&a->mutex);
+
+    if (finishing)
+    {
+        return luaL_error(L, "data cannot be submitted after finish");
+    }
+
+    if (ret != LZMA_OK)
+    {
+        return lua_xz_stream_error(L, a->stream, ret);
+    }
+
+    /* data after the end of the stream is ignored */
+    if (data_size == 0 || stopped)
+    {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    if (full)
+    {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    chunk = (lua_xz_async_chunk *)malloc(sizeof(lua_xz_async_chunk) + data_size);
+    if (chunk == NULL)
+    {
+        return luaL_error(L, "Failed to allocate memory for the submitted data");
+    }
+    chunk->size = data_size;
+    memcpy(chunk->data, data, data_size);
+
+    /* only submit pushes to the input queue, so it still has room */
+    lua_xz_mutex_lock(&a->mutex);
+    lua_xz_async_push(&a->input, chunk);
+    lua_xz_cond_signal(&a->worker_cond);
+    lua_xz_mutex_unlock(&a->mutex);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** signals that no more data will be submitted:
+** the worker finishes the stream once
+** the input queue is empty
+*/
+static int lua_xz_async_finish(lua_State *L)
+{
+    lua_xz_async *a = lua_xz_check_async(L, 1);
+
+    lua_xz_mutex_lock(&a->mutex);
+    a->finishing = 1;
+    lua_xz_cond_signal(&a->worker_cond);
+    lua_xz_mutex_unlock(&a->mutex);
+
+    return 0;
+}
+
+/*
+** hands back the output queued so far,
+** and whether the stream ended with
+** all of its output handed back
+*/
+static int lua_xz_async_collect(lua_State *L, lua_xz_async *a)
+{
+    lua_xz_async_queue output;
+    lua_xz_async_chunk *chunk;
+    luaL_Buffer B;
+    int ended;
+    lzma_ret ret;
+
+    lua_xz_mutex_lock(&a->mutex);
+    output = a->output;
+    a->output.head = NULL;
+    a->output.tail = NULL;
+    a->output.count = 0;
+    ended = a->ended;
+    ret = a->ret;
+
+    /* there is room on the output queue again */
+    lua_xz_cond_signal(&a->worker_cond);
+    lua_xz_mutex_unlock(&a->mutex);
+
+    if (ret != LZMA_OK)
+    {
+        lua_xz_async_clear(&output);
+        return lua_xz_stream_error(L, a->stream, ret);
+    }
+
+    luaL_buffinit(L, &B);
+    while ((chunk = lua_xz_async_pop(&output)) != NULL)
+    {
+        luaL_addlstring(&B, (const char *)chunk->data, chunk->size);
+        free(chunk);
+    }
+    luaL_pushresult(&B);
+
+    lua_pushboolean(L, ended);
+    return 2;
+}
+
+/*
+** returns the output queued so far,
+** without waiting
+*/
+static int lua_xz_async_poll(lua_State *L)
+{
+    lua_xz_async *a = lua_xz_check_async(L, 1);
+    return lua_xz_async_collect(L, a);
+}
+
+/*
+** waits for output, up to
+** `timeout' seconds when given
+*/
+static int lua_xz_async_wait(lua_State *L)
+{
+    lua_xz_async *a = lua_xz_check_async(L, 1);
+    lua_Number timeout = luaL_optnumber(L, 2, -1);
+    double deadline;
+    double remaining;
+
+    luaL_argcheck(L, lua_isnoneornil(L, 2) || timeout >= 0, 2, "timeout must be a number greater than or equal to 0");
+
+    deadline = lua_xz_aux_clock() + (double)timeout;
+
+    lua_xz_mutex_lock(&a->mutex);
+
+    /*
+    ** stop waiting when there is output, or when
+    ** no output will come until more data
+    ** is submitted (or finish is called)
+    */
+    while (a->output.head == NULL && !a->stopped && !(a->idle && a->input.head == NULL && !a->finishing))
+    {
+        if (timeout < 0)
+        {
+            lua_xz_cond_wait(&a->owner_cond, &a->mutex);
+        }
+        else
+        {
+            remaining = deadline - lua_xz_aux_clock();
+            if (remaining <= 0)
+            {
+                break;
+            }
+            lua_xz_cond_timedwait(&a->owner_cond, &a->mutex, remaining);
+        }
+    }
+
+    lua_xz_mutex_unlock(&a->mutex);
+
+    return lua_xz_async_collect(L, a);
+}
+
+/*
+** stops the worker, discarding the
+** queued data, and gives the stream back
+*/
+static int lua_xz_async_close(lua_State *L)
+{
+    lua_xz_async *a = (lua_xz_async *)luaL_checkudata(L, 1, LUA_XZ_ASYNC_METATABLE);
+    if (!a->is_closed)
+    {
+        lua_xz_async_stop(a);
+
+        lua_xz_async_clear(&a->input);
+        lua_xz_async_clear(&a->output);
+
+        lua_xz_cond_destroy(&a->owner_cond);
+        lua_xz_cond_destroy(&a->worker_cond);
+        lua_xz_mutex_destroy(&a->mutex);
+
+        /* the stream might have been closed first */
+        if (a->stream->async == a)
+        {
+            a->stream->async = NULL;
+        }
+
+        luaL_unref(L, LUA_REGISTRYINDEX, a->stream_ref);
+        a->stream_ref = LUA_NOREF;
+
+        /* prevent it from being called again */
+        a->is_closed = 1;
+    }
+    return 0;
+}
+
+static int lua_xz_async_newindex(lua_State *L)
+{
+    return luaL_error(L, "Read-only object");
+}
+
+static const luaL_Reg lua_xz_async_functions[] = {
+    {"close", lua_xz_async_close},
+    {"finish", lua_xz_async_finish},
+    {"poll", lua_xz_async_poll},
+    {"submit", lua_xz_async_submit},
+    {"wait", lua_xz_async_wait},
+    {"__gc", lua_xz_async_close},
+    {NULL, NULL}
+};
+/* end of lua_xz_async */
+
+/* start of lua_xz one-shot functions */
+
+/*
+** computes the total uncompressed size
+** of the (possibly concatenated) .xz streams
+** held by `in', reading only the stream footers
+** and the indexes from the end of the data.
+** 
+** Returns LZMA_OK on success, or the error
+** found while decoding the indexes.
+*/
+static lzma_ret lua_xz_aux_xz_uncompressed_size(const uint8_t *in, size_t in_size, uint64_t memlimit, uint64_t *uncompressed_size)
+{
+    lzma_stream_flags footer_flags;
+    lzma_index *index;
+    lzma_ret ret;
+    size_t pos = in_size;
+    size_t index_pos;
+    uint64_t index_memlimit;
+    lzma_vli stream_size;
+
+    *uncompressed_size = 0;
+
+    if (in_size == 0)
+    {
+        return LZMA_FORMAT_ERROR;
+    }
+
+    while (pos > 0)
+    {
+        /* skip stream padding */
+        while (pos >= 4 && in[pos - 1] == 0 && in[pos - 2] == 0 && in[pos - 3] == 0 && in[pos - 4] == 0)
+        {
+            pos -= 4;
+        }
+
+        if (pos < 2 * LZMA_STREAM_HEADER_SIZE)
+        {
+            return *uncompressed_size == 0 && pos == in_size ? LZMA_FORMAT_ERROR : LZMA_DATA_ERROR;
+        }
+
+        ret = lzma_stream_footer_decode(&footer_flags, in + pos - LZMA_STREAM_HEADER_SIZE);
+        if (ret != LZMA_OK)
+        {
+            return ret;
+        }
+
+        if (footer_flags.backward_size > pos - 2 * LZMA_STREAM_HEADER_SIZE)
+        {
+            return LZMA_DATA_ERROR;
+        }
+
+        index = NULL;
+        index_memlimit = memlimit;
+        index_pos = pos - LZMA_STREAM_HEADER_SIZE - (size_t)footer_flags.backward_size;
+        ret = lzma_index_buffer_decode(&index, &index_memlimit, NULL, in, &index_pos, pos - LZMA_STREAM_HEADER_SIZE);
+        if (ret != LZMA_OK)
+        {
+            return ret;
+        }
+
+        *uncompressed_size += lzma_index_uncompressed_size(index);
+        stream_size = lzma_index_stream_size(index);
+        lzma_index_end(index, NULL);
+
+        if (stream_size > pos)
+        {
+            return LZMA_DATA_ERROR;
+        }
+
+        pos -= (size_t)stream_size;
+    }
+
+    return LZMA_OK;
+}
+
+/*
+** compresses a string to
+** the .xz format at once
+*/
+static int lua_xz_compress(lua_State *L)
+{
+    size_t in_size;
+    const uint8_t *in = (const uint8_t *)luaL_checklstring(L, 1, &in_size);
+    uint32_t preset = lua_isnoneornil(L, 2) ? LZMA_PRESET_DEFAULT : lua_xz_aux_checkpreset(L, 2);
+    lzma_check check = (lzma_check)luaL_optinteger(L, 3, LZMA_CHECK_CRC64);
+    size_t out_size = lzma_stream_buffer_bound(in_size);
+    size_t out_pos = 0;
+    uint8_t *out;
+    lzma_ret ret;
+
+    if (out_size == 0)
+    {
+        return luaL_error(L, "Input is too large to be compressed at once");
+    }
+
+    out = (uint8_t *)lua_xz_aux_pushscratch(L, out_size);
+
+    ret = lzma_easy_buffer_encode(preset, check, NULL, in, in_size, out, &out_pos, out_size);
+
+    if (ret != LZMA_OK)
+    {
+        switch (ret)
+        {
+        case LZMA_MEM_ERROR:
+            return luaL_error(L, "Memory allocation failed");
+        case LZMA_OPTIONS_ERROR:
+            return luaL_error(L, "The given compression preset is not supported by this build of liblzma");
+        case LZMA_UNSUPPORTED_CHECK:
+            return luaL_error(L, "The given check type is not supported by this build of liblzma");
+        case LZMA_DATA_ERROR:
+            return luaL_error(L, "File size limits exceeded");
+        default:
+            return luaL_error(L, "Failed to compress the data");
+        }
+    }
+
+    lua_pushlstring(L, (const char *)out, out_pos);
+    return 1;
+}
+
+/*
+** decompresses a string from
+** the .xz format at once
+*/
+static int lua_xz_decompress(lua_State *L)
+{
+    size_t in_size;
+    const uint8_t *in = (const uint8_t *)luaL_checklstring(L, 1, &in_size);
+    uint64_t memlimit = lua_isnoneornil(L, 2) ? UINT64_MAX : lua_xz_aux_checkmemlimit(L, 2);
+    uint64_t uncompressed_size;
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    lua_xz_stream *stream;
+    luaL_Buffer B;
+    uint8_t *out;
+    lzma_ret ret;
+
+    /*
+    ** size the output exactly
+    ** through the indexes
+    */
+    ret = lua_xz_aux_xz_uncompressed_size(in, in_size, memlimit, &uncompressed_size);
+
+    if (ret == LZMA_OK && lua_xz_aux_trustsize(uncompressed_size, in_size, memlimit))
+    {
+        out = (uint8_t *)lua_xz_aux_pushscratch(L, (size_t)uncompressed_size);
+
+        ret = lzma_stream_buffer_decode(&memlimit, LZMA_CONCATENATED, NULL, in, &in_pos, in_size, out, &out_pos, (size_t)uncompressed_size);
+        if (ret == LZMA_OK)
+        {
+            lua_pushlstring(L, (const char *)out, out_pos);
+        }
+    }
+    else if (ret == LZMA_OK)
+    {
+        /* the indexes claim too much: let the output grow as it is decoded */
+        stream = lua_xz_stream_alloc(L, 1, 0);
+        ret = lzma_stream_decoder(&stream->strm, memlimit, LZMA_CONCATENATED);
+
+        if (ret == LZMA_OK)
+        {
+            stream->strm.next_in = in;
+            stream->strm.avail_in = in_size;
+
+            luaL_buffinit(L, &B);
+            ret = lua_xz_stream_code(stream, LZMA_FINISH, &B);
+            if (ret == LZMA_STREAM_END)
+            {
+                luaL_pushresult(&B);
+                ret = LZMA_OK;
+            }
+        }
+
+        /* free the decoder right away */
+        lzma_end(&stream->strm);
+        stream->is_closed = 1;
+    }
+
+    if (ret != LZMA_OK)
+    {
+        switch (ret)
+        {
+        case LZMA_MEM_ERROR:
+            return luaL_error(L, "Memory allocation failed");
+        case LZMA_MEMLIMIT_ERROR:
+            return luaL_error(L, "Memory usage limit was reached");
+        case LZMA_FORMAT_ERROR:
+            return luaL_error(L, "The input is not in the .xz format");
+        case LZMA_OPTIONS_ERROR:
+            return luaL_error(L, "Unsupported compression options");
+        case LZMA_DATA_ERROR:
+            return luaL_error(L, "Compressed data is corrupt");
+        case LZMA_BUF_ERROR:
+            return luaL_error(L, "Compressed data is truncated or otherwise corrupt");
+        default:
+            return luaL_error(L, "Failed to decompress the data");
+        }
+    }
+
+    return 1;
+}
+
+/*
+** compresses a string to
+** the .lzma format at once
+*/
+static int lua_xz_lzmacompress(lua_State *L)
+{
+    size_t in_size;
+    const uint8_t *in = (const uint8_t *)luaL_checklstring(L, 1, &in_size);
+    uint32_t preset = lua_isnoneornil(L, 2) ? LZMA_PRESET_DEFAULT : lua_xz_aux_checkpreset(L, 2);
+    lua_xz_stream *stream = lua_xz_stream_alloc(L, 0, 1);
+    luaL_Buffer B;
+    lzma_ret ret;
+
+    if (lzma_lzma_preset(&stream->opt_lzma, preset))
+    {
+        return luaL_error(L, "Unsupported preset");
+    }
+
+    ret = lzma_alone_encoder(&stream->strm, (const lzma_options_lzma *)&stream->opt_lzma);
+    if (ret != LZMA_OK)
+    {
+        switch (ret)
+        {
+        case LZMA_MEM_ERROR:
+            return luaL_error(L, "Memory allocation failed");
+        case LZMA_OPTIONS_ERROR:
+            return luaL_error(L, "The given compression preset is not supported by this build of liblzma");
+        default:
+            return luaL_error(L, "Failed to create lzma_alone_encoder");
+        }
+    }
+
+    stream->strm.next_in = in;
+    stream->strm.avail_in = in_size;
+
+    luaL_buffinit(L, &B);
+    ret = lua_xz_stream_code(stream, LZMA_FINISH, &B);
+    if (ret != LZMA_STREAM_END)
+    {
+        return lua_xz_stream_error(L, stream, ret);
+    }
+    luaL_pushresult(&B);
+
+    /* free the encoder right away */
+    lzma_end(&stream->strm);
+    stream->is_closed = 1;
+
+    return 1;
+}
+
+/*
+** decompresses a string from
+** the .lzma format at once
+*/
+static int lua_xz_lzmadecompress(lua_State *L)
+{
+    size_t in_size;
+    const uint8_t *in = (const uint8_t *)luaL_checklstring(L, 1, &in_size);
+    uint64_t memlimit = lua_isnoneornil(L, 2) ? UINT64_MAX : lua_xz_aux_checkmemlimit(L, 2);
+    lua_xz_stream *stream = lua_xz_stream_alloc(L, 0, 0);
+    uint64_t uncompressed_size = UINT64_MAX;
+    luaL_Buffer B;
+    uint8_t *out;
+    lzma_ret ret;
+    int i;
+
+    /*
+    ** the .lzma header stores
+    ** the uncompressed size as a
+    ** little-endian 64-bit integer
+    ** at offset 5, or UINT64_MAX
+    ** when it is unknown
+    */
+    if (in_size >= 13)
+    {
+        uncompressed_size = 0;
+        for (i = 12; i >= 5; i--)
+        {
+            uncompressed_size = (uncompressed_size << 8) | in[i];
+        }
+    }
+
+    ret = lzma_alone_decoder(&stream->strm, memlimit);
+    if (ret != LZMA_OK)
+    {
+        return luaL_error(L, ret == LZMA_MEM_ERROR ? "Memory allocation failed" : "Failed to create lzma_alone_decoder");
+    }
+
+    stream->strm.next_in = in;
+    stream->strm.avail_in = in_size;
+
+    if (uncompressed_size != UINT64_MAX && lua_xz_aux_trustsize(uncompressed_size, in_size, memlimit))
+    {
+        /* the size is known: decode straight into the scratch buffer */
+        out = (uint8_t *)lua_xz_aux_pushscratch(L, (size_t)uncompressed_size);
+        stream->strm.next_out = out;
+        stream->strm.avail_out = (size_t)uncompressed_size;
+
+        do
+        {
+            ret = lzma_code(&stream->strm, LZMA_FINISH);
+        } while (ret == LZMA_OK);
+
+        if (ret == LZMA_STREAM_END)
+        {
+            lua_pushlstring(L, (const char *)out, (size_t)uncompressed_size - stream->strm.avail_out);
+        }
+    }
+    else
+    {
+        luaL_buffinit(L, &B);
+        ret = lua_xz_stream_code(stream, LZMA_FINISH, &B);
+        if (ret == LZMA_STREAM_END)
+        {
+            luaL_pushresult(&B);
+        }
+    }
+
+    if (ret != LZMA_STREAM_END)
+    {
+        return lua_xz_stream_error(L, stream, ret);
+    }
+
+    /* free the decoder right away */
+    lzma_end(&stream->strm);
+    stream->is_closed = 1;
+
+    return 1;
+}
+/* end of lua_xz one-shot functions */
+
+/* start of lua_xz batch functions */
+typedef struct taglua_xz_batch_item
+{
+    /* input, anchored by the table of items */
+    const uint8_t *in;
+    size_t in_size;
+
+    /* output, allocated by the worker */
+    uint8_t *out;
+    size_t out_size;
+
+    /* LZMA_OK, or the error of the item */
+    lzma_ret ret;
+} lua_xz_batch_item;
+
+/*
+** userdata holding the items of a batch,
+** followed by its threads, whose __gc frees
+** the outputs not handed to Lua yet
+*/
+typedef struct taglua_xz_batch_items
+{
+    size_t count;
+
+    /*
+    ** note:
+    **   items member must be the last field,
+    **   just like the output_buffer of lua_xz_aux_buffers
+    */
+    lua_xz_batch_item items[1];
+} lua_xz_batch_items;
+
+#define LUA_XZ_BATCH_METATABLE "lua_xz_batch_metatable"
+
+static int lua_xz_batch_items_gc(lua_State *L)
+{
+    lua_xz_batch_items *b = (lua_xz_batch_items *)lua_touserdata(L, 1);
+    size_t i;
+
+    for (i = 0; i < b->count; i++)
+    {
+        free(b->items[i].out);
+        b->items[i].out = NULL;
+    }
+
+    return 0;
+}
+
+typedef struct taglua_xz_batch
+{
+    lua_xz_batch_item *items;
+    size_t count;
+
+    /* next item to be taken by a worker, guarded by the mutex */
+    size_t next;
+    lua_xz_mutex mutex;
+
+    int is_writer;
+    uint32_t preset;
+    lzma_check check;
+    uint64_t memlimit;
+
+    /* LZMA2 options of the preset */
+    lzma_options_lzma opt_lzma;
+} lua_xz_batch;
+
+/*
+** compresses / decompresses a single item
+** on `strm', which keeps the allocations
+** of the encoder / decoder of the previous
+** item of the same worker
+*/
+static void lua_xz_batch_code(lua_xz_batch *batch, lzma_stream *strm, lua_xz_batch_item *item)
+{
+    lzma_options_lzma opt_lzma;
+    lzma_filter filters[2];
+    uint64_t out_size = 0;
+    size_t out_pos;
+    uint8_t *out;
+    int grow = 0;
+    lzma_ret ret;
+
+    if (batch->is_writer)
+    {
+        /*
+        ** a dictionary larger than the item
+        ** does not improve the ratio, while
+        ** the match finder of a reused encoder
+        ** is cleared on every item: shrink it
+        ** to the power of 2 holding the item
+        */
+        opt_lzma = batch->opt_lzma;
+        while (opt_lzma.dict_size > LZMA_DICT_SIZE_MIN && opt_lzma.dict_size / 2 >= item->in_size)
+        {
+            opt_lzma.dict_size /= 2;
+        }
+
+        filters[0].id = LZMA_FILTER_LZMA2;
+        filters[0].options = &opt_lzma;
+        filters[1].id = LZMA_VLI_UNKNOWN;
+        filters[1].options = NULL;
+
+        out_size = lzma_stream_buffer_bound(item->in_size);
+        ret = out_size == 0 ? LZMA_DATA_ERROR : lzma_stream_encoder(strm, (const lzma_filter *)filters, batch->check);
+    }
+    else
+    {
+        /*
+        ** size the output exactly through the indexes,
+        ** unless they claim more than what is trusted:
+        ** then the output grows as it is decoded
+        */
+        ret = lua_xz_aux_xz_uncompressed_size(item->in, item->in_size, batch->memlimit, &out_size);
+        if (ret == LZMA_OK && !lua_xz_aux_trustsize(out_size, item->in_size, batch->memlimit))
+        {
+            out_size = LUA_XZ_SCRATCH_CACHE_SIZE;
+            grow = 1;
+        }
+
+        if (ret == LZMA_OK)
+        {
+            ret = lzma_stream_decoder(strm, batch->memlimit, LZMA_CONCATENATED);
+        }
+    }
+
+    if (ret == LZMA_OK)
+    {
+        item->out = (uint8_t *)malloc((size_t)out_size + 1);
+        if (item->out == NULL)
+        {
+            ret = LZMA_MEM_ERROR;
+        }
+    }
+
+    if (ret == LZMA_OK)
+    {
+        strm->next_in = item->in;
+        strm->avail_in = item->in_size;
+        strm->next_out = item->out;
+        strm->avail_out = (size_t)out_size;
+
+        do
+        {
+            ret = lzma_code(strm, LZMA_FINISH);
+
+            if (ret == LZMA_OK && grow && strm->avail_out == 0)
+            {
+                out_pos = (size_t)out_size;
+                out = out_size <= (uint64_t)(SIZE_MAX / 2 - 1) ? (uint8_t *)realloc(item->out, (size_t)out_size * 2 + 1) : NULL;
+                if (out == NULL)
+                {
+                    ret = LZMA_MEM_ERROR;
+                    break;
+                }
+
+                out_size *= 2;
+                item->out = out;
+                strm->next_out = out + out_pos;
+                strm->avail_out = (size_t)out_size - out_pos;
+            }
+        } while (ret == LZMA_OK);
+
+        if (ret == LZMA_STREAM_END)
+        {
+            item->out_size = (size_t)out_size - strm->avail_out;
+            ret = LZMA_OK;
+        }
+    }
+
+    if (ret != LZMA_OK)
+    {
+        free(item->out);
+        item->out = NULL;
+    }
+
+    item->ret = ret;
+}
+
+/*
+** a worker of the batch: takes the
+** next item until there is none left.
+** 
+** It never touches the lua_State.
+*/
+static LUA_XZ_THREAD_FUNCTION(lua_xz_batch_worker)
+{
+    lua_xz_batch *batch = (lua_xz_batch *)arg;
+    lzma_stream strm;
+    size_t index;
+
+    memset(&strm, 0, sizeof(lzma_stream));
+
+    while (1)
+    {
+        lua_xz_mutex_lock(&batch->mutex);
+        index = batch->next;
+        if (index < batch->count)
+        {
+            batch->next++;
+        }
+        lua_xz_mutex_unlock(&batch->mutex);
+
+        if (index >= batch->count)
+        {
+            break;
+        }
+
+        lua_xz_batch_code(batch, &strm, &batch->items[index]);
+    }
+
+    lzma_end(&strm);
+
+    return LUA_XZ_THREAD_RETURN;
+}
+
+/*
+** compresses / decompresses the array of
+** strings (or buffer views) at index 1 on
+** a pool of native threads, returning the
+** array of outputs, where failed items
+** hold false, and a table with the
+** error messages of the failed items
+*/
+static int lua_xz_batch_run(lua_State *L, lua_xz_batch *batch, int options)
+{
+    lua_xz_batch_items *b;
+    lua_xz_thread *threads;
+    lua_xz_buffer_view *view;
+    lua_xz_batch_item *item;
+    uint32_t threads_count;
+    uint32_t started = 0;
+    size_t i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!lua_isnoneornil(L, options))
+    {
+        luaL_checktype(L, options, LUA_TTABLE);
+    }
+
+    /* one thread per core by default */
+    threads_count = lua_xz_aux_optthreads(L, options);
+    if (threads_count == 0)
+    {
+        threads_count = lzma_cputhreads();
+    }
+
+    batch->count = lua_xz_aux_rawlen(L, 1);
+    batch->next = 0;
+
+    if (threads_count == 0)
+    {
+        threads_count = 1;
+    }
+    else if ((size_t)threads_count > batch->count)
+    {
+        threads_count = batch->count > 0 ? (uint32_t)batch->count : 1;
+    }
+
+    /*
+    ** the items and the threads are collected with
+    ** the userdata, which frees the outputs left
+    ** behind by an error while collecting them
+    */
+    b = (lua_xz_batch_items *)lua_newuserdata(L, sizeof(lua_xz_batch_items) + batch->count * sizeof(lua_xz_batch_item) + threads_count * sizeof(lua_xz_thread));
+    if (b == NULL)
+    {
+        return luaL_error(L, "Failed to allocate memory for the batch");
+    }
+    memset(b->items, 0, batch->count * sizeof(lua_xz_batch_item));
+    b->count = batch->count;
+    batch->items = b->items;
+    threads = (lua_xz_thread *)(batch->items + batch->count);
+
+    luaL_getmetatable(L, LUA_XZ_BATCH_METATABLE);
+    lua_setmetatable(L, -2);
+
+    for (i = 0; i < batch->count; i++)
+    {
+        item = &batch->items[i];
+        item->ret = LZMA_OK;
+
+        /*
+        ** the strings and the views stay
+        ** anchored by the table of items
+        ** while the workers read them
+        */
+        lua_rawgeti(L, 1, (int)(i + 1));
+        if (lua_type(L, -1) == LUA_TSTRING)
+        {
+            item->in = (const uint8_t *)lua_tolstring(L, -1, &item->in_size);
+        }
+        else if ((view = (lua_xz_buffer_view *)lua_xz_aux_testudata(L, -1, LUA_XZ_BUFFER_VIEW_METATABLE)) != NULL && view->is_valid)
+        {
+            item->in = view->data;
+            item->in_size = view->size;
+        }
+        else
+        {
+            return luaL_error(L, "item %d must be a string or a buffer view", (int)(i + 1));
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_xz_mutex_init(&batch->mutex);
+
+    /*
+    ** the calling thread is a worker as well.
+    ** When a thread cannot be created, the
+    ** batch runs on fewer threads
+    */
+    for (started = 0; started + 1 < threads_count; started++)
+    {
+        if (lua_xz_thread_create(&threads[started], lua_xz_batch_worker, batch) != 0)
+        {
+            break;
+        }
+    }
+
+    lua_xz_batch_worker(batch);
+
+    for (i = 0; i < (size_t)started; i++)
+    {
+        lua_xz_thread_join(threads[i]);
+    }
+
+    lua_xz_mutex_destroy(&batch->mutex);
+
+    /* collect the outputs */
+    lua_createtable(L, (int)batch->count, 0);
+    lua_newtable(L);
+
+    for (i = 0; i < batch->count; i++)
+    {
+        item = &batch->items[i];
+        if (item->ret == LZMA_OK)
+        {
+            lua_pushlstring(L, (const char *)item->out, item->out_size);
+            free(item->out);
+            item->out = NULL;
+        }
+        else
+        {
+            lua_pushboolean(L, 0);
+
+            lua_pushstring(L, lua_xz_stream_strerror(batch->is_writer, item->ret));
+            lua_rawseti(L, -3, (int)(i + 1));
+        }
+        lua_rawseti(L, -3, (int)(i + 1));
+    }
+
+    return 2;
+}
+
+/*
+** compresses an array of strings
+** to the .xz format at once
+*/
+static int lua_xz_compress_many(lua_State *L)
+{
+    lua_xz_batch batch;
+
+    batch.is_writer = 1;
+    batch.preset = lua_isnoneornil(L, 2) ? LZMA_PRESET_DEFAULT : lua_xz_aux_checkpreset(L, 2);
+    batch.check = (lzma_check)luaL_optinteger(L, 3, LZMA_CHECK_CRC64);
+    batch.memlimit = UINT64_MAX;
+
+    /* the workers report errors of the items only */
+    if (lzma_lzma_preset(&batch.opt_lzma, batch.preset))
+    {
+        return luaL_error(L, "The given compression preset is not supported by this build of liblzma");
+    }
+
+    if (!lzma_check_is_supported(batch.check))
+    {
+        return luaL_error(L, "The given check type is not supported by this build of liblzma");
+    }
+
+    return lua_xz_batch_run(L, &batch, 4);
+}
+
+/*
+** decompresses an array of strings
+** from the .xz format at once
+*/
+static int lua_xz_decompress_many(lua_State *L)
+{
+    lua_xz_batch batch;
+
+    batch.is_writer = 0;
+    batch.preset = LZMA_PRESET_DEFAULT;
+    batch.check = LZMA_CHECK_NONE;
+    batch.memlimit = lua_isnoneornil(L, 2) ? UINT64_MAX : lua_xz_aux_checkmemlimit(L, 2);
+
+    return lua_xz_batch_run(L, &batch, 3);
+}
+/* end of lua_xz batch functions */
+
+/* start of lua_xz file functions */
+
+/*
+** default size of each of the
+** input and output buffers used by
+** `compress_file' and `decompress_file'
+*/
+#ifndef LUA_XZ_FILE_BUFFER_SIZE
+#define LUA_XZ_FILE_BUFFER_SIZE (1024 * 1024)
+#endif
+
+/*
+** alignment of the buffers used by
+** `compress_file' and `decompress_file'
+** (a page on most platforms)
+*/
+#ifndef LUA_XZ_FILE_BUFFER_ALIGNMENT
+#define LUA_XZ_FILE_BUFFER_ALIGNMENT 4096
+#endif
+
+/*
+** a read-only view
+** of a whole input file
+*/
+typedef struct taglua_xz_file_map
+{
+    const uint8_t *data;
+    size_t size;
+#if defined(_WIN32)
+    HANDLE handle;
+#endif
+} lua_xz_file_map;
+
+/*
+** maps the whole file `f' for reading.
+** 
+** Returns 0 when the file cannot be mapped
+** (empty files, pipes, files that do not fit
+** the address space or platforms without
+** memory mapped files), so that the caller
+** falls back to fread.
+*/
+static int lua_xz_file_map_open(lua_xz_file_map *map, FILE *f)
+{
+#if defined(_WIN32)
+    HANDLE file = (HANDLE)_get_osfhandle(_fileno(f));
+    LARGE_INTEGER file_size;
+    void *view;
+
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size) || file_size.QuadPart <= 0 || (unsigned long long)file_size.QuadPart > (unsigned long long)SIZE_MAX)
+    {
+        return 0;
+    }
+
+    map->handle = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map->handle == NULL)
+    {
+        return 0;
+    }
+
+    view = MapViewOfFile(map->handle, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL)
+    {
+        CloseHandle(map->handle);
+        return 0;
+    }
+
+    map->data = (const uint8_t *)view;
+    map->size = (size_t)file_size.QuadPart;
+    return 1;
+#elif defined(LUA_XZ_HAS_MMAP)
+    struct stat st;
+    void *view;
+    int fd = fileno(f);
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || (unsigned long long)st.st_size > (unsigned long long)SIZE_MAX)
+    {
+        return 0;
+    }
+
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED)
+    {
+        return 0;
+    }
+
+#ifdef POSIX_MADV_SEQUENTIAL
+    posix_madvise(view, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+    map->data = (const uint8_t *)view;
+    map->size = (size_t)st.st_size;
+    return 1;
+#else
+    (void)map;
+    (void)f;
+    return 0;
+#endif
+}
+
+static void lua_xz_file_map_close(lua_xz_file_map *map)
+{
+#if defined(_WIN32)
+    UnmapViewOfFile((LPCVOID)map->data);
+    CloseHandle(map->handle);
+#elif defined(LUA_XZ_HAS_MMAP)
+    munmap((void *)map->data, map->size);
+#endif
+    map->data = NULL;
+    map->size = 0;
+}
+
+/*
+** moves the position of `f' to
+** the 64-bit offset `offset'.
+** 
+** Returns 0 on success.
+*/
+static int lua_xz_aux_fseek64(FILE *f, uint64_t offset)
+{
+#if defined(_WIN32)
+    return offset > (UINT64_MAX >> 1) ? -1 : _fseeki64(f, (__int64)offset, SEEK_SET);
+#elif defined(LUA_XZ_HAS_FSEEKO)
+    off_t o = (off_t)offset;
+    return (o < 0 || (uint64_t)o != offset) ? -1 : fseeko(f, o, SEEK_SET);
+#else
+    return offset > (uint64_t)LONG_MAX ? -1 : fseek(f, (long)offset, SEEK_SET);
+#endif
+}
+
+/*
+** returns the size of the file `f',
+** or UINT64_MAX when it cannot be
+** determined (e.g.: pipes)
+*/
+static uint64_t lua_xz_aux_fsize64(FILE *f)
+{
+#if defined(_WIN32)
+    __int64 size;
+    if (_fseeki64(f, 0, SEEK_END) != 0 || (size = _ftelli64(f)) < 0)
+    {
+        return UINT64_MAX;
+    }
+#elif defined(LUA_XZ_HAS_FSEEKO)
+    off_t size;
+    if (fseeko(f, 0, SEEK_END) != 0 || (size = ftello(f)) < 0)
+    {
+        return UINT64_MAX;
+    }
+#else
+    long size;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+    {
+        return UINT64_MAX;
+    }
+#endif
+    return (uint64_t)size;
+}
+
+/*
+** runs the already initialized `stream'
+** from the file `in' (or from the mapped
+** `map', when its data is not NULL)
+** into the file `out', without calling Lua.
+** When `out' is NULL, the output is
+** discarded, reusing `output_buffer'.
+** 
+** Returns NULL on success, or
+** the error message otherwise.
+*/
+static const char *lua_xz_file_code(lua_xz_stream *stream, FILE *in, const lua_xz_file_map *map, FILE *out, uint8_t *input_buffer, uint8_t *output_buffer, size_t buffer_size)
+{
+    lzma_stream *s = &stream->strm;
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret;
+    size_t read_size;
+    size_t write_size;
+
+    s->next_in = NULL;
+    s->avail_in = 0;
+    s->next_out = output_buffer;
+    s->avail_out = buffer_size;
+
+    if (map->data != NULL)
+    {
+        s->next_in = map->data;
+        s->avail_in = map->size;
+        action = LZMA_FINISH;
+    }
+
+    while (1)
+    {
+        if (s->avail_in == 0 && action == LZMA_RUN)
+        {
+            read_size = fread(input_buffer, 1, buffer_size, in);
+            if (ferror(in))
+            {
+                return "Failed to read the input file";
+            }
+
+            s->next_in = input_buffer;
+            s->avail_in = read_size;
+
+            if (feof(in))
+            {
+                action = LZMA_FINISH;
+            }
+        }
+
+        ret = lua_xz_stream_lzma_code(stream, action);
+
+        if (s->avail_out == 0 || ret == LZMA_STREAM_END)
+        {
+            write_size = buffer_size - s->avail_out;
+            if (write_size > 0 && out != NULL && fwrite(output_buffer, 1, write_size, out) != write_size)
+            {
+                return "Failed to write the output file";
+            }
+
+            s->next_out = output_buffer;
+            s->avail_out = buffer_size;
+        }
+
+        if (ret == LZMA_STREAM_END)
+        {
+            return NULL;
+        }
+
+        if (ret != LZMA_OK)
+        {
+            return lua_xz_stream_strerror(stream->is_writer, ret);
+        }
+    }
+}
+
+/*
+** shared implementation of
+** `compress_file' and `decompress_file'.
+** 
+** Expects the initialized stream
+** on the top of the stack.
+*/
+static int lua_xz_file_exec(lua_State *L, lua_xz_stream *stream)
+{
+    const char *src = luaL_checkstring(L, 1);
+    const char *dst = luaL_checkstring(L, 2);
+    lua_Integer arg_buffer_size = lua_xz_aux_optinteger(L, 3, "buffersize", LUA_XZ_FILE_BUFFER_SIZE);
+    int use_mmap;
+    size_t buffer_size;
+    uint8_t *buffers;
+    FILE *in;
+    FILE *out;
+    lua_xz_file_map map;
+    const char *err;
+    double start;
+    double elapsed;
+
+    luaL_argcheck(L, arg_buffer_size > 0 && (uint64_t)arg_buffer_size <= (SIZE_MAX - LUA_XZ_FILE_BUFFER_ALIGNMENT) / 2, 3, "buffersize must be an integer greater than 0");
+    buffer_size = (size_t)arg_buffer_size;
+
+    lua_xz_aux_getoption(L, 3, "mmap");
+    use_mmap = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    luaL_argcheck(L, strcmp(src, dst) != 0, 2, "the output file must differ from the input file");
+
+    /*
+    ** allocate the input and output buffers
+    ** at once, aligning them on
+    ** LUA_XZ_FILE_BUFFER_ALIGNMENT bytes
+    */
+    buffers = (uint8_t *)lua_newuserdata(L, 2 * buffer_size + LUA_XZ_FILE_BUFFER_ALIGNMENT - 1);
+    if (buffers == NULL)
+    {
+        return luaL_error(L, "Failed to allocate memory for the file buffers");
+    }
+    buffers += (LUA_XZ_FILE_BUFFER_ALIGNMENT - ((size_t)buffers % LUA_XZ_FILE_BUFFER_ALIGNMENT)) % LUA_XZ_FILE_BUFFER_ALIGNMENT;
+
+    in = fopen(src, "rb");
+    if (in == NULL)
+    {
+        return luaL_error(L, "Failed to open %s for reading", src);
+    }
+
+    out = fopen(dst, "wb");
+    if (out == NULL)
+    {
+        fclose(in);
+        return luaL_error(L, "Failed to open %s for writing", dst);
+    }
+
+    map.data = NULL;
+    map.size = 0;
+    if (use_mmap)
+    {
+        lua_xz_file_map_open(&map, in);
+    }
+
+    start = lua_xz_aux_clock();
+    err = lua_xz_file_code(stream, in, &map, out, buffers, buffers + buffer_size, buffer_size);
+    elapsed = lua_xz_aux_clock() - start;
+
+    if (map.data != NULL)
+    {
+        lua_xz_file_map_close(&map);
+    }
+
+    fclose(in);
+    if (fclose(out) != 0 && err == NULL)
+    {
+        err = "Failed to write the output file";
+    }
+
+    /* free the encoder / decoder right away */
+    lzma_end(&stream->strm);
+    stream->is_closed = 1;
+
+    if (err != NULL)
+    {
+        /* do not leave a partial output behind */
+        remove(dst);
+        return luaL_error(L, "%s", err);
+    }
+
+    lua_pushinteger(L, (lua_Integer)stream->strm.total_in);
+    lua_pushinteger(L, (lua_Integer)stream->strm.total_out);
+    lua_pushnumber(L, (lua_Number)elapsed);
+    return 3;
+}
+
+/*
+** returns whether the field `format'
+** of the options table at `index'
+** selects the .xz format (the default)
+** instead of the .lzma format
+*/
+static int lua_xz_file_optformat(lua_State *L, int index)
+{
+    int is_xz = 1;
+    const char *format;
+
+    if (lua_xz_aux_getoption(L, index, "format") != LUA_TNIL)
+    {
+        format = lua_tostring(L, -1);
+        if (format != NULL && strcmp(format, "lzma") == 0)
+        {
+            is_xz = 0;
+        }
+        else if (format == NULL || strcmp(format, "xz") != 0)
+        {
+            lua_pop(L, 1);
+            return luaL_error(L, "option format must be \"xz\" or \"lzma\"");
+        }
+    }
+
+    lua_pop(L, 1);
+    return is_xz;
+}
+
+/*
+** compresses the file `src'
+** into the file `dst'
+*/
+static int lua_xz_compress_file(lua_State *L)
+{
+    uint32_t preset = LZMA_PRESET_DEFAULT;
+    lzma_check check;
+    lua_xz_stream *stream;
+    int is_xz;
+
+    luaL_checkstring(L, 1);
+    luaL_checkstring(L, 2);
+    if (!lua_isnoneornil(L, 3))
+    {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    lua_settop(L, 3);
+
+    is_xz = lua_xz_file_optformat(L, 3);
+
+    if (lua_xz_aux_getoption(L, 3, "preset") != LUA_TNIL)
+    {
+        preset = lua_xz_aux_checkpreset(L, lua_gettop(L));
+    }
+    lua_pop(L, 1);
+
+    check = (lzma_check)lua_xz_aux_optinteger(L, 3, "check", LZMA_CHECK_CRC64);
+
+    stream = lua_xz_stream_alloc(L, is_xz, 1);
+    lua_xz_stream_init_writer(L, stream, preset, check, 3);
+
+    return lua_xz_file_exec(L, stream);
+}
+
+/*
+** decompresses the file `src'
+** into the file `dst'
+*/
+static int lua_xz_decompress_file(lua_State *L)
+{
+    uint64_t memlimit;
+    uint32_t flags;
+    lua_xz_stream *stream;
+    int is_xz;
+
+    luaL_checkstring(L, 1);
+    luaL_checkstring(L, 2);
+    if (!lua_isnoneornil(L, 3))
+    {
+        luaL_checktype(L, 3, LUA_TTABLE);
+    }
+    lua_settop(L, 3);
+
+    is_xz = lua_xz_file_optformat(L, 3);
+    memlimit = lua_xz_aux_optmemlimit(L, 3, "memlimit", UINT64_MAX);
+    flags = (uint32_t)lua_xz_aux_optinteger(L, 3, "flags", LZMA_CONCATENATED);
+
+    stream = lua_xz_stream_alloc(L, is_xz, 0);
+    lua_xz_stream_init_reader(L, stream, memlimit, flags, 3);
+
+    return lua_xz_file_exec(L, stream);
+}
+/* end of lua_xz file functions */
+
+/* start of lua_xz test functions */
+
+/*
+** summary of the (possibly concatenated)
+** .xz streams checked by `test' and `test_file'
+*/
+typedef struct taglua_xz_test_summary
+{
+    uint64_t streams;
+    uint64_t blocks;
+
+    /* bitmask of the check types (1 << check) */
+    uint32_t checks;
+} lua_xz_test_summary;
+
+/*
+** reads `size' bytes of the compressed
+** data at `offset' into `buffer'.
+**
+** Returns 0 on success.
+*/
+typedef int (*lua_xz_test_read_at)(void *ud, uint64_t offset, uint8_t *buffer, size_t size);
+
+static int lua_xz_test_read_map(void *ud, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    const lua_xz_file_map *map = (const lua_xz_file_map *)ud;
+
+    if (offset > (uint64_t)map->size || (uint64_t)size > (uint64_t)map->size - offset)
+    {
+        return -1;
+    }
+
+    memcpy(buffer, map->data + (size_t)offset, size);
+    return 0;
+}
+
+static int lua_xz_test_read_file(void *ud, uint64_t offset, uint8_t *buffer, size_t size)
+{
+    FILE *f = (FILE *)ud;
+
+    if (lua_xz_aux_fseek64(f, offset) != 0 || fread(buffer, 1, size, f) != size)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+** counts the streams and the blocks of
+** the `size' bytes of compressed data,
+** reading only the stream footers and the
+** indexes from the end of the data (see
+** lua_xz_aux_xz_uncompressed_size), through
+** `read_at' and the scratch `buffer'.
+**
+** Returns LZMA_OK on success, or the error
+** found while decoding the indexes.
+*/
+static lzma_ret lua_xz_test_scan(lua_xz_test_read_at read_at, void *ud, uint64_t size, uint64_t memlimit, uint8_t *buffer, size_t buffer_size, lua_xz_test_summary *summary)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_stream_flags footer_flags;
+    lzma_index *index;
+    lzma_ret ret;
+    uint64_t pos = size;
+    uint64_t index_pos;
+    uint64_t index_end;
+    lzma_vli stream_size;
+    size_t chunk;
+
+    summary->streams = 0;
+    summary->blocks = 0;
+    summary->checks = 0;
+
+    while (pos > 0)
+    {
+        /* skip stream padding */
+        while (pos >= 4)
+        {
+            if (read_at(ud, pos - 4, buffer, 4) != 0)
+            {
+                return LZMA_BUF_ERROR;
+            }
+
+            if (buffer[0] != 0 || buffer[1] != 0 || buffer[2] != 0 || buffer[3] != 0)
+            {
+                break;
+            }
+            pos -= 4;
+        }
+
+        if (pos < 2 * LZMA_STREAM_HEADER_SIZE)
+        {
+            return LZMA_DATA_ERROR;
+        }
+
+        if (read_at(ud, pos - LZMA_STREAM_HEADER_SIZE, buffer, LZMA_STREAM_HEADER_SIZE) != 0)
+        {
+            return LZMA_BUF_ERROR;
+        }
+
+        ret = lzma_stream_footer_decode(&footer_flags, buffer);
+        if (ret != LZMA_OK)
+        {
+            return ret;
+        }
+
+        if (footer_flags.backward_size > pos - 2 * LZMA_STREAM_HEADER_SIZE)
+        {
+            return LZMA_DATA_ERROR;
+        }
+
+        /* the index is decoded in chunks of the scratch buffer */
+        index = NULL;
+        ret = lzma_index_decoder(&strm, &index, memlimit);
+        index_end = pos - LZMA_STREAM_HEADER_SIZE;
+        index_pos = index_end - footer_flags.backward_size;
+
+        while (ret == LZMA_OK)
+        {
+            chunk = index_end - index_pos < (uint64_t)buffer_size ? (size_t)(index_end - index_pos) : buffer_size;
+            if (read_at(ud, index_pos, buffer, chunk) != 0)
+            {
+                ret = LZMA_BUF_ERROR;
+                break;
             }
+            index_pos += chunk;
+
+            strm.next_in = buffer;
+            strm.avail_in = chunk;
+            ret = lzma_code(&strm, index_pos == index_end ? LZMA_FINISH : LZMA_RUN);
+        }
+        lzma_end(&strm);
+
+        if (ret != LZMA_STREAM_END)
+        {
+            return ret == LZMA_OK ? LZMA_DATA_ERROR : ret;
+        }
+
+        /* the check type is known to the index through the footer */
+        ret = lzma_index_stream_flags(index, &footer_flags);
+        if (ret == LZMA_OK)
+        {
+            summary->streams++;
+            summary->blocks += lzma_index_block_count(index);
+            summary->checks |= lzma_index_checks(index);
+        }
+        stream_size = lzma_index_stream_size(index);
+        lzma_index_end(index, NULL);
+
+        if (ret != LZMA_OK)
+        {
+            return ret;
+        }
+
+        if (stream_size > pos)
+        {
+            return LZMA_DATA_ERROR;
+        }
+
+        pos -= stream_size;
+    }
+
+    return LZMA_OK;
+}
+
+/*
+** pushes the result table of
+** `test' and `test_file'
+*/
+static void lua_xz_test_pushresult(lua_State *L, lua_xz_stream *stream, const lua_xz_test_summary *summary, double elapsed)
+{
+    int check;
+
+    lua_createtable(L, 0, 6);
+
+    lua_pushinteger(L, (lua_Integer)stream->strm.total_out);
+    lua_setfield(L, -2, "uncompressed_size");
+
+    lua_pushinteger(L, (lua_Integer)stream->strm.total_in);
+    lua_setfield(L, -2, "compressed_size");
+
+    if (summary != NULL)
+    {
+        lua_pushinteger(L, (lua_Integer)summary->streams);
+        lua_setfield(L, -2, "streams");
+
+        lua_pushinteger(L, (lua_Integer)summary->blocks);
+        lua_setfield(L, -2, "blocks");
+
+        /* the strongest check, when the streams differ */
+        for (check = LZMA_CHECK_ID_MAX; check > 0 && (summary->checks & (1U << check)) == 0; check--)
+        {
+        }
+        lua_pushinteger(L, (lua_Integer)check);
+        lua_setfield(L, -2, "check");
+    }
+
+    lua_pushnumber(L, (lua_Number)elapsed);
+    lua_setfield(L, -2, "time");
+}
+
+/*
+** creates the decoder of `test'
+** and `test_file', with the options
+** table at `options'
+*/
+static lua_xz_stream *lua_xz_test_new_stream(lua_State *L, int options)
+{
+    lua_xz_stream *stream;
+    uint64_t memlimit = lua_xz_aux_optmemlimit(L, options, "memlimit", UINT64_MAX);
+
+    stream = lua_xz_stream_alloc(L, 1, 0);
+
+    /*
+    ** a check unknown to this build of
+    ** liblzma cannot be verified, so it
+    ** is reported as an error instead
+    ** of being skipped
+    */
+    lua_xz_stream_init_reader(L, stream, memlimit, LZMA_CONCATENATED | LZMA_TELL_UNSUPPORTED_CHECK, options);
+
+    return stream;
+}
+
+/*
+** decodes a .xz string, discarding
+** the output, to verify its integrity
+*/
+static int lua_xz_test(lua_State *L)
+{
+    lua_xz_file_map map;
+    lua_xz_stream *stream;
+    lua_xz_test_summary summary;
+    uint8_t *buffer;
+    const char *err;
+    lzma_ret ret;
+    double start;
+    double elapsed;
+
+    map.data = (const uint8_t *)luaL_checklstring(L, 1, &map.size);
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+    lua_settop(L, 2);
+
+    stream = lua_xz_test_new_stream(L, 2);
+    buffer = (uint8_t *)lua_xz_aux_pushscratch(L, LUA_XZ_BUFFER_SIZE);
+
+    /* the whole string is the input */
+    start = lua_xz_aux_clock();
+    err = lua_xz_file_code(stream, NULL, &map, NULL, NULL, buffer, LUA_XZ_BUFFER_SIZE);
+    elapsed = lua_xz_aux_clock() - start;
+
+    lzma_end(&stream->strm);
+    stream->is_closed = 1;
+
+    if (err != NULL)
+    {
+        return luaL_error(L, "%s", err);
+    }
+
+    ret = lua_xz_test_scan(lua_xz_test_read_map, (void *)&map, (uint64_t)map.size, stream->memlimit, buffer, LUA_XZ_BUFFER_SIZE, &summary);
+    if (ret != LZMA_OK)
+    {
+        return lua_xz_stream_error(L, stream, ret);
+    }
+
+    lua_xz_test_pushresult(L, stream, &summary, elapsed);
+    return 1;
+}
+
+/*
+** decodes a .xz file, discarding
+** the output, to verify its integrity
+*/
+static int lua_xz_test_file(lua_State *L)
+{
+    const char *src = luaL_checkstring(L, 1);
+    lua_Integer arg_buffer_size;
+    size_t buffer_size;
+    int use_mmap;
+    lua_xz_stream *stream;
+    lua_xz_test_summary summary;
+    lua_xz_file_map map;
+    uint64_t size = UINT64_MAX;
+    uint8_t *buffers;
+    FILE *in;
+    const char *err;
+    lzma_ret ret = LZMA_OK;
+    double start;
+    double elapsed;
+
+    if (!lua_isnoneornil(L, 2))
+    {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+    lua_settop(L, 2);
+
+    arg_buffer_size = lua_xz_aux_optinteger(L, 2, "buffersize", LUA_XZ_FILE_BUFFER_SIZE);
+    luaL_argcheck(L, arg_buffer_size > 0 && (uint64_t)arg_buffer_size <= SIZE_MAX / 2, 2, "buffersize must be an integer greater than 0");
+    buffer_size = (size_t)arg_buffer_size;
+
+    lua_xz_aux_getoption(L, 2, "mmap");
+    use_mmap = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    stream = lua_xz_test_new_stream(L, 2);
+    buffers = (uint8_t *)lua_xz_aux_pushscratch(L, 2 * buffer_size);
+
+    in = fopen(src, "rb");
+    if (in == NULL)
+    {
+        return luaL_error(L, "Failed to open %s for reading", src);
+    }
+
+    map.data = NULL;
+    map.size = 0;
+    if (use_mmap)
+    {
+        lua_xz_file_map_open(&map, in);
+    }
+
+    start = lua_xz_aux_clock();
+    err = lua_xz_file_code(stream, in, &map, NULL, buffers, buffers + buffer_size, buffer_size);
+    elapsed = lua_xz_aux_clock() - start;
+
+    lzma_end(&stream->strm);
+    stream->is_closed = 1;
+
+    /*
+    ** once the data is verified, the
+    ** indexes are read again from the
+    ** end of the file, unless it cannot
+    ** seek (e.g.: pipes)
+    */
+    if (err == NULL)
+    {
+        if (map.data != NULL)
+        {
+            ret = lua_xz_test_scan(lua_xz_test_read_map, (void *)&map, (uint64_t)map.size, stream->memlimit, buffers, buffer_size, &summary);
+        }
+        else if ((size = lua_xz_aux_fsize64(in)) != UINT64_MAX)
+        {
+            ret = lua_xz_test_scan(lua_xz_test_read_file, (void *)in, size, stream->memlimit, buffers, buffer_size, &summary);
+        }
+
+        if (ret != LZMA_OK)
+        {
+            err = lua_xz_stream_strerror(0, ret);
+        }
+    }
+
+    if (map.data != NULL)
+    {
+        size = map.size;
+        lua_xz_file_map_close(&map);
+    }
+    fclose(in);
+
+    if (err != NULL)
+    {
+        return luaL_error(L, "%s", err);
+    }
+
+    lua_xz_test_pushresult(L, stream, size != UINT64_MAX ? &summary : NULL, elapsed);
+    return 1;
+}
+/* end of lua_xz test functions */
+
+/* start of lua_xz_seekable */
+
+/*
+** the seekable reader parses the
+** indexes with lzma_file_info_decoder,
+** which is available since liblzma 5.4
+*/
+#if LZMA_VERSION >= 50040002
+#define LUA_XZ_HAS_SEEKABLE
+#endif
+
+/*
+** default size of each of the
+** input and output buffers
+** of a seekable reader
+*/
+#ifndef LUA_XZ_SEEKABLE_BUFFER_SIZE
+#define LUA_XZ_SEEKABLE_BUFFER_SIZE (64 * 1024)
+#endif
+
+#define LUA_XZ_SEEKABLE_METATABLE "lua_xz_seekable_metatable"
+
+#ifdef LUA_XZ_HAS_SEEKABLE
+
+/* the compressed data is read from a file opened by path */
+#define LUA_XZ_SEEKABLE_PATH 0
+
+/* the compressed data is read from a Lua file handle */
+#define LUA_XZ_SEEKABLE_FILE 1
+
+/* the compressed data is read by a read-at function */
+#define LUA_XZ_SEEKABLE_READ_AT 2
+
+typedef struct taglua_xz_seekable
+{
+    /*
+    ** decoder of the indexes and,
+    ** afterwards, of the blocks
+    */
+    lzma_stream strm;
+
+    /* indexes of all the streams */
+    lzma_index *index;
+
+    /* memory usage limit of the decoders */
+    uint64_t memlimit;
+
+    /* one of LUA_XZ_SEEKABLE_PATH, LUA_XZ_SEEKABLE_FILE, LUA_XZ_SEEKABLE_READ_AT */
+    int source;
+
+    /* file opened from a path, owned by the reader */
+    FILE *file;
+
+    /* registry reference to the file handle or to the read-at function */
+    int source_ref;
+
+    /* size of the compressed data */
+    uint64_t compressed_size;
+
+    /* size of the uncompressed data */
+    uint64_t uncompressed_size;
+
+    int is_closed;
+
+    /*
+    ** set while the read-at function
+    ** is running, which must not close
+    ** or read the reader it feeds
+    */
+    int is_busy;
+
+    /* set while strm holds the decoder of a block */
+    int block_active;
+
+    /*
+    ** header of the current block, which
+    ** the block decoder keeps a pointer to,
+    ** writing the sizes and the check
+    ** once the block ends
+    */
+    lzma_block block;
+
+    /* uncompressed offset right after the current block */
+    uint64_t block_end;
+
+    /* compressed offset of the next input of the current block */
+    uint64_t input_position;
+
+    /* compressed offset right after the current block */
+    uint64_t input_end;
+
+    /* uncompressed offset of output_buffer[0] */
+    uint64_t output_position;
+
+    /* amount of valid bytes on output_buffer */
+    size_t output_size;
+
+    /* size of each of the input and output buffers */
+    size_t buffer_size;
+
+    /* input buffer, lying right after the output buffer */
+    uint8_t *input_buffer;
+
+    /*
+    ** note:
+    **   output_buffer member must be the last field,
+    **   just like the one of lua_xz_aux_buffers
+    */
+    uint8_t output_buffer[1];
+} lua_xz_seekable;
+
+static lua_xz_seekable *lua_xz_check_seekable(lua_State *L, int index)
+{
+    lua_xz_seekable *s = (lua_xz_seekable *)luaL_checkudata(L, index, LUA_XZ_SEEKABLE_METATABLE);
+    luaL_argcheck(L, !s->is_closed, index, "seekable reader cannot be used after it was closed");
+    luaL_argcheck(L, !s->is_busy, index, "seekable reader cannot be used by its read-at function");
+    return s;
+}
+
+/*
+** reads up to `size' bytes
+** of the compressed data at
+** `offset' into the input buffer.
+** 
+** Returns the number of bytes read,
+** which is less than `size' only
+** at the end of the data.
+*/
+static size_t lua_xz_seekable_fetch(lua_State *L, lua_xz_seekable *s, uint64_t offset, size_t size)
+{
+    FILE *f = s->file;
+    const char *data;
+    size_t read_bytes;
+    int status;
+
+    if (s->source == LUA_XZ_SEEKABLE_READ_AT)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, s->source_ref);
+        lua_pushinteger(L, (lua_Integer)offset);
+        lua_pushinteger(L, (lua_Integer)size);
+
+        /*
+        ** the reader stays busy until the
+        ** call returns, even on errors
+        */
+        s->is_busy = 1;
+        status = lua_pcall(L, 2, 1, 0);
+        s->is_busy = 0;
+
+        if (status != 0)
+        {
+            lua_error(L);
         }
-        else
+
+        read_bytes = 0;
+        if (!lua_isnil(L, -1))
         {
-            if (lzma_lzma_preset(&stream->opt_lzma, preset))
+            if (lua_type(L, -1) != LUA_TSTRING)
             {
-                return luaL_error(L, "Unsupported preset");
+                luaL_error(L, "the read-at function must return a string or nil");
             }
 
-            ret = lzma_alone_encoder(&stream->strm, (const lzma_options_lzma *)&stream->opt_lzma);
+            data = lua_tolstring(L, -1, &read_bytes);
+            if (read_bytes > size)
+            {
+                read_bytes = size;
+            }
+            memcpy(s->input_buffer, data, read_bytes);
+        }
 
-            if (ret != LZMA_OK)
+        lua_pop(L, 1);
+        return read_bytes;
+    }
+
+    if (s->source == LUA_XZ_SEEKABLE_FILE)
+    {
+        /* the file handle might have been closed meanwhile */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, s->source_ref);
+        f = lua_xz_aux_tofile(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if (lua_xz_aux_fseek64(f, offset) != 0)
+    {
+        luaL_error(L, "Failed to seek the compressed file");
+    }
+
+    read_bytes = fread(s->input_buffer, 1, size, f);
+    if (read_bytes < size && ferror(f))
+    {
+        luaL_error(L, "Failed to read the compressed file");
+    }
+
+    return read_bytes;
+}
+
+/*
+** decodes the stream footers and the
+** indexes of the compressed data,
+** seeking backwards from its end
+*/
+static void lua_xz_seekable_decode_index(lua_State *L, lua_xz_seekable *s)
+{
+    uint64_t position = 0;
+    size_t size;
+    lzma_ret ret = lzma_file_info_decoder(&s->strm, &s->index, s->memlimit, s->compressed_size);
+
+    while (ret == LZMA_OK)
+    {
+        if (s->strm.avail_in == 0)
+        {
+            size = s->buffer_size;
+            if (size > s->compressed_size - position)
             {
-                switch (ret)
-                {
-                case LZMA_MEM_ERROR:
-                    return luaL_error(L, "Memory allocation failed");
-                case LZMA_OPTIONS_ERROR:
-                    return luaL_error(L, "The given compression preset is not supported by this build of liblzma");
-                case LZMA_PROG_ERROR:
-                    return luaL_error(L, "One or more of the parameters have values that will never be valid");
-                default:
-                    return luaL_error(L, "Failed to create lzma_alone_encoder");
-                }
+                size = (size_t)(s->compressed_size - position);
             }
+
+            s->strm.next_in = s->input_buffer;
+            s->strm.avail_in = size > 0 ? lua_xz_seekable_fetch(L, s, position, size) : 0;
+            position += s->strm.avail_in;
+        }
+
+        ret = lzma_code(&s->strm, LZMA_RUN);
+        if (ret == LZMA_SEEK_NEEDED)
+        {
+            position = s->strm.seek_pos;
+            s->strm.avail_in = 0;
+            ret = LZMA_OK;
         }
     }
-    else
+
+    if (ret != LZMA_STREAM_END)
     {
-        arg_memlimit = luaL_checkinteger(L, 1);
-        luaL_argcheck(L, arg_memlimit == LUA_XZ_MEMLIMIT_UNLIMITED || arg_memlimit >= 0, 1, "memlimit must be an integer greater than or equal to 0");
+        luaL_error(L, "%s", lua_xz_stream_strerror(0, ret));
+    }
+}
+
+/*
+** sets up the decoder of the block
+** holding the uncompressed `offset'
+*/
+static void lua_xz_seekable_start_block(lua_State *L, lua_xz_seekable *s, uint64_t offset)
+{
+    lzma_index_iter iter;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block *block = &s->block;
+    size_t size;
+    lzma_ret ret;
+
+    s->block_active = 0;
+    s->output_size = 0;
 
-        if (arg_memlimit == LUA_XZ_MEMLIMIT_UNLIMITED)
+    lzma_index_iter_init(&iter, s->index);
+    if (lzma_index_iter_locate(&iter, offset))
+    {
+        luaL_error(L, "offset out of the uncompressed data");
+    }
+
+    /* the block header and the beginning of the compressed data */
+    size = s->buffer_size;
+    if (size > iter.block.total_size)
+    {
+        size = (size_t)iter.block.total_size;
+    }
+    size = lua_xz_seekable_fetch(L, s, iter.block.compressed_file_offset, size);
+
+    memset(block, 0, sizeof(lzma_block));
+    block->version = 1;
+    block->check = iter.stream.flags->check;
+    block->filters = filters;
+    block->header_size = size > 0 ? lzma_block_header_size_decode(s->input_buffer[0]) : 0;
+    filters[0].id = LZMA_VLI_UNKNOWN;
+
+    if (size == 0 || s->input_buffer[0] == 0x00 || block->header_size > size)
+    {
+        ret = LZMA_DATA_ERROR;
+    }
+    else
+    {
+        ret = lzma_block_header_decode(block, NULL, s->input_buffer);
+        if (ret == LZMA_OK)
         {
-            memlimit = UINT64_MAX;
+            ret = lzma_block_compressed_size(block, iter.block.unpadded_size);
         }
-        else if (arg_memlimit == 0)
+        if (ret == LZMA_OK && lzma_raw_decoder_memusage(filters) > s->memlimit)
         {
-            memlimit = 1;
+            ret = LZMA_MEMLIMIT_ERROR;
         }
-        else
+        if (ret == LZMA_OK)
         {
-            memlimit = (uint64_t)arg_memlimit;
+            ret = lzma_block_decoder(&s->strm, block);
         }
 
-        if (is_xz)
-        {
-            arg_flags = luaL_checkinteger(L, 2);
-            luaL_argcheck(L, arg_flags >= 0, 2, "flags must be an integer greater than or equal to 0");
+        /* the decoder keeps its own copy of the filter options */
+        lzma_filters_free(filters, NULL);
+    }
 
-            flags = (uint32_t)arg_flags;
+    /* the filters above do not outlive this call */
+    block->filters = NULL;
 
-            ret = lzma_stream_decoder(
-                &stream->strm,
-                memlimit,
-                flags);
-    
-            if (ret != LZMA_OK)
+    if (ret != LZMA_OK)
+    {
+        luaL_error(L, "%s", lua_xz_stream_strerror(0, ret));
+    }
+
+    s->strm.next_in = s->input_buffer + block->header_size;
+    s->strm.avail_in = size - block->header_size;
+    s->input_position = iter.block.compressed_file_offset + size;
+    s->input_end = iter.block.compressed_file_offset + iter.block.total_size;
+    s->output_position = iter.block.uncompressed_file_offset;
+    s->block_end = iter.block.uncompressed_file_offset + iter.block.uncompressed_size;
+    s->block_active = 1;
+}
+
+/*
+** refills the output buffer with the data
+** following the one it currently holds,
+** first moving the decoder to the block
+** holding `offset' when needed
+*/
+static void lua_xz_seekable_decode(lua_State *L, lua_xz_seekable *s, uint64_t offset)
+{
+    uint64_t position = s->output_position + s->output_size;
+    size_t size;
+    lzma_ret ret = LZMA_OK;
+
+    if (!s->block_active || offset < position || offset >= s->block_end)
+    {
+        lua_xz_seekable_start_block(L, s, offset);
+        position = s->output_position;
+    }
+
+    /*
+    ** reading the input might raise errors,
+    ** leaving the decoder in the middle of
+    ** the output buffer. Thus, the block is
+    ** only kept after the buffer is filled
+    */
+    s->block_active = 0;
+    s->output_position = position;
+    s->output_size = 0;
+    s->strm.next_out = s->output_buffer;
+    s->strm.avail_out = s->buffer_size;
+
+    while (ret == LZMA_OK && s->strm.avail_out > 0)
+    {
+        if (s->strm.avail_in == 0 && s->input_position < s->input_end)
+        {
+            size = s->buffer_size;
+            if (size > s->input_end - s->input_position)
             {
-                switch (ret)
-                {
-                case LZMA_MEM_ERROR:
-                    return luaL_error(L, "Memory allocation failed");
-                case LZMA_OPTIONS_ERROR:
-                    return luaL_error(L, "Unsupported decompressor flags");
-                default:
-                    return luaL_error(L, "Failed to create lzma_stream_decoder");
-                }
+                size = (size_t)(s->input_end - s->input_position);
+            }
+
+            size = lua_xz_seekable_fetch(L, s, s->input_position, size);
+            if (size == 0)
+            {
+                luaL_error(L, "%s", lua_xz_stream_strerror(0, LZMA_BUF_ERROR));
             }
+
+            s->strm.next_in = s->input_buffer;
+            s->strm.avail_in = size;
+            s->input_position += size;
         }
-        else
+
+        ret = lzma_code(&s->strm, LZMA_RUN);
+    }
+
+    s->output_size = s->buffer_size - s->strm.avail_out;
+
+    if (ret == LZMA_STREAM_END)
+    {
+        if (s->output_position + s->output_size != s->block_end)
         {
-            ret = lzma_alone_decoder(
-                &stream->strm,
-                memlimit);
-    
-            if (ret != LZMA_OK)
+            s->output_size = 0;
+            luaL_error(L, "%s", lua_xz_stream_strerror(0, LZMA_DATA_ERROR));
+        }
+    }
+    else if (ret == LZMA_OK)
+    {
+        s->block_active = 1;
+    }
+    else
+    {
+        s->output_size = 0;
+        luaL_error(L, "%s", lua_xz_stream_strerror(0, ret));
+    }
+}
+
+/*
+** pushes a seekable reader of the source
+** at index 1, with the options at index 2,
+** whose indexes are not decoded yet
+*/
+static lua_xz_seekable *lua_xz_seekable_open(lua_State *L)
+{
+    lzma_stream strm_init = LZMA_STREAM_INIT;
+    lua_xz_seekable *s;
+    lua_Integer arg_buffer_size = lua_xz_aux_optinteger(L, 2, "buffersize", LUA_XZ_SEEKABLE_BUFFER_SIZE);
+    lua_Integer arg_size = lua_xz_aux_optinteger(L, 2, "size", -1);
+    uint64_t memlimit = lua_xz_aux_optmemlimit(L, 2, "memlimit", UINT64_MAX);
+    size_t buffer_size;
+    int source;
+    void *ud;
+
+    if (lua_type(L, 1) == LUA_TSTRING)
+    {
+        source = LUA_XZ_SEEKABLE_PATH;
+    }
+    else if (lua_xz_aux_tofile(L, 1) != NULL)
+    {
+        source = LUA_XZ_SEEKABLE_FILE;
+    }
+    else if (lua_isfunction(L, 1))
+    {
+        source = LUA_XZ_SEEKABLE_READ_AT;
+        luaL_argcheck(L, arg_size >= 0, 2, "option size is required by a read-at function");
+    }
+    else
+    {
+        luaL_argerror(L, 1, "path, file or function expected");
+        return NULL;
+    }
+
+    /* the input buffer must hold the largest block header */
+    luaL_argcheck(L, arg_buffer_size >= LZMA_BLOCK_HEADER_SIZE_MAX && (uint64_t)arg_buffer_size <= (SIZE_MAX - sizeof(lua_xz_seekable)) / 2, 2, "buffersize must be an integer greater than or equal to 1024");
+    buffer_size = (size_t)arg_buffer_size;
+
+    ud = lua_newuserdata(L, sizeof(lua_xz_seekable) + 2 * buffer_size);
+    if (ud == NULL)
+    {
+        luaL_error(L, "Failed to create lua_xz_seekable userdata");
+        return NULL;
+    }
+
+    s = (lua_xz_seekable *)ud;
+    s->strm = strm_init;
+    s->index = NULL;
+    s->memlimit = memlimit;
+    s->source = source;
+    s->file = NULL;
+    s->source_ref = LUA_NOREF;
+    s->compressed_size = 0;
+    s->uncompressed_size = 0;
+    s->is_closed = 0;
+    s->is_busy = 0;
+    s->block_active = 0;
+    s->block_end = 0;
+    s->input_position = 0;
+    s->input_end = 0;
+    s->output_position = 0;
+    s->output_size = 0;
+    s->buffer_size = buffer_size;
+    s->input_buffer = s->output_buffer + buffer_size;
+
+    luaL_getmetatable(L, LUA_XZ_SEEKABLE_METATABLE);
+    lua_setmetatable(L, -2);
+
+    if (source == LUA_XZ_SEEKABLE_PATH)
+    {
+        s->file = fopen(lua_tostring(L, 1), "rb");
+        if (s->file == NULL)
+        {
+            luaL_error(L, "Failed to open %s for reading", lua_tostring(L, 1));
+            return NULL;
+        }
+        s->compressed_size = lua_xz_aux_fsize64(s->file);
+    }
+    else
+    {
+        lua_pushvalue(L, 1);
+        s->source_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        s->compressed_size = source == LUA_XZ_SEEKABLE_FILE ? lua_xz_aux_fsize64(lua_xz_aux_tofile(L, 1)) : (uint64_t)arg_size;
+    }
+
+    if (s->compressed_size == UINT64_MAX)
+    {
+        luaL_error(L, "Failed to get the size of the compressed file");
+        return NULL;
+    }
+
+    return s;
+}
+
+/*
+** creates a seekable reader over
+** a file path, a file handle or
+** a read-at function
+*/
+static int lua_xz_seekable_new(lua_State *L)
+{
+    lua_xz_seekable *s = lua_xz_seekable_open(L);
+
+    lua_xz_seekable_decode_index(L, s);
+    s->uncompressed_size = lzma_index_uncompressed_size(s->index);
+
+    return 1;
+}
+
+/*
+** reads `length' bytes of the
+** uncompressed data starting at
+** the 0-based `offset', decoding
+** only the blocks holding them
+*/
+static int lua_xz_seekable_read(lua_State *L)
+{
+    lua_xz_seekable *s = lua_xz_check_seekable(L, 1);
+    lua_Integer arg_offset = luaL_checkinteger(L, 2);
+    lua_Integer arg_length = luaL_checkinteger(L, 3);
+    uint64_t offset;
+    uint64_t remaining;
+    size_t skip;
+    size_t n;
+    luaL_Buffer B;
+
+    luaL_argcheck(L, arg_offset >= 0, 2, "offset must be greater than or equal to 0");
+    luaL_argcheck(L, arg_length >= 0, 3, "length must be greater than or equal to 0");
+
+    offset = (uint64_t)arg_offset;
+    remaining = (uint64_t)arg_length;
+
+    /* clamp the range to the uncompressed data */
+    if (offset >= s->uncompressed_size)
+    {
+        remaining = 0;
+    }
+    else if (remaining > s->uncompressed_size - offset)
+    {
+        remaining = s->uncompressed_size - offset;
+    }
+
+    luaL_buffinit(L, &B);
+
+    while (remaining > 0)
+    {
+        if (offset >= s->output_position && offset < s->output_position + s->output_size)
+        {
+            skip = (size_t)(offset - s->output_position);
+            n = s->output_size - skip;
+            if (n > remaining)
             {
-                switch (ret)
-                {
-                case LZMA_MEM_ERROR:
-                    return luaL_error(L, "Memory allocation failed");
-                case LZMA_OPTIONS_ERROR:
-                    return luaL_error(L, "Unsupported decompressor flags");
-                default:
-                    return luaL_error(L, "Failed to create lzma_alone_decoder");
-                }
+                n = (size_t)remaining;
             }
+
+            luaL_addlstring(&B, (const char *)s->output_buffer + skip, n);
+            offset += n;
+            remaining -= n;
+        }
+        else
+        {
+            lua_xz_seekable_decode(L, s, offset);
         }
     }
 
+    luaL_pushresult(&B);
     return 1;
 }
 
 /*
-** free the aux buffers created
-** during the execution of
-** `lua_xz_stream_exec' below
+** gets the size of the uncompressed data
 */
-#define lua_xz_stream_exec_free_aux_buffers(L,i) (lua_xz_aux_buffers_resize_input_buffer(L, (i), 0),lua_remove(L, (i)))
+static int lua_xz_seekable_size(lua_State *L)
+{
+    lua_xz_seekable *s = lua_xz_check_seekable(L, 1);
+    lua_pushinteger(L, (lua_Integer)s->uncompressed_size);
+    return 1;
+}
 
-/* 
-** this function follows the pattern
-** https://github.com/tukaani-project/xz/raw/c3cb1e53a114ac944f559fe7cac45dbf48cca156/doc/examples/01_compress_easy.c
-** to compress data, and
-** https://github.com/tukaani-project/xz/raw/c3cb1e53a114ac944f559fe7cac45dbf48cca156/doc/examples/02_decompress.c
-** to decompress data
-** 
-** on top of that,
-** we added a producer / consumer
-** pattern to the lzma_stream
+/*
+** releases the decoder, the indexes
+** and the source of `s'
 */
-static int lua_xz_stream_exec(lua_State *L)
+static void lua_xz_seekable_release(lua_State *L, lua_xz_seekable *s)
 {
-    lua_xz_stream *stream = lua_xz_check_active_stream(L, 1);
+    if (!s->is_closed)
+    {
+        lzma_end(&s->strm);
 
-    int buffers_index = 0;
+        if (s->index != NULL)
+        {
+            lzma_index_end(s->index, NULL);
+            s->index = NULL;
+        }
 
-    lzma_ret ret;
-    size_t write_size;
-    lzma_stream *s;
-    size_t produced_data_size = 0;
-    const char *produced_data;
-    int produced_data_type;
+        if (s->file != NULL)
+        {
+            fclose(s->file);
+            s->file = NULL;
+        }
 
-    /* 
-    ** input buffer allocated on stack, but
-    ** switch to a dynamically allocated
-    ** input buffer by `lua_xz_aux_buffers *b'
-    ** to be able to hold a copy to the
-    ** last produced data
-    */
-    uint8_t input_buffer[LUA_XZ_BUFFER_SIZE];
+        luaL_unref(L, LUA_REGISTRYINDEX, s->source_ref);
+        s->source_ref = LUA_NOREF;
 
-    /* 
-    ** dynamically allocated
-    ** (input and output) buffers to hold
-    ** data for the lzma_stream
-    */
-    lua_xz_aux_buffers *b;
+        /* prevent it from being called again */
+        s->is_closed = 1;
+    }
+}
 
-    /*
-    ** use LZMA_RUN until the producer function
-    ** returns nil or none, because
-    ** a produced nil or none signals
-    ** that it is time to finish the stream
-    ** by setting LZMA_FINISH
-    */
-    lzma_action action = LZMA_RUN;
+static int lua_xz_seekable_close(lua_State *L)
+{
+    lua_xz_seekable *s = (lua_xz_seekable *)luaL_checkudata(L, 1, LUA_XZ_SEEKABLE_METATABLE);
+    luaL_argcheck(L, !s->is_busy, 1, "seekable reader cannot be closed by its read-at function");
+    lua_xz_seekable_release(L, s);
+    return 0;
+}
 
-    lua_Integer arg_output_buffer_size;
-    size_t output_buffer_size;
+/*
+** sets the field `key' of the
+** table on the top of the stack
+** to the integer `value'
+*/
+static void lua_xz_info_setinteger(lua_State *L, const char *key, uint64_t value)
+{
+    lua_pushinteger(L, (lua_Integer)value);
+    lua_setfield(L, -2, key);
+}
 
-    /* prevent exec from running again */
-    stream->executed = 1;
+/*
+** pushes the information of the
+** .lzma file held by `s', from the
+** header already read into its buffer
+*/
+static void lua_xz_info_lzma(lua_State *L, lua_xz_seekable *s)
+{
+    lzma_filter filters[2];
+    lzma_options_lzma *opt_lzma;
+    uint64_t uncompressed_size = 0;
+    uint64_t memusage;
+    uint32_t d;
+    int i;
 
-    /*
-    ** validate buffer size to be able
-    ** to create the output buffer
-    ** of lua_xz_aux_buffers with correct size
-    */
-    if (lua_xz_aux_isinteger(L, 4))
+    filters[0].id = LZMA_FILTER_LZMA1;
+    filters[0].options = NULL;
+    filters[1].id = LZMA_VLI_UNKNOWN;
+    filters[1].options = NULL;
+    if (lzma_properties_decode(&filters[0], NULL, s->input_buffer, 5) != LZMA_OK)
     {
-        arg_output_buffer_size = lua_tointeger(L, 4);
+        luaL_error(L, "The input is not in the .xz or .lzma format");
+        return;
     }
-    else
+
+    /* the properties include the dictionary size */
+    opt_lzma = (lzma_options_lzma *)filters[0].options;
+    memusage = lzma_raw_decoder_memusage((const lzma_filter *)filters);
+
+    /* the little endian uncompressed size follows them */
+    for (i = 12; i >= 5; i--)
+    {
+        uncompressed_size = (uncompressed_size << 8) | s->input_buffer[i];
+    }
+
+    /*
+    ** reject what lzma_alone_decoder rejects:
+    ** dictionary sizes other than 2^n or
+    ** 2^n + 2^(n-1), and uncompressed sizes
+    ** of 256 GB or more
+    */
+    d = opt_lzma->dict_size - 1;
+    d |= d >> 2;
+    d |= d >> 3;
+    d |= d >> 4;
+    d |= d >> 8;
+    d |= d >> 16;
+    d++;
+    if ((opt_lzma->dict_size != UINT32_MAX && d != opt_lzma->dict_size) || (uncompressed_size != UINT64_MAX && uncompressed_size >= ((uint64_t)1 << 38)))
     {
-        arg_output_buffer_size = LUA_XZ_BUFFER_SIZE;
+        free(filters[0].options);
+        luaL_error(L, "The input is not in the .xz or .lzma format");
+        return;
     }
 
-    if (arg_output_buffer_size <= 0)
+    lua_createtable(L, 0, 8);
+
+    lua_pushliteral(L, "lzma");
+    lua_setfield(L, -2, "format");
+
+    lua_xz_info_setinteger(L, "compressed_size", s->compressed_size);
+
+    /* all ones means unknown (the data ends with an end marker) */
+    if (uncompressed_size != UINT64_MAX)
     {
-        return luaL_error(L, "Buffer size must be a positive integer");
+        lua_xz_info_setinteger(L, "uncompressed_size", uncompressed_size);
     }
 
-    output_buffer_size = (size_t)arg_output_buffer_size;
+    lua_xz_info_setinteger(L, "dict_size", opt_lzma->dict_size);
+    lua_xz_info_setinteger(L, "lc", opt_lzma->lc);
+    lua_xz_info_setinteger(L, "lp", opt_lzma->lp);
+    lua_xz_info_setinteger(L, "pb", opt_lzma->pb);
 
-    /* assert that producer is a function */
-    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (memusage != UINT64_MAX)
+    {
+        lua_xz_info_setinteger(L, "memusage", memusage);
+    }
 
-    /* assert that consumer is a function */
-    luaL_checktype(L, 3, LUA_TFUNCTION);
+    free(filters[0].options);
+}
 
-    /* create the aux buffers */
-    b = lua_xz_aux_buffers_new(L, output_buffer_size);
+/*
+** pushes the information of the
+** .xz file held by `s', from its
+** indexes and its block headers
+*/
+static void lua_xz_info_xz(lua_State *L, lua_xz_seekable *s)
+{
+    lzma_index_iter iter;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    uint64_t dict_size = 0;
+    uint64_t memusage = 0;
+    uint64_t block_memusage;
+    uint32_t checks;
+    size_t size;
+    lzma_ret ret;
+    int check;
+    int i;
 
-    buffers_index = lua_gettop(L);
+    lua_xz_seekable_decode_index(L, s);
 
-    s = &stream->strm;
+    lua_createtable(L, 0, 10);
 
-    s->next_in = NULL;
-    s->avail_in = 0;
-    s->next_out = b->output_buffer;
-    s->avail_out = b->output_buffer_size;
+    lua_pushliteral(L, "xz");
+    lua_setfield(L, -2, "format");
 
-    while (1)
-    {
-        if (s->avail_in == 0 && action != LZMA_FINISH)
-        {
-            /* push the producer function */
-            lua_pushvalue(L, 2);
-            
-            if (lua_pcall(L, 0, 1, 0) == 0)
-            {
-                produced_data_type = lua_type(L, -1);
+    lua_xz_info_setinteger(L, "compressed_size", s->compressed_size);
+    lua_xz_info_setinteger(L, "uncompressed_size", lzma_index_uncompressed_size(s->index));
 
-                if (produced_data_type == LUA_TNIL || produced_data_type == LUA_TNONE)
-                {
-                    s->next_in = NULL;
-                    s->avail_in = 0;
-                    action = LZMA_FINISH;
-                }
-                else if (produced_data_type == LUA_TSTRING)
-                {
-                    produced_data = lua_tolstring(L, -1, &produced_data_size);
+    /* the strongest check, when the streams differ */
+    checks = lzma_index_checks(s->index);
+    for (check = LZMA_CHECK_ID_MAX; check > 0 && (checks & (1U << check)) == 0; check--)
+    {
+    }
+    lua_xz_info_setinteger(L, "check", (uint64_t)check);
 
-                    if (produced_data_size > sizeof(input_buffer))
-                    {
-                        /* input buffer on stack is not enough, fallback to the dynamic buffer */
-
-                        if (b->input_buffer == NULL || produced_data_size > b->input_buffer_size)
-                        {
-                            /* dynamic input buffer is small, grow it and copy data */
-
-                            lua_xz_aux_buffers_resize_input_buffer(L, buffers_index, produced_data_size);
-                            s->next_in = b->input_buffer;
-                            s->avail_in = produced_data_size;
-                            memcpy((void *)b->input_buffer, (const void *)produced_data, produced_data_size);
-                        }
-                        else
-                        {
-                            /* dynamic input buffer is enough, copy data to it */
-
-                            s->next_in = b->input_buffer;
-                            s->avail_in = produced_data_size;
-                            memcpy((void *)b->input_buffer, (const void *)produced_data, produced_data_size);
-                        }
-                    }
-                    else
-                    {
-                        /* input buffer on stack is enough, copy data to it */
+    lua_xz_info_setinteger(L, "index_memusage", lzma_index_memusage(lzma_index_stream_count(s->index), lzma_index_block_count(s->index)));
 
-                        s->next_in = (uint8_t *)input_buffer;
-                        s->avail_in = produced_data_size;
-                        memcpy((void *)input_buffer, (const void *)produced_data, produced_data_size);
-                    }
-                }
-                else
-                {
-                    /* remove the produced data */
-                    lua_pop(L, 1);
-                    lua_xz_stream_exec_free_aux_buffers(L, buffers_index);
-                    return luaL_error(L, "Produced data must be a string or nil (to finish the stream)");
-                }
+    /* streams */
+    lua_createtable(L, (int)lzma_index_stream_count(s->index), 0);
+    lzma_index_iter_init(&iter, s->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM))
+    {
+        lua_createtable(L, 0, 7);
+        lua_xz_info_setinteger(L, "compressed_offset", iter.stream.compressed_offset);
+        lua_xz_info_setinteger(L, "compressed_size", iter.stream.compressed_size);
+        lua_xz_info_setinteger(L, "uncompressed_offset", iter.stream.uncompressed_offset);
+        lua_xz_info_setinteger(L, "uncompressed_size", iter.stream.uncompressed_size);
+        lua_xz_info_setinteger(L, "blocks", iter.stream.block_count);
+        lua_xz_info_setinteger(L, "padding", iter.stream.padding);
+        lua_xz_info_setinteger(L, "check", (uint64_t)iter.stream.flags->check);
+        lua_rawseti(L, -2, (int)iter.stream.number);
+    }
+    lua_setfield(L, -2, "streams");
 
-                /* remove the produced data */
-                lua_pop(L, 1);
-            }
-            else
-            {
-                lua_xz_stream_exec_free_aux_buffers(L, buffers_index);
-                return luaL_error(L, lua_tostring(L, -1));
-            }
+    /*
+    ** blocks, whose headers give
+    ** the filter chain of each one
+    */
+    lua_createtable(L, (int)lzma_index_block_count(s->index), 0);
+    lzma_index_iter_init(&iter, s->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+    {
+        size = LZMA_BLOCK_HEADER_SIZE_MAX;
+        if (size > iter.block.total_size)
+        {
+            size = (size_t)iter.block.total_size;
         }
+        size = lua_xz_seekable_fetch(L, s, iter.block.compressed_file_offset, size);
 
-        /* do the encoding / decoding */
-        ret = lzma_code(s, action);
+        memset(&block, 0, sizeof(lzma_block));
+        block.version = 1;
+        block.check = iter.stream.flags->check;
+        block.filters = filters;
+        block.header_size = size > 0 ? lzma_block_header_size_decode(s->input_buffer[0]) : 0;
+        filters[0].id = LZMA_VLI_UNKNOWN;
 
-        /* output buffer is full or compression finished successfully */
-        if (s->avail_out == 0 || ret == LZMA_STREAM_END)
+        if (size == 0 || s->input_buffer[0] == 0x00 || block.header_size > size)
         {
-            write_size = b->output_buffer_size - s->avail_out;
-
-            /* push the consumer function */
-            lua_pushvalue(L, 3);
-
-            /* push the arg of the consumer function */
-            lua_pushlstring(L, (const char *)b->output_buffer, write_size);
-
-            /* call the consumer function */
-            if (lua_pcall(L, 1, 0, 0) == 0)
-            {
-                s->next_out = b->output_buffer;
-                s->avail_out = b->output_buffer_size;
-            }
-            else
-            {
-                lua_xz_stream_exec_free_aux_buffers(L, buffers_index);
-                return luaL_error(L, lua_tostring(L, -1));
-            }
+            ret = LZMA_DATA_ERROR;
+        }
+        else
+        {
+            ret = lzma_block_header_decode(&block, NULL, s->input_buffer);
         }
 
         if (ret != LZMA_OK)
         {
-            lua_xz_stream_exec_free_aux_buffers(L, buffers_index);
+            luaL_error(L, "%s", lua_xz_stream_strerror(0, ret));
+            return;
+        }
 
-            if (ret == LZMA_STREAM_END)
-            {
-                return 0;
-            }
+        block_memusage = lzma_raw_decoder_memusage((const lzma_filter *)filters);
 
-            if (stream->is_writer)
+        lua_createtable(L, 0, 7);
+        lua_xz_info_setinteger(L, "stream", iter.stream.number);
+        lua_xz_info_setinteger(L, "compressed_offset", iter.block.compressed_file_offset);
+        lua_xz_info_setinteger(L, "compressed_size", iter.block.total_size);
+        lua_xz_info_setinteger(L, "uncompressed_offset", iter.block.uncompressed_file_offset);
+        lua_xz_info_setinteger(L, "uncompressed_size", iter.block.uncompressed_size);
+
+        /* the last filter of the chain is LZMA2 */
+        for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+        {
+            if (filters[i].id == LZMA_FILTER_LZMA2 && filters[i].options != NULL)
             {
-                switch (ret)
+                lua_xz_info_setinteger(L, "dict_size", ((const lzma_options_lzma *)filters[i].options)->dict_size);
+                if (((const lzma_options_lzma *)filters[i].options)->dict_size > dict_size)
                 {
-                case LZMA_MEM_ERROR:
-                    return luaL_error(L, "Memory allocation failed in the writer stream");
-                case LZMA_DATA_ERROR:
-                    return luaL_error(L, "File size limits exceeded");
-                default:
-                    return luaL_error(L, "Unknown error, possibly a bug in the writer stream");
+                    dict_size = ((const lzma_options_lzma *)filters[i].options)->dict_size;
                 }
             }
-            else
+        }
+        lzma_filters_free(filters, NULL);
+
+        if (block_memusage != UINT64_MAX)
+        {
+            lua_xz_info_setinteger(L, "memusage", block_memusage);
+            if (block_memusage > memusage)
             {
-                switch (ret)
-                {
-                case LZMA_MEM_ERROR:
-                    return luaL_error(L, "Memory allocation failed in the reader stream");
-                case LZMA_FORMAT_ERROR:
-                    return luaL_error(L, "The input is not in the .xz format");
-                case LZMA_OPTIONS_ERROR:
-                    return luaL_error(L, "Unsupported compression options");
-                case LZMA_DATA_ERROR:
-                    return luaL_error(L, "Compressed file is corrupt");
-                case LZMA_BUF_ERROR:
-                    return luaL_error(L, "Compressed file is truncated or otherwise corrupt");
-                default:
-                    return luaL_error(L, "Unknown error, possibly a bug in the reader stream");
-                }
+                memusage = block_memusage;
             }
         }
+
+        lua_rawseti(L, -2, (int)iter.block.number_in_file);
     }
+    lua_setfield(L, -2, "blocks");
 
-    return 0;
+    lua_xz_info_setinteger(L, "dict_size", dict_size);
+    lua_xz_info_setinteger(L, "memusage", memusage);
 }
 
-static int lua_xz_stream_xzwriter(lua_State *L)
+/*
+** gets the sizes and the settings of
+** a .xz or .lzma file, reading only
+** its headers and its indexes
+*/
+static int lua_xz_info(lua_State *L)
 {
-    return lua_xz_stream_new(L, 1, 1);
-}
+    static const uint8_t xz_magic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+    lua_xz_seekable *s = lua_xz_seekable_open(L);
+    size_t size;
 
-static int lua_xz_stream_xzreader(lua_State *L)
-{
-    return lua_xz_stream_new(L, 1, 0);
+    /* the .xz stream header or the .lzma header */
+    size = s->compressed_size < 13 ? (size_t)s->compressed_size : 13;
+    size = lua_xz_seekable_fetch(L, s, 0, size);
+
+    if (size >= sizeof(xz_magic) && memcmp(s->input_buffer, xz_magic, sizeof(xz_magic)) == 0)
+    {
+        lua_xz_info_xz(L, s);
+    }
+    else if (size == 13)
+    {
+        lua_xz_info_lzma(L, s);
+    }
+    else
+    {
+        return luaL_error(L, "The input is not in the .xz or .lzma format");
+    }
+
+    /* release the file right away */
+    lua_xz_seekable_release(L, s);
+    return 1;
 }
 
-static int lua_xz_stream_lzmawriter(lua_State *L)
+static int lua_xz_seekable_newindex(lua_State *L)
 {
-    return lua_xz_stream_new(L, 0, 1);
+    return luaL_error(L, "Read-only object");
 }
 
-static int lua_xz_stream_lzmareader(lua_State *L)
+static const luaL_Reg lua_xz_seekable_functions[] = {
+    {"close", lua_xz_seekable_close},
+    {"read", lua_xz_seekable_read},
+    {"size", lua_xz_seekable_size},
+    {"__gc", lua_xz_seekable_close},
+    {NULL, NULL}
+};
+
+#else
+
+static int lua_xz_seekable_new(lua_State *L)
 {
-    return lua_xz_stream_new(L, 0, 0);
+    return luaL_error(L, "seekable readers require liblzma 5.4 or newer");
 }
 
-static int lua_xz_stream_close(lua_State *L)
+static int lua_xz_info(lua_State *L)
 {
-    lua_xz_stream *stream = lua_xz_check_stream(L, 1);
-    if (!stream->is_closed)
-    {
-        /* free the lzma_stream */
-        lzma_end(&stream->strm);
-
-        /* prevent it from being called again */
-        stream->is_closed = 1;
-    }
-    return 0;
+    return luaL_error(L, "info requires liblzma 5.4 or newer");
 }
 
-static int lua_xz_stream_newindex(lua_State *L)
+static int lua_xz_seekable_newindex(lua_State *L)
 {
     return luaL_error(L, "Read-only object");
 }
 
-static const luaL_Reg lua_xz_stream_functions[] = {
-    {"close", lua_xz_stream_close},
-    {"exec", lua_xz_stream_exec},
-    {"lzmareader", lua_xz_stream_lzmareader},
-    {"lzmawriter", lua_xz_stream_lzmawriter},
-    {"xzreader", lua_xz_stream_xzreader},
-    {"xzwriter", lua_xz_stream_xzwriter},
-    {"__gc", lua_xz_stream_close},
+static const luaL_Reg lua_xz_seekable_functions[] = {
     {NULL, NULL}
 };
-/* end of lua_xz_stream */
+
+#endif
+/* end of lua_xz_seekable */
+
+static const luaL_Reg lua_xz_functions[] = {
+    { "allocated", lua_xz_allocated },
+    { "async", lua_xz_async_new },
+    { "compress", lua_xz_compress },
+    { "compress_file", lua_xz_compress_file },
+    { "compress_many", lua_xz_compress_many },
+    { "crc32", lua_xz_hasher_crc32 },
+    { "crc32sum", lua_xz_hasher_crc32sum },
+    { "crc64", lua_xz_hasher_crc64 },
+    { "crc64sum", lua_xz_hasher_crc64sum },
+    { "cputhreads", lua_xz_cputhreads },
+    { "decompress", lua_xz_decompress },
+    { "decompress_file", lua_xz_decompress_file },
+    { "decompress_many", lua_xz_decompress_many },
+    { "dictionary", lua_xz_dictionary_new },
+    { "info", lua_xz_info },
+    { "lzmacompress", lua_xz_lzmacompress },
+    { "lzmadecompress", lua_xz_lzmadecompress },
+    { "pool_trim", lua_xz_pool_trim },
+    { "seekable", lua_xz_seekable_new },
+    { "test", lua_xz_test },
+    { "test_file", lua_xz_test_file },
+    { NULL, NULL }
+};
 
 /* exporting the library */
 LUA_XZ_EXPORT int luaopen_xz(lua_State *L)
 {
+    const lua_xz_filter_info *filter_info;
+
     lua_createtable(L, 0, 0);
     luaL_newmetatable(L, LUA_XZ_METATABLE);
 
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, lua_xz_functions);
+#else
+    luaL_setfuncs(L, lua_xz_functions, 0);
+#endif
+
     /* start of lua_xz constants */
     lua_pushstring(L, "version");
     lua_pushstring(L, LUA_XZ_BINDING_VERSION);
@@ -755,6 +7247,14 @@ LUA_XZ_EXPORT int luaopen_xz(lua_State *L)
     lua_pushstring(L, "PRESET_DEFAULT");
     lua_pushinteger(L, LZMA_PRESET_DEFAULT);
     lua_settable(L, -3);
+
+    lua_pushstring(L, "SYNC_FLUSH");
+    lua_pushinteger(L, LZMA_SYNC_FLUSH);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "FULL_FLUSH");
+    lua_pushinteger(L, LZMA_FULL_FLUSH);
+    lua_settable(L, -3);
     /* start of lua_xz constants */
 
     /* start of lua_xz_check */
@@ -802,6 +7302,42 @@ LUA_XZ_EXPORT int luaopen_xz(lua_State *L)
     lua_settable(L, -3); /* lua_xz.check = lua_xz_check */
     /* end of lua_xz_check */
 
+    /* start of lua_xz_filter */
+    lua_pushstring(L, "filter");
+
+    lua_createtable(L, 0, 0);
+    luaL_newmetatable(L, LUA_XZ_FILTER_METATABLE);
+
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, lua_xz_filter_functions);
+#else
+    luaL_setfuncs(L, lua_xz_filter_functions, 0);
+#endif
+
+    for (filter_info = lua_xz_filter_infos; filter_info->name != NULL; filter_info++)
+    {
+        lua_pushstring(L, filter_info->key);
+        lua_pushstring(L, filter_info->name);
+        lua_settable(L, -3);
+    }
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, lua_xz_filter_newindex);
+    lua_settable(L, -3);
+
+    lua_setmetatable(L, -2); /* setmetatable(lua_xz_filter, LUA_XZ_FILTER_METATABLE) */
+
+    lua_settable(L, -3); /* lua_xz.filter = lua_xz_filter */
+    /* end of lua_xz_filter */
+
     /* start of lua_xz_stream */
     lua_pushstring(L, "stream");
 
@@ -831,6 +7367,140 @@ LUA_XZ_EXPORT int luaopen_xz(lua_State *L)
     lua_settable(L, -3); /* lua_xz.stream = lua_xz_stream */
     /* end of lua_xz_stream */
 
+    /* start of lua_xz_buffer_view */
+    luaL_newmetatable(L, LUA_XZ_BUFFER_VIEW_METATABLE);
+
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, lua_xz_buffer_view_functions);
+#else
+    luaL_setfuncs(L, lua_xz_buffer_view_functions, 0);
+#endif
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, lua_xz_buffer_view_newindex);
+    lua_settable(L, -3);
+
+    lua_pop(L, 1);
+    /* end of lua_xz_buffer_view */
+
+    /* start of lua_xz_dictionary */
+    luaL_newmetatable(L, LUA_XZ_DICTIONARY_METATABLE);
+
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, lua_xz_dictionary_functions);
+#else
+    luaL_setfuncs(L, lua_xz_dictionary_functions, 0);
+#endif
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, lua_xz_dictionary_newindex);
+    lua_settable(L, -3);
+
+    lua_pop(L, 1);
+    /* end of lua_xz_dictionary */
+
+    /* start of lua_xz_hasher */
+    luaL_newmetatable(L, LUA_XZ_HASHER_METATABLE);
+
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, lua_xz_hasher_functions);
+#else
+    luaL_setfuncs(L, lua_xz_hasher_functions, 0);
+#endif
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, lua_xz_hasher_newindex);
+    lua_settable(L, -3);
+
+    lua_pop(L, 1);
+    /* end of lua_xz_hasher */
+
+    /* start of lua_xz_async */
+    luaL_newmetatable(L, LUA_XZ_ASYNC_METATABLE);
+
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, lua_xz_async_functions);
+#else
+    luaL_setfuncs(L, lua_xz_async_functions, 0);
+#endif
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, lua_xz_async_newindex);
+    lua_settable(L, -3);
+
+    lua_pop(L, 1);
+    /* end of lua_xz_async */
+
+    /* start of lua_xz_batch */
+    luaL_newmetatable(L, LUA_XZ_BATCH_METATABLE);
+
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, lua_xz_batch_items_gc);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_settable(L, -3);
+
+    lua_pop(L, 1);
+    /* end of lua_xz_batch */
+
+    /* start of lua_xz_seekable */
+    luaL_newmetatable(L, LUA_XZ_SEEKABLE_METATABLE);
+
+#if LUA_VERSION_NUM < 502
+    luaL_register(L, NULL, lua_xz_seekable_functions);
+#else
+    luaL_setfuncs(L, lua_xz_seekable_functions, 0);
+#endif
+
+    lua_pushstring(L, "__index");
+    lua_pushvalue(L, -2);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcfunction(L, lua_xz_seekable_newindex);
+    lua_settable(L, -3);
+
+    lua_pop(L, 1);
+    /* end of lua_xz_seekable */
+
     lua_pushstring(L, "__index");
     lua_pushvalue(L, -2);
     lua_settable(L, -3);